@@ -0,0 +1,33 @@
+#pragma once
+
+#include "stdtypes.h"
+
+#define APP_SEGMENTS_MAX    4
+
+struct app_segment {
+    vaddr_t         vaddr;          // first mapped byte
+    uint32_t        file_size;      // bytes backed by the image
+    uint32_t        mem_size;       // mapped bytes (the rest is zero-filled)
+    uint32_t        flags;          // PAGE_R / PAGE_W / PAGE_X
+    const uint8_t   *data;          // segment bytes inside the embedded ELF
+};
+
+struct app_image {
+    int             id;                 // APP_ID_*
+    const char      *name;              // APP_NAME_*
+    const uint8_t   *elf;               // embedded ELF image
+    const char      *elf_size;          // linker symbol; its address is the size
+    bool            valid;              // loadable by this kernel (set by app_image_init)
+    vaddr_t         end;                // end of the highest segment
+    vaddr_t         text_start;         // read-only pages shared by every instance
+    vaddr_t         text_end;
+    const uint8_t   *text_data;         // page-aligned backing of text_start (NULL: not shareable)
+    int             segment_count;
+    struct app_segment segments[APP_SEGMENTS_MAX];
+};
+
+void app_image_init(void);
+const struct app_image *app_image_lookup(int app_id);
+uint32_t app_image_pages(const struct app_image *image);
+paddr_t app_image_shared_page(const struct app_image *image, vaddr_t page_vaddr);
+int app_image_fill_page(const struct app_image *image, vaddr_t page_vaddr, uint8_t *page, uint32_t *flags_out);
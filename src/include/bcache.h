@@ -0,0 +1,19 @@
+#pragma once
+
+#include "stdtypes.h"
+
+#define BCACHE_BLOCKS       64      // staged 512B blocks
+#define BCACHE_FLUSH_MS     1000    // kflushd period: upper bound on dirty data age
+
+struct bcache_stats {
+    uint32_t evictions;         // clean blocks dropped to make room
+    uint32_t dirty_blocks;      // blocks waiting for write-back
+    uint32_t flushes;           // write-back passes that wrote something
+    uint32_t blocks_flushed;
+    uint32_t errors;            // failed passes (their blocks stay dirty)
+};
+
+int bcache_write(uint32_t block_index, const void *in_block);
+int bcache_flush(void);
+void bcache_get_stats(struct bcache_stats *out);
+void bcache_start_flusher(void);
@@ -3,8 +3,26 @@
 #include "stdtypes.h"
 
 #define BLOCKDEV_BLOCK_SIZE 512
-#define BLOCKDEV_BLOCK_COUNT 256
+#define BLOCKDEV_SEG_MAX 32         // blocks per request (the device may allow fewer)
+#define BLOCKDEV_VEC_BATCH 8        // requests per blockdev_readv/writev submit
+
+// One request in a blockdev_submit() batch: block_index.. is read into / written
+// from buf, or from bufs[0..nblocks-1] (one block each) when bufs is set.
+// done/status belong to the driver.
+struct blockdev_io {
+    uint32_t        block_index;
+    void            *buf;           // BLOCKDEV_BLOCK_SIZE bytes
+    void *const     *bufs;
+    int             nblocks;
+    bool            write;
+    volatile bool   done;
+    uint8_t         status;         // virtio-blk status byte (0: ok)
+};
 
 void blockdev_init(void);
+uint32_t blockdev_block_count(void);
+int blockdev_submit(struct blockdev_io *ios, int count);
 int blockdev_read(uint32_t block_index, void *out_block);
 int blockdev_write(uint32_t block_index, const void *in_block);
+int blockdev_readv(uint32_t block_index, void *const *bufs, int count);
+int blockdev_writev(uint32_t block_index, const void *const *bufs, int count);
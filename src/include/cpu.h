@@ -0,0 +1,55 @@
+#pragma once
+
+#include "stdtypes.h"
+
+#define CPUS_MAX                4       // harts brought up by smp_start_secondaries()
+#define SMP_HART_ID_MAX         8       // hart ids probed with SBI HSM
+#define SMP_BOOT_STACK_PAGES    2       // idle/boot stack of a secondary hart
+
+struct process;
+
+// Per-hart state. tp always points at the running hart's entry in kernel mode,
+// and sscratch does while the hart runs in U-mode.
+// kernel_entry addresses the first three fields by offset.
+struct cpu {
+    uint32_t    boot_sp;            // initial sp of a secondary hart (secondary_entry loads offset 0)
+    uint32_t    kernel_sp;          // kernel stack top of the process running on this hart
+    uint32_t    trap_sp;            // sp at trap entry, until saved into the trap frame
+    int         id;                 // index in cpus[] (0: boot hart)
+    int         hart_id;            // SBI hart id
+    volatile bool online;           // finished bring-up
+    struct process *current;        // process running on this hart
+    struct process *idle;           // this hart's idle process (pid 0)
+    struct process *switch_prev;    // process being switched away from
+    bool        need_resched;       // yield at the next timer tick
+    bool        tick_stopped;       // periodic tick disarmed (tickless)
+    uint64_t    last_tick_time;     // slice accounting clock of this hart
+    int         irq_depth;          // irq_push_off() nesting
+    bool        irq_enabled;        // SIE before the outermost irq_push_off()
+    uint32_t    steals;             // times this hart took work from another hart's queue
+    uint32_t    migrations;         // processes moved onto this hart by stealing
+    uint32_t    idle_ms;            // time spent in the idle wfi
+    uint32_t    idle_rem;           // rdtime counts not yet folded into idle_ms
+};
+
+_Static_assert(offsetof(struct cpu, kernel_sp) == 4, "kernel_entry loads cpu->kernel_sp at 4(tp)");
+_Static_assert(offsetof(struct cpu, trap_sp) == 8, "kernel_entry uses cpu->trap_sp at 8(tp)");
+
+extern struct cpu cpus[CPUS_MAX];
+extern int cpu_count;
+
+static inline struct cpu *this_cpu(void) {
+    struct cpu *cpu;
+    __asm__ __volatile__("mv %0, tp" : "=r"(cpu));
+    return cpu;
+}
+
+static inline void cpu_set_this(struct cpu *cpu) {
+    __asm__ __volatile__("mv tp, %0" :: "r"(cpu) : "memory");
+}
+
+void cpu_init_boot(int hart_id);
+void smp_start_secondaries(void);
+void smp_send_ipi(struct cpu *cpu);
+void enable_ipi(void);
+void clear_ipi(void);
@@ -6,7 +6,7 @@
 #define FS_NAME_MAX      16
 #define FS_FD_MAX        16
 #define FS_MAX_NODES     128
-#define FS_FILE_MAX_SIZE 512
+#define FS_FILE_MAX_SIZE (135 * 512)   // pfs: 7 direct + 128 indirect block pointers
 
 #define FS_TYPE_FILE 1
 #define FS_TYPE_DIR  2
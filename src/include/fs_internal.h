@@ -2,18 +2,35 @@
 
 #include "fs.h"
 
+// pfs write-back counters (/proc/pfs)
+struct pfs_stats {
+    uint32_t syncs;             // write-back passes
+    uint32_t blocks_written;
+    uint32_t bytes_written;
+    uint32_t last_sync_bytes;   // bytes written by the latest pass
+    uint32_t errors;            // passes that failed (their blocks stay dirty)
+    uint32_t dirty_blocks;      // blocks waiting for the next pass
+    uint32_t used_blocks;       // volume blocks in use (metadata included)
+    uint32_t total_blocks;      // volume size
+};
+
 void fs_init(void);
 int fs_fork_copy_fds(int parent_pid, int child_pid);
 int fs_open(int pid, const char *path, int flags);
 int fs_close(int pid, int fd);
 int fs_read(int pid, int fd, void *buf, size_t size);
 int fs_write(int pid, int fd, const void *buf, size_t size);
-int fs_mkdir(const char *path);
-int fs_readdir(const char *path, int index, struct fs_dirent *out);
-int fs_unlink(const char *path);
-int fs_rmdir(const char *path);
+int fs_mkdir(int pid, const char *path);
+int fs_readdir(int pid, const char *path, int index, struct fs_dirent *out);
+int fs_unlink(int pid, const char *path);
+int fs_rmdir(int pid, const char *path);
+int fs_fsync(int pid, int fd);
+int fs_writeback(void);
+int fs_sync(void);
 void fs_on_process_recycle(int pid);
-uint32_t fs_get_pfs_image_blocks(void);
+uint32_t fs_get_pfs_volume_blocks(void);
+uint32_t fs_get_pfs_used_blocks(void);
+void fs_get_pfs_stats(struct pfs_stats *out);
 int fs_dup2(int pid, int old_fd, int new_fd);
 int fs_get_root_entry(int *mount_idx, int *node_idx);
-int fs_get_path_entry(int *mount_idx, int *node_idx, const char *path);
\ No newline at end of file
+int fs_get_path_entry(int pid, int *mount_idx, int *node_idx, const char *path);
\ No newline at end of file
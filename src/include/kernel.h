@@ -49,7 +49,9 @@
 // 0x0e: Reserved
 #define SCAUSE_STORE_AMO_PAGE_FAULT             0x0f
 
+#define SCAUSE_SUPERVISOR_SOFTWARE              0x80000001
 #define SCAUSE_SUPERVISOR_TIMER                 0x80000005
+#define SCAUSE_SUPERVISOR_EXTERNAL              0x80000009
 
 
 // trap frame structure
@@ -89,6 +91,7 @@ struct trap_frame {
 
 #define KERNEL_BASE 0x80200000
 #define USER_BASE 0x1000000
+#define USER_END  0x1800000     // user.ld keeps every image below this
 #define MMIO_BASE 0x10000000
 #define MMIO_END  0x10010000
 #define SSTATUS_SPIE (1 << 5)
@@ -110,10 +113,12 @@ struct kernel_info {
     uint32_t ramfs_size_max;
     uint32_t pfs_block_size;
     uint32_t pfs_block_count;
-    uint32_t pfs_image_blocks;
-    uint32_t pfs_image_bytes;
+    uint32_t pfs_used_blocks;
+    uint32_t pfs_used_bytes;
+    uint32_t cpu_count;
 };
 
 void user_entry(void);
 __attribute__((noreturn)) void kernel_shutdown(void);
+__attribute__((noreturn)) void kernel_secondary_main(void);
 void kernel_get_info(struct kernel_info *out);
@@ -2,7 +2,8 @@
 
 #include "stdtypes.h"
 
-#define PAGE_SIZE   4096
+#define PAGE_SIZE       4096
+#define MEGAPAGE_SIZE   (4 * 1024 * 1024)   // Sv32 level-1 leaf
 
 #define SATP_SV32   (1u << 31)      // Sv32 Mode Flag
 #define PAGE_V      (1 << 0)        // enable bit
@@ -10,10 +11,34 @@
 #define PAGE_W      (1 << 2)        // writable
 #define PAGE_X      (1 << 3)        // executable
 #define PAGE_U      (1 << 4)        // accessable from U-Mode
+#define PAGE_COW    (1 << 8)        // RSW: read-only shared, copy on first write
+
+#define PTE_PADDR(pte)  ((paddr_t) (((pte) >> 10) * PAGE_SIZE))
+#define PTE_FLAGS(pte)  ((pte) & 0x3ff)
+
+#define BUDDY_MAX_ORDER     10      // largest free block: 2^10 pages (4 MiB)
+#define BUDDY_ORDER_NONE    0xff
+
+struct memory_stats {
+    uint32_t total_pages;                       // pages in free ram (incl. allocator metadata)
+    uint32_t managed_pages;                     // pages handed out by alloc_pages()
+    uint32_t free_pages;                        // currently free managed pages
+    uint32_t free_blocks[BUDDY_MAX_ORDER + 1];  // free block count per order
+};
 
 uint32_t memory_init(void);
 paddr_t alloc_pages(uint32_t n);
 void free_pages(paddr_t paddr, uint32_t n);
 void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags);
+uint32_t *lookup_pte(uint32_t *table1, uint32_t vaddr);
+void kernel_vm_init(void);
+void map_kernel_space(uint32_t *table1);
+uint32_t *kernel_page_table(void);
+bool is_kernel_pde(const uint32_t *table1, uint32_t vpn1);
+void page_ref_inc(paddr_t paddr);
+uint32_t page_ref_dec(paddr_t paddr);
+uint32_t page_ref_count(paddr_t paddr);
+bool is_managed_page(paddr_t paddr);
 int bitmap_page_state(int index);
 int bitmap_page_count(void);
+void memory_get_stats(struct memory_stats *out);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "stdtypes.h"
+
+#define PLIC_BASE           0x0c000000u
+#define PLIC_MMIO_END       0x0c400000u     // priorities, pending/enable bits, contexts 0..511
+#define PLIC_IRQ_MAX        64
+
+// QEMU virt interrupt sources
+#define VIRTIO0_IRQ         1       // virtio-mmio slot i raises VIRTIO0_IRQ + i
+#define UART0_IRQ           10
+
+typedef void (*plic_handler_t)(void);
+
+void plic_register(uint32_t irq, plic_handler_t handler);
+void plic_init_hart(void);
+void plic_handle_irq(void);
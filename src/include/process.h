@@ -2,6 +2,9 @@
 
 #include "stdtypes.h"
 #include "fs.h"
+#include "app_image.h"
+#include "cpu.h"
+#include "spinlock.h"
 
 #define PROCS_MAX     64
 #define PROC_NAME_MAX 16
@@ -19,10 +22,30 @@
 #define PROC_WAIT_CONSOLE_INPUT 1
 #define PROC_WAIT_CHILD_EXIT    2
 #define PROC_WAIT_IPC_RECV      3
+#define PROC_WAIT_TIMER         4
+#define PROC_WAIT_BLOCK_IO      5
+#define PROC_WAIT_REASON_MAX    6
 
-#define SCHED_TIME_SLICE_TICKS  3
+#define SCHED_TIME_SLICE_TICKS  3       // slice at level 0, doubled per lower level
+#define SCHED_LEVELS            3       // MLFQ levels (0: highest priority)
+#define SCHED_NICE_MAX          (SCHED_LEVELS - 1)
+#define SCHED_BOOST_TICKS       100     // every process returns to its nice level
 
 
+struct process;
+
+// Intrusive FIFO of processes (run queue, wait queues, exited list).
+struct proc_queue {
+    struct process *head;
+    struct process *tail;
+    uint32_t length;
+};
+
+// Processes blocked on one event (console input, a mailbox, a child exit, ...).
+struct wait_queue {
+    struct proc_queue waiters;
+};
+
 struct process {
     int         pid;                    // process id
     int         state;                  // process status
@@ -30,15 +53,32 @@ struct process {
     int         wait_reason;            // why this process is waiting
     int         wait_pid;               // target child pid for waitpid (-1:any)
     int         parent_pid;             // parent pid (0: no parent)
-    uint32_t    user_pages;             // mapped user pages count
+    uint32_t    user_pages;             // user address space size in pages
+    const struct app_image *image;      // demand-paging source for user pages
+    void        (*kthread_fn)(void);    // kernel thread body (NULL: user process)
     vaddr_t     sp;                     // sp for context switch
     uint32_t    *page_table;            // page table
     uint32_t    time_slice;             // remaining time slice ticks
     uint32_t    run_ticks;              // accumulated running ticks
     uint32_t    schedule_count;         // how many times scheduled in
+    int         sched_level;            // MLFQ level (0: highest priority)
+    int         nice;                   // best level this process may hold
+    uint32_t    wait_ticks;             // accumulated ticks spent runnable but not running
+    uint32_t    runnable_since;         // tick when last queued on a run queue
+    struct proc_queue *queue;           // queue this process is linked on (NULL: none)
+    struct process *queue_prev;         // queue links
+    struct process *queue_next;
+    struct cpu  *cpu;                   // hart running this process (NULL: not on a cpu)
+    int         last_cpu;               // cpus[] index whose run queue this process belongs to
+    bool        killed;                 // kill requested while running on another hart
+    bool        in_syscall;             // inside a blocking syscall (handle_syscall)
+    uint64_t    wakeup_time;            // timer deadline (rdtime) while timer_index != 0
+    int         timer_index;            // position in the sleep heap (0: no timer armed)
     int         ipc_has_message;        // single-slot mailbox state
     int         ipc_from_pid;           // mailbox sender pid
     uint32_t    ipc_message;            // mailbox payload
+    struct wait_queue ipc_waiters;      // blocked in ipc_recv on this mailbox
+    struct wait_queue child_exit_waiters; // blocked in waitpid for a child of this process
     int         exec_argc;              // argc for current image
     char        exec_argv[PROC_EXEC_ARGV_MAX][PROC_EXEC_ARG_LEN];
     int         root_mount_idx;         // root mount index
@@ -61,34 +101,53 @@ struct ps_info {
     int  state;
     int  wait_reason;
     char name[PROC_NAME_MAX];
+    int  priority;          // MLFQ level (0: highest)
+    int  nice;
+    uint32_t wait_ticks;    // ticks spent waiting for the cpu
 };
 
 struct trap_frame;
 
 
 extern struct process procs[PROCS_MAX];
-extern struct process *current_proc;
-extern struct process *idle_proc;
 extern struct process *init_proc;
 
+// process running on the calling hart
+#define current_proc (this_cpu()->current)
+
 void switch_context(uint32_t *prev_sp, uint32_t *next_sp);
-struct process *create_process(const void *image, size_t image_size, const char *name);
-void wakeup_input_waiters(void);
-void notify_child_exit(struct process *child);
-void orphan_children(int parent_pid);
+struct process *create_process(const struct app_image *image, const char *name);
+struct process *process_create_idle(void);
+struct process *process_create_kthread(const char *name, void (*fn)(void));
+void wait_queue_sleep(struct wait_queue *wq, int wait_reason, int wait_pid, struct spinlock *lk);
+void wait_queue_wake_one(struct wait_queue *wq);
+void wait_queue_wake_all(struct wait_queue *wq);
+bool process_can_block(void);
+__attribute__((noreturn)) void process_exit(void);
+void process_exit_if_killed(void);
+void process_sleep_until(uint64_t deadline);
+void scheduler_expire_timers(void);
 int wait_for_child_exit(int parent_pid, int target_pid);
 void scheduler_on_timer_tick(void);
+void scheduler_start_process(void);
+void scheduler_program_timer(void);
 bool scheduler_should_yield(void);
+uint32_t scheduler_runqueue_length(void);
+int process_set_nice(int pid, int nice);
 int process_ipc_send(int src_pid, int dst_pid, uint32_t message);
 int process_ipc_recv(int self_pid, int *from_pid, uint32_t *message);
 int process_kill(int target_pid);
 int process_fork(struct trap_frame *parent_tf);
-int process_exec(const void *image,
-                 size_t image_size,
-                 const char *name,
+int process_exec(const struct app_image *image,
                  int argc,
                  const char argv[PROC_EXEC_ARGV_MAX][PROC_EXEC_ARG_LEN]);
-struct process *process_from_trap_frame(struct trap_frame *f);
+int process_handle_page_fault(struct process *proc, uint32_t scause, vaddr_t addr);
 int procfs_sync_process(const struct process *proc);
 int procfs_cleanup(const struct process *proc);
+int procfs_sync_meminfo(int pid);
+int procfs_sync_sched(int pid);
+int procfs_sync_cpus(int pid);
+int procfs_sync_pfs(int pid);
+int procfs_sync_bcache(int pid);
+int procfs_on_open(int pid, const char *name);
 void yield(void);
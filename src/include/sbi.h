@@ -1,5 +1,20 @@
 #pragma once
 
+// SBI extension / function ids
+#define SBI_EXT_BASE                0x10
+#define SBI_BASE_PROBE_EXTENSION    3
+#define SBI_EXT_IPI                 0x735049    // "sPI"
+#define SBI_IPI_SEND_IPI            0
+#define SBI_EXT_HSM                 0x48534d    // "HSM"
+#define SBI_HSM_HART_START          0
+#define SBI_EXT_DBCN                0x4442434e  // "DBCN"
+#define SBI_DBCN_CONSOLE_WRITE      0
+
+// SBI error codes
+#define SBI_SUCCESS                 0
+#define SBI_ERR_INVALID_PARAM       -3
+#define SBI_ERR_ALREADY_AVAILABLE   -6
+
 struct sbiret {
     long error;
     long value;
@@ -8,4 +23,10 @@ struct sbiret {
 struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3,
                        long arg4, long arg5, long fid, long eid);
 
+void sbi_console_putchar(char ch);
+long sbi_console_getchar(void);
+long sbi_debug_console_write(const void *buf, unsigned long len);
 void sbi_shutdown(void);
+long sbi_probe_extension(long eid);
+long sbi_hart_start(unsigned long hart_id, unsigned long start_addr, unsigned long opaque);
+long sbi_send_ipi(unsigned long hart_mask, unsigned long hart_mask_base);
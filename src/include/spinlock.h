@@ -0,0 +1,22 @@
+#pragma once
+
+#include "stdtypes.h"
+
+struct cpu;
+
+struct spinlock {
+    volatile uint32_t locked;
+    struct cpu  *owner;             // holding hart (NULL: free)
+    uint32_t    depth;              // nesting count for spin_lock_recursive()
+    const char  *name;
+};
+
+#define SPINLOCK_INIT(lock_name) { .locked = 0, .owner = NULL, .depth = 0, .name = (lock_name) }
+
+void irq_push_off(void);
+void irq_pop_off(void);
+void spin_lock(struct spinlock *lk);
+void spin_unlock(struct spinlock *lk);
+void spin_lock_recursive(struct spinlock *lk);
+void spin_unlock_recursive(struct spinlock *lk);
+bool spin_holding(const struct spinlock *lk);
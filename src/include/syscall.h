@@ -31,7 +31,11 @@
 #define SYSCALL_GETROOTFS   26
 #define SYSCALL_GETCWD      27
 #define SYSCALL_CHDIR       28
+#define SYSCALL_NICE        29
+#define SYSCALL_SLEEP_NS    30
+#define SYSCALL_FSYNC       31
+#define SYSCALL_SYNC        32
 
 
-void handle_syscall(struct trap_frame *f);
 void poll_console_input(void);
+void console_receive(const char *buf, int len);
@@ -1,9 +1,17 @@
 #pragma once
 
-#define TIMER_INTERVAL 200000  // 20ms
+#include "stdtypes.h"
+
+#define TIMER_FREQ_HZ  10000000    // QEMU virt timebase
+#define TIMER_INTERVAL 200000      // 20ms
+#define TIMER_NS_PER_COUNT (1000000000 / TIMER_FREQ_HZ)
 
 
 void enable_timer_interrupt(void);
 static inline uint64_t rdtime(void);
 static inline void wrtimecmp(uint64_t val);
 void timer_set_next();
+void timer_arm_at(uint64_t deadline);
+uint64_t timer_now(void);
+void timer_disarm(void);
+uint32_t timer_consume_ticks(uint64_t *last_tick_time);
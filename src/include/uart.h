@@ -0,0 +1,11 @@
+#pragma once
+
+#include "stdtypes.h"
+
+#define UART0_BASE          0x10000000u     // ns16550a on QEMU virt
+#define UART_FIFO_SIZE      16
+#define UART_TX_BUF_SIZE    1024
+
+int uart_init(void);
+bool uart_active(void);
+void console_write(const char *buf, size_t len);
@@ -41,3 +41,12 @@
 
 #define APP_ID_BITMAP       15
 #define APP_NAME_BITMAP     "bitmap"
+
+#define APP_ID_NICE         16
+#define APP_NAME_NICE       "nice"
+
+#define APP_ID_SLEEP        17
+#define APP_NAME_SLEEP      "sleep"
+
+#define APP_ID_SYNC         18
+#define APP_NAME_SYNC       "sync"
@@ -0,0 +1,218 @@
+#include "bcache.h"
+#include "blockdev.h"
+#include "fs_internal.h"
+#include "kernel.h"
+#include "commonlibs.h"
+#include "process.h"
+#include "spinlock.h"
+#include "timer.h"
+
+struct bcache_buf {
+    bool        valid;
+    bool        dirty;
+    bool        pinned;         // staged by the running flush: not evictable
+    uint32_t    block_index;
+    uint32_t    last_use;       // LRU stamp
+    uint8_t     data[BLOCKDEV_BLOCK_SIZE];
+};
+
+static struct bcache_buf bcache_bufs[BCACHE_BLOCKS];
+static uint32_t bcache_clock;
+static struct bcache_stats bcache_stats;
+// Guards the buffers. Never held across block I/O: a flush writes a staged copy,
+// so writers only wait for the disk when every buffer is dirty.
+static struct spinlock bcache_lock = SPINLOCK_INIT("bcache");
+static bool bcache_flushing;
+static struct wait_queue bcache_flush_waiters;
+
+// One flush at a time (bcache_flushing), so the staging area can be static.
+static uint8_t flush_data[BCACHE_BLOCKS][BLOCKDEV_BLOCK_SIZE];
+static uint32_t flush_blocks[BCACHE_BLOCKS];
+static struct bcache_buf *flush_bufs[BCACHE_BLOCKS];
+
+static struct bcache_buf *bcache_lookup_locked(uint32_t block_index) {
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        struct bcache_buf *b = &bcache_bufs[i];
+        if (b->valid && b->block_index == block_index) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// A free buffer, else the least recently used clean one. NULL: everything is dirty
+// or being flushed.
+static struct bcache_buf *bcache_victim_locked(void) {
+    struct bcache_buf *victim = NULL;
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        struct bcache_buf *b = &bcache_bufs[i];
+        if (!b->valid) {
+            return b;
+        }
+        if (b->dirty || b->pinned) {
+            continue;
+        }
+        if (!victim || b->last_use - victim->last_use > 0x7fffffffu) {
+            victim = b;
+        }
+    }
+    if (victim) {
+        bcache_stats.evictions++;
+    }
+    return victim;
+}
+
+static void bcache_fill_locked(struct bcache_buf *b, uint32_t block_index, const void *data) {
+    b->valid = true;
+    b->block_index = block_index;
+    b->last_use = ++bcache_clock;
+    memcpy(b->data, data, BLOCKDEV_BLOCK_SIZE);
+}
+
+// Whole-block write into the cache; the disk sees it on the next flush.
+int bcache_write(uint32_t block_index, const void *in_block) {
+    if (!in_block || block_index >= blockdev_block_count()) {
+        return -1;
+    }
+
+    spin_lock(&bcache_lock);
+    for (;;) {
+        struct bcache_buf *b = bcache_lookup_locked(block_index);
+        if (!b) {
+            b = bcache_victim_locked();
+        }
+        if (b) {
+            if (!b->dirty) {
+                bcache_stats.dirty_blocks++;
+            }
+            bcache_fill_locked(b, block_index, in_block);
+            b->dirty = true;
+            break;
+        }
+
+        // every buffer is dirty: write them back to make room
+        spin_unlock(&bcache_lock);
+        if (bcache_flush() < 0) {
+            return -1;
+        }
+        spin_lock(&bcache_lock);
+    }
+    spin_unlock(&bcache_lock);
+    return 0;
+}
+
+static void bcache_sort_staged(int n) {
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && flush_blocks[j - 1] > flush_blocks[j]; j--) {
+            uint32_t block = flush_blocks[j];
+            flush_blocks[j] = flush_blocks[j - 1];
+            flush_blocks[j - 1] = block;
+            struct bcache_buf *b = flush_bufs[j];
+            flush_bufs[j] = flush_bufs[j - 1];
+            flush_bufs[j - 1] = b;
+        }
+    }
+}
+
+// Write every dirty block back. Dirty buffers are copied to the staging area and
+// marked clean under the lock, then written in ascending block runs (one vectored
+// request each) without it; writes arriving meanwhile dirty the buffer again and
+// go out with the next flush. A caller that finds a flush in flight waits for it
+// and then flushes what is still dirty, so everything written before the call is
+// on disk when it returns 0.
+int bcache_flush(void) {
+    spin_lock(&bcache_lock);
+    while (bcache_flushing) {
+        if (!process_can_block()) {
+            spin_unlock(&bcache_lock);
+            return -1;
+        }
+        wait_queue_sleep(&bcache_flush_waiters, PROC_WAIT_BLOCK_IO, -1, &bcache_lock);
+    }
+
+    int n = 0;
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        struct bcache_buf *b = &bcache_bufs[i];
+        if (!b->valid || !b->dirty) {
+            continue;
+        }
+        flush_bufs[n] = b;
+        flush_blocks[n] = b->block_index;
+        n++;
+    }
+    if (n == 0) {
+        spin_unlock(&bcache_lock);
+        return 0;
+    }
+    bcache_sort_staged(n);
+    for (int i = 0; i < n; i++) {
+        struct bcache_buf *b = flush_bufs[i];
+        memcpy(flush_data[i], b->data, BLOCKDEV_BLOCK_SIZE);
+        b->dirty = false;
+        b->pinned = true;
+    }
+    bcache_stats.dirty_blocks -= (uint32_t) n;
+    bcache_flushing = true;
+    spin_unlock(&bcache_lock);
+
+    int ret = 0;
+    for (int i = 0; i < n && ret == 0;) {
+        const void *run[BLOCKDEV_SEG_MAX];
+        int len = 0;
+        while (i + len < n && len < BLOCKDEV_SEG_MAX &&
+               flush_blocks[i + len] == flush_blocks[i] + (uint32_t) len) {
+            run[len] = flush_data[i + len];
+            len++;
+        }
+        ret = blockdev_writev(flush_blocks[i], run, len);
+        i += len;
+    }
+
+    spin_lock(&bcache_lock);
+    for (int i = 0; i < n; i++) {
+        struct bcache_buf *b = flush_bufs[i];
+        b->pinned = false;
+        // a failed block stays dirty unless a newer write already did that
+        if (ret < 0 && !b->dirty) {
+            b->dirty = true;
+            bcache_stats.dirty_blocks++;
+        }
+    }
+    if (ret < 0) {
+        bcache_stats.errors++;
+    } else {
+        bcache_stats.flushes++;
+        bcache_stats.blocks_flushed += (uint32_t) n;
+    }
+    bcache_flushing = false;
+    spin_unlock(&bcache_lock);
+    wait_queue_wake_all(&bcache_flush_waiters);
+    return ret;
+}
+
+void bcache_get_stats(struct bcache_stats *out) {
+    spin_lock(&bcache_lock);
+    *out = bcache_stats;
+    spin_unlock(&bcache_lock);
+}
+
+static void bcache_flusher_main(void) {
+    const uint64_t period = (uint64_t) BCACHE_FLUSH_MS * (TIMER_FREQ_HZ / 1000);
+    for (;;) {
+        process_sleep_until(timer_now() + period);
+        if (fs_writeback() < 0) {
+            printf("[bcache] fs write-back failed\n");
+        }
+        if (bcache_stats.dirty_blocks > 0 && bcache_flush() < 0) {
+            printf("[bcache] write-back failed\n");
+        }
+    }
+}
+
+// kflushd: every BCACHE_FLUSH_MS, pulls pending fs changes into the cache and
+// writes the dirty blocks back.
+void bcache_start_flusher(void) {
+    if (!process_create_kthread("kflushd", bcache_flusher_main)) {
+        PANIC("no process slot for kflushd");
+    }
+}
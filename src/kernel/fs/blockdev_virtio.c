@@ -2,6 +2,9 @@
 #include "kernel.h"
 #include "stdtypes.h"
 #include "commonlibs.h"
+#include "process.h"
+#include "spinlock.h"
+#include "plic.h"
 
 #define VIRTIO_MMIO_BASE       0x10001000u
 #define VIRTIO_MMIO_STRIDE     0x1000u
@@ -20,6 +23,8 @@
 #define VIRTIO_MMIO_QUEUE_NUM      0x038
 #define VIRTIO_MMIO_QUEUE_READY    0x044
 #define VIRTIO_MMIO_QUEUE_NOTIFY   0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS 0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK  0x064
 #define VIRTIO_MMIO_STATUS         0x070
 #define VIRTIO_MMIO_QUEUE_DESC_LOW  0x080
 #define VIRTIO_MMIO_QUEUE_DESC_HIGH 0x084
@@ -41,10 +46,13 @@
 
 #define VIRTQ_DESC_F_NEXT  1u
 #define VIRTQ_DESC_F_WRITE 2u
+#define VIRTQ_DESC_F_INDIRECT 4u
+#define VIRTQ_USED_F_NO_NOTIFY 1u
 
 #define VIRTIO_BLK_T_IN  0u
 #define VIRTIO_BLK_T_OUT 1u
 
+#define VIRTIO_BLK_F_SEG_MAX       2
 #define VIRTIO_BLK_F_RO            5
 #define VIRTIO_BLK_F_SCSI          7
 #define VIRTIO_BLK_F_CONFIG_WCE    11
@@ -54,9 +62,11 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX    29
 
-#define VQ_NUM 8
+#define VQ_NUM 64
 #define VQ_ALIGN 4096
 #define VQ_BYTES (2 * VQ_ALIGN)
+#define VQ_DIRECT_MAX 4         // longer chains go through an indirect table when negotiated
+#define VQ_INDIRECT_LEN (BLOCKDEV_SEG_MAX + 2)
 #define VIRTIO_IO_SPIN_LIMIT 30000000u
 
 struct virtq_desc {
@@ -91,21 +101,40 @@ struct virtio_blk_req_hdr {
     uint64_t sector;
 } __attribute__((packed));
 
+_Static_assert(sizeof(struct virtq_desc) * VQ_NUM + sizeof(struct virtq_avail) <= VQ_ALIGN,
+               "desc table and avail ring must fit below the used ring");
+_Static_assert(sizeof(struct virtq_used) <= VQ_BYTES - VQ_ALIGN, "used ring overflows vq_mem");
+
 static volatile uint32_t *virtio_mmio;
 static uint32_t capacity_blocks;
+static uint32_t blk_irq;
 
 static uint8_t vq_mem[VQ_BYTES] __attribute__((aligned(VQ_ALIGN)));
 static struct virtq_desc *vq_desc;
 static struct virtq_avail *vq_avail;
 static volatile struct virtq_used *vq_used;
 static uint16_t vq_last_used_idx;
-static struct virtio_blk_req_hdr req_hdr;
-static volatile uint8_t req_status;
+// Free descriptors are chained through vq_desc[].next.
+static uint16_t desc_free_head;
+static int desc_free_count;
+// Per-request slots and the completion table, indexed by the chain's head descriptor.
+static struct virtio_blk_req_hdr req_hdrs[VQ_NUM];
+static volatile uint8_t req_status[VQ_NUM];
+static struct blockdev_io *blk_pending[VQ_NUM];
+static struct virtq_desc vq_indirect[VQ_NUM][VQ_INDIRECT_LEN] __attribute__((aligned(16)));
+static int blk_inflight;                    // requests owned by the device
+static bool blk_indirect;                   // VIRTIO_RING_F_INDIRECT_DESC accepted
+static bool blk_event_idx;                  // VIRTIO_RING_F_EVENT_IDX accepted
+static uint32_t blk_seg_max = 1;            // data segments per request
 static int blk_log_once;
 static int last_io_timed_out;
 static int blk_recovering;
+static struct wait_queue blk_waiters;       // issuers waiting for descriptors or a completion
+// Guards the virtqueue, the free list and blk_pending. Taken before proc_lock; fs_lock
+// is never held across block I/O (pfs_sync drops it).
+static struct spinlock blk_lock = SPINLOCK_INIT("blk");
 
-static int virtio_do_io(uint32_t type, uint32_t block_index, void *buf);
+static int virtio_submit(struct blockdev_io *ios, int count);
 
 static inline void fence_rw_rw(void) {
     __asm__ __volatile__("fence rw, rw" ::: "memory");
@@ -141,6 +170,7 @@ static int virtio_find_blk(void) {
         }
 
         virtio_mmio = base;
+        blk_irq = VIRTIO0_IRQ + i;
         return 0;
     }
 
@@ -156,6 +186,14 @@ static void virtio_setup_vq_layout(void) {
 
     memset(vq_mem, 0, sizeof(vq_mem));
     vq_last_used_idx = 0;
+
+    for (uint16_t i = 0; i < VQ_NUM; i++) {
+        vq_desc[i].next = (uint16_t) (i + 1);
+    }
+    desc_free_head = 0;
+    desc_free_count = VQ_NUM;
+    memset(blk_pending, 0, sizeof(blk_pending));
+    blk_inflight = 0;
 }
 
 static int virtio_setup_queue(void) {
@@ -191,14 +229,15 @@ static int virtio_configure_device(void) {
     uint32_t features0 = mmio_read(VIRTIO_MMIO_DEVICE_FEATURES);
     mmio_write(VIRTIO_MMIO_DEVICE_FEATURES_SEL, 1);
     uint32_t features1 = mmio_read(VIRTIO_MMIO_DEVICE_FEATURES);
-    (void) features0;
+    uint32_t driver0 = features0 & ((1u << VIRTIO_BLK_F_SEG_MAX) | (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                                    (1u << VIRTIO_RING_F_EVENT_IDX));
 
     if ((features1 & (1u << (VIRTIO_F_VERSION_1 - 32))) == 0) {
         return -1;
     }
 
     mmio_write(VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
-    mmio_write(VIRTIO_MMIO_DRIVER_FEATURES, 0);
+    mmio_write(VIRTIO_MMIO_DRIVER_FEATURES, driver0);
     mmio_write(VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
     mmio_write(VIRTIO_MMIO_DRIVER_FEATURES, (1u << (VIRTIO_F_VERSION_1 - 32)));
 
@@ -209,6 +248,21 @@ static int virtio_configure_device(void) {
         return -1;
     }
 
+    // Without SEG_MAX the device takes any segment count; we still cap it at what
+    // a direct chain or an indirect table can describe.
+    blk_indirect = (driver0 & (1u << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+    blk_event_idx = (driver0 & (1u << VIRTIO_RING_F_EVENT_IDX)) != 0;
+    blk_seg_max = blk_indirect ? BLOCKDEV_SEG_MAX : VQ_DIRECT_MAX - 2;
+    if (driver0 & (1u << VIRTIO_BLK_F_SEG_MAX)) {
+        uint32_t seg_max = mmio_read(VIRTIO_MMIO_CONFIG + 0x0c);
+        if (seg_max == 0) {
+            seg_max = 1;
+        }
+        if (seg_max < blk_seg_max) {
+            blk_seg_max = seg_max;
+        }
+    }
+
     if (virtio_setup_queue() < 0) {
         return -1;
     }
@@ -241,15 +295,14 @@ static int virtio_recover_from_timeout(void) {
     }
     blk_recovering = 1;
 
+    spin_lock(&blk_lock);
     virtio_setup_vq_layout();
-    if (virtio_configure_device() < 0 || virtio_read_capacity() < 0) {
-        mmio_write(VIRTIO_MMIO_STATUS, VIRTIO_STATUS_FAILED);
-        blk_recovering = 0;
-        return -1;
-    }
+    int ret = virtio_configure_device() < 0 || virtio_read_capacity() < 0 ? -1 : 0;
+    spin_unlock(&blk_lock);
 
     uint8_t probe[BLOCKDEV_BLOCK_SIZE];
-    if (virtio_do_io(VIRTIO_BLK_T_IN, 0, probe) < 0) {
+    struct blockdev_io io = { .block_index = 0, .buf = probe, .write = false };
+    if (ret < 0 || virtio_submit(&io, 1) < 0) {
         mmio_write(VIRTIO_MMIO_STATUS, VIRTIO_STATUS_FAILED);
         blk_recovering = 0;
         return -1;
@@ -259,67 +312,256 @@ static int virtio_recover_from_timeout(void) {
     return 0;
 }
 
-static int virtio_do_io(uint32_t type, uint32_t block_index, void *buf) {
-    last_io_timed_out = 0;
+static uint16_t virtio_alloc_desc(void) {
+    uint16_t idx = desc_free_head;
+    desc_free_head = vq_desc[idx].next;
+    desc_free_count--;
+    return idx;
+}
 
-    req_hdr.type = type;
-    req_hdr.reserved = 0;
-    req_hdr.sector = block_index;
-    req_status = 0xff;
+static void virtio_free_chain(uint16_t head) {
+    uint16_t idx = head;
+    for (;;) {
+        uint16_t flags = vq_desc[idx].flags;
+        uint16_t next = vq_desc[idx].next;
+        vq_desc[idx].flags = 0;
+        vq_desc[idx].next = desc_free_head;
+        desc_free_head = idx;
+        desc_free_count++;
+        if ((flags & VIRTQ_DESC_F_NEXT) == 0) {
+            break;
+        }
+        idx = next;
+    }
+}
 
-    vq_desc[0].addr = (uint64_t) (uint32_t) &req_hdr;
-    vq_desc[0].len = sizeof(req_hdr);
-    vq_desc[0].flags = VIRTQ_DESC_F_NEXT;
-    vq_desc[0].next = 1;
+static inline int io_blocks(const struct blockdev_io *io) {
+    return io->bufs ? io->nblocks : 1;
+}
 
-    vq_desc[1].addr = (uint64_t) (uint32_t) buf;
-    vq_desc[1].len = BLOCKDEV_BLOCK_SIZE;
-    vq_desc[1].flags = VIRTQ_DESC_F_NEXT;
-    if (type == VIRTIO_BLK_T_IN) {
-        vq_desc[1].flags |= VIRTQ_DESC_F_WRITE;
+static inline bool io_indirect(const struct blockdev_io *io) {
+    return blk_indirect && io_blocks(io) + 2 > VQ_DIRECT_MAX;
+}
+
+// Ring descriptors io occupies while in flight.
+static int io_desc_count(const struct blockdev_io *io) {
+    return io_indirect(io) ? 1 : io_blocks(io) + 2;
+}
+
+static void virtio_fill_desc(struct virtq_desc *d, void *addr, uint32_t len, uint16_t flags, uint16_t next) {
+    d->addr = (uint64_t) (uint32_t) addr;
+    d->len = len;
+    d->flags = flags;
+    d->next = next;
+}
+
+// Build the header, data segments and status descriptors for io and place its
+// head in avail slot: a ring chain for short requests, otherwise one ring
+// descriptor pointing at the head's indirect table. The caller checked that
+// io_desc_count(io) descriptors are free.
+static void virtio_queue_locked(struct blockdev_io *io, uint16_t slot) {
+    int blocks = io_blocks(io);
+    uint16_t data_flags = io->write ? 0 : VIRTQ_DESC_F_WRITE;
+    uint16_t head = virtio_alloc_desc();
+
+    req_hdrs[head].type = io->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    req_hdrs[head].reserved = 0;
+    req_hdrs[head].sector = io->block_index;
+    req_status[head] = 0xff;
+
+    if (io_indirect(io)) {
+        struct virtq_desc *table = vq_indirect[head];
+        int last = blocks + 1;
+        virtio_fill_desc(&table[0], &req_hdrs[head], sizeof(req_hdrs[head]), VIRTQ_DESC_F_NEXT, 1);
+        for (int i = 0; i < blocks; i++) {
+            void *buf = io->bufs ? io->bufs[i] : io->buf;
+            virtio_fill_desc(&table[i + 1], buf, BLOCKDEV_BLOCK_SIZE,
+                             VIRTQ_DESC_F_NEXT | data_flags, (uint16_t) (i + 2));
+        }
+        virtio_fill_desc(&table[last], (void *) &req_status[head], 1, VIRTQ_DESC_F_WRITE, 0);
+        virtio_fill_desc(&vq_desc[head], table, (uint32_t) (last + 1) * sizeof(struct virtq_desc),
+                         VIRTQ_DESC_F_INDIRECT, 0);
+    } else {
+        uint16_t prev = head;
+        virtio_fill_desc(&vq_desc[head], &req_hdrs[head], sizeof(req_hdrs[head]), VIRTQ_DESC_F_NEXT, 0);
+        for (int i = 0; i < blocks; i++) {
+            void *buf = io->bufs ? io->bufs[i] : io->buf;
+            uint16_t d = virtio_alloc_desc();
+            vq_desc[prev].next = d;
+            virtio_fill_desc(&vq_desc[d], buf, BLOCKDEV_BLOCK_SIZE, VIRTQ_DESC_F_NEXT | data_flags, 0);
+            prev = d;
+        }
+        uint16_t tail = virtio_alloc_desc();
+        vq_desc[prev].next = tail;
+        virtio_fill_desc(&vq_desc[tail], (void *) &req_status[head], 1, VIRTQ_DESC_F_WRITE, 0);
     }
-    vq_desc[1].next = 2;
 
-    vq_desc[2].addr = (uint64_t) (uint32_t) &req_status;
-    vq_desc[2].len = 1;
-    vq_desc[2].flags = VIRTQ_DESC_F_WRITE;
-    vq_desc[2].next = 0;
+    blk_pending[head] = io;
+    blk_inflight++;
+    vq_avail->ring[slot % VQ_NUM] = head;
+}
 
-    uint16_t avail_idx = vq_avail->idx;
-    vq_avail->ring[avail_idx % VQ_NUM] = 0;
-    fence_rw_rw();
-    vq_avail->idx = (uint16_t) (avail_idx + 1);
+// Consume used ring entries: each chain goes back to the free list and the request
+// recorded for its head gets its result.
+static bool virtio_reap_locked(void) {
+    bool reaped = false;
+    while (vq_last_used_idx != vq_used->idx) {
+        fence_rw_rw();
+        uint32_t head = vq_used->ring[vq_last_used_idx % VQ_NUM].id;
+        vq_last_used_idx++;
+        reaped = true;
+        if (head >= VQ_NUM) {
+            continue;
+        }
 
-    fence_rw_rw();
-    mmio_write(VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+        struct blockdev_io *io = blk_pending[head];
+        if (io) {
+            io->status = req_status[head];
+            io->done = true;
+            blk_pending[head] = NULL;
+            blk_inflight--;
+        }
+        virtio_free_chain((uint16_t) head);
+    }
+    return reaped;
+}
 
+// Poll-mode wait (boot, or a caller that cannot sleep): spin until the device
+// posts a used entry.
+static int virtio_poll_locked(void) {
     uint32_t spin = 0;
     while (vq_used->idx == vq_last_used_idx) {
         __asm__ __volatile__("nop");
         if (++spin > VIRTIO_IO_SPIN_LIMIT) {
             last_io_timed_out = 1;
             if (!blk_log_once) {
-                printf("[blk] timeout type=%d blk=%d status=%x used=%d last=%d\n",
-                       (int) type, (int) block_index, (unsigned) req_status,
-                       (int) vq_used->idx, (int) vq_last_used_idx);
+                printf("[blk] timeout free=%d used=%d last=%d\n",
+                       desc_free_count, (int) vq_used->idx, (int) vq_last_used_idx);
                 blk_log_once = 1;
             }
+            // fail every outstanding request; recovery resets the queue
+            for (int i = 0; i < VQ_NUM; i++) {
+                if (blk_pending[i]) {
+                    blk_pending[i]->done = true;
+                    blk_pending[i] = NULL;
+                }
+            }
+            blk_inflight = 0;
             return -1;
         }
     }
+    virtio_reap_locked();
+    return 0;
+}
+
+static int virtio_wait_locked(bool can_block) {
+    if (can_block) {
+        wait_queue_sleep(&blk_waiters, PROC_WAIT_BLOCK_IO, -1, &blk_lock);
+        return 0;
+    }
+    return virtio_poll_locked();
+}
 
-    vq_last_used_idx = vq_used->idx;
+// With EVENT_IDX, interrupt only when the last request now in flight completes
+// (used_event is the used index after which the device signals).
+static void virtio_arm_interrupt_locked(void) {
+    if (!blk_event_idx || blk_inflight == 0) {
+        return;
+    }
+    vq_avail->used_event = (uint16_t) (vq_last_used_idx + blk_inflight - 1);
     fence_rw_rw();
+}
+
+// Kick only if the device asked for it: avail_event (EVENT_IDX) or the
+// NO_NOTIFY flag tells whether it is still walking the avail ring.
+static bool virtio_need_kick_locked(uint16_t old_idx, uint16_t new_idx) {
+    fence_rw_rw();
+    if (blk_event_idx) {
+        uint16_t event = vq_used->avail_event;
+        return (uint16_t) (new_idx - event - 1) < (uint16_t) (new_idx - old_idx);
+    }
+    return (vq_used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0;
+}
+
+static void virtio_blk_irq(void) {
+    spin_lock(&blk_lock);
+    mmio_write(VIRTIO_MMIO_INTERRUPT_ACK, mmio_read(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3);
+    bool reaped = false;
+    // Re-arm for the rest of the batch, then recheck: entries posted before the
+    // device saw the new used_event raise no interrupt.
+    do {
+        reaped |= virtio_reap_locked();
+        virtio_arm_interrupt_locked();
+    } while (vq_used->idx != vq_last_used_idx);
+    spin_unlock(&blk_lock);
+
+    if (reaped) {
+        wait_queue_wake_all(&blk_waiters);
+    }
+}
+
+// Queue as many requests as there are free descriptors for, publish them with one avail
+// index update and one notify, and keep going as completions free descriptors.
+// A process sleeps (PROC_WAIT_BLOCK_IO) until the completion interrupt; boot code
+// and callers holding other locks poll.
+static int virtio_submit(struct blockdev_io *ios, int count) {
+    for (int i = 0; i < count; i++) {
+        ios[i].done = false;
+        ios[i].status = 0xff;
+    }
 
-    if (req_status != 0) {
-        if (!blk_log_once) {
-            printf("[blk] io err type=%d blk=%d status=%x\n",
-                   (int) type, (int) block_index, (unsigned) req_status);
-            blk_log_once = 1;
+    spin_lock(&blk_lock);
+    bool can_block = process_can_block();
+    int ret = 0;
+    last_io_timed_out = 0;
+
+    int next = 0;
+    while (next < count && ret == 0) {
+        uint16_t avail_idx = vq_avail->idx;
+        uint16_t added = 0;
+        while (next < count && desc_free_count >= io_desc_count(&ios[next])) {
+            virtio_queue_locked(&ios[next++], (uint16_t) (avail_idx + added));
+            added++;
+        }
+        if (added > 0) {
+            virtio_arm_interrupt_locked();
+            fence_rw_rw();
+            vq_avail->idx = (uint16_t) (avail_idx + added);
+            if (virtio_need_kick_locked(avail_idx, (uint16_t) (avail_idx + added))) {
+                mmio_write(VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+            }
         }
+        if (next < count) {
+            ret = virtio_wait_locked(can_block);
+        }
+    }
+
+    for (int i = 0; i < next && ret == 0; i++) {
+        while (!ios[i].done && ret == 0) {
+            ret = virtio_wait_locked(can_block);
+        }
+    }
+    spin_unlock(&blk_lock);
+
+    // A poller may have reaped for a sleeping issuer too.
+    if (!can_block) {
+        wait_queue_wake_all(&blk_waiters);
+    }
+    if (ret < 0) {
         return -1;
     }
 
+    for (int i = 0; i < count; i++) {
+        if (ios[i].status != 0) {
+            if (!blk_log_once) {
+                printf("[blk] io err write=%d blk=%d n=%d status=%x\n",
+                       (int) ios[i].write, (int) ios[i].block_index, io_blocks(&ios[i]),
+                       (unsigned) ios[i].status);
+                blk_log_once = 1;
+            }
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -340,52 +582,101 @@ void blockdev_init(void) {
     }
 
     uint8_t probe[BLOCKDEV_BLOCK_SIZE];
-    if (virtio_do_io(VIRTIO_BLK_T_IN, 0, probe) < 0) {
+    struct blockdev_io io = { .block_index = 0, .buf = probe, .write = false };
+    if (virtio_submit(&io, 1) < 0) {
         mmio_write(VIRTIO_MMIO_STATUS, VIRTIO_STATUS_FAILED);
         PANIC("virtio-blk probe io failed");
     }
+
+    // completions arrive by interrupt once the harts run plic_init_hart()
+    plic_register(blk_irq, virtio_blk_irq);
 }
 
-int blockdev_read(uint32_t block_index, void *out_block) {
-    if (!out_block) {
+// Requests complete in any order; each one gets its own done/status.
+int blockdev_submit(struct blockdev_io *ios, int count) {
+    if (!ios || count < 0) {
         return -1;
     }
-    if (block_index >= BLOCKDEV_BLOCK_COUNT || block_index >= capacity_blocks) {
-        return -1;
+    for (int i = 0; i < count; i++) {
+        int blocks = io_blocks(&ios[i]);
+        if (blocks < 1 || (uint32_t) blocks > blk_seg_max) {
+            return -1;
+        }
+        if (ios[i].block_index >= capacity_blocks ||
+            (uint32_t) blocks > capacity_blocks - ios[i].block_index) {
+            return -1;
+        }
+        for (int j = 0; j < blocks; j++) {
+            if (!(ios[i].bufs ? ios[i].bufs[j] : ios[i].buf)) {
+                return -1;
+            }
+        }
+    }
+    if (count == 0) {
+        return 0;
     }
 
-    if (virtio_do_io(VIRTIO_BLK_T_IN, block_index, out_block) == 0) {
+    if (virtio_submit(ios, count) == 0) {
         return 0;
     }
     if (!last_io_timed_out) {
         return -1;
     }
 
+    // rewriting or rereading the whole batch is harmless
     printf("[blk] recovering from timeout...\n");
     if (virtio_recover_from_timeout() < 0) {
         return -1;
     }
-    return virtio_do_io(VIRTIO_BLK_T_IN, block_index, out_block);
+    return virtio_submit(ios, count);
+}
+
+// Device size in blocks (virtio-blk capacity, read at init).
+uint32_t blockdev_block_count(void) {
+    return capacity_blocks;
+}
+
+int blockdev_read(uint32_t block_index, void *out_block) {
+    struct blockdev_io io = { .block_index = block_index, .buf = out_block, .write = false };
+    return blockdev_submit(&io, 1);
 }
 
 int blockdev_write(uint32_t block_index, const void *in_block) {
-    if (!in_block) {
+    struct blockdev_io io = { .block_index = block_index, .buf = (void *) in_block, .write = true };
+    return blockdev_submit(&io, 1);
+}
+
+// Split the run into requests of up to blk_seg_max blocks and submit them a few
+// at a time, so a long transfer costs a handful of device round trips.
+static int blockdev_rw_vec(uint32_t block_index, void *const *bufs, int count, bool write) {
+    struct blockdev_io ios[BLOCKDEV_VEC_BATCH];
+
+    if (!bufs || count < 0) {
         return -1;
     }
-    if (block_index >= BLOCKDEV_BLOCK_COUNT || block_index >= capacity_blocks) {
-        return -1;
+    while (count > 0) {
+        int n = 0;
+        while (count > 0 && n < BLOCKDEV_VEC_BATCH) {
+            int blocks = count > (int) blk_seg_max ? (int) blk_seg_max : count;
+            ios[n] = (struct blockdev_io) {
+                .block_index = block_index, .bufs = bufs, .nblocks = blocks, .write = write,
+            };
+            block_index += (uint32_t) blocks;
+            bufs += blocks;
+            count -= blocks;
+            n++;
+        }
+        if (blockdev_submit(ios, n) < 0) {
+            return -1;
+        }
     }
+    return 0;
+}
 
-    if (virtio_do_io(VIRTIO_BLK_T_OUT, block_index, (void *) in_block) == 0) {
-        return 0;
-    }
-    if (!last_io_timed_out) {
-        return -1;
-    }
+int blockdev_readv(uint32_t block_index, void *const *bufs, int count) {
+    return blockdev_rw_vec(block_index, bufs, count, false);
+}
 
-    printf("[blk] recovering from timeout...\n");
-    if (virtio_recover_from_timeout() < 0) {
-        return -1;
-    }
-    return virtio_do_io(VIRTIO_BLK_T_OUT, block_index, (void *) in_block);
+int blockdev_writev(uint32_t block_index, const void *const *bufs, int count) {
+    return blockdev_rw_vec(block_index, (void *const *) bufs, count, true);
 }
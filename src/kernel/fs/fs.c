@@ -1,13 +1,37 @@
 #include "fs_internal.h"
 #include "process.h"
 #include "kernel.h"
+#include "memory.h"
+#include "spinlock.h"
 #include "commonlibs.h"
 #include "blockdev.h"
+#include "bcache.h"
+#include "uart.h"
 
 extern void syscall_handle_getchar(struct trap_frame *f);
 
 #define VFS_MOUNT_MAX 4
-#define PFS_MAGIC 0x50465331u
+
+// pfs v2 volume (512B blocks):
+//   0              superblock
+//   bitmap_start   free-block bitmap, one bit per volume block (set: in use)
+//   inode_start    inode table, FS_MAX_NODES x struct pfs_inode
+//   data_start     file blocks and indirect pointer blocks, allocated on demand
+#define PFS_MAGIC               0x50465332u     // "PFS2"
+#define PFS_VERSION             2
+#define PFS_MAX_BLOCKS          65536           // volume cap (32 MiB): bounds the in-RAM bitmap
+#define PFS_DIRECT              7
+#define PFS_PTRS_PER_BLOCK      (BLOCKDEV_BLOCK_SIZE / 4)
+#define PFS_FILE_BLOCKS         (PFS_DIRECT + PFS_PTRS_PER_BLOCK)
+#define PFS_IND_SLOT            PFS_FILE_BLOCKS // node dirty bit of the indirect block
+#define PFS_NODE_MAP_WORDS      ((PFS_FILE_BLOCKS + 1 + 31) / 32)
+#define PFS_BITS_PER_BLOCK      (BLOCKDEV_BLOCK_SIZE * 8)
+#define PFS_INODES_PER_BLOCK    8
+#define PFS_INODE_BLOCKS        (FS_MAX_NODES / PFS_INODES_PER_BLOCK)
+#define PFS_META_MAX            (1 + PFS_MAX_BLOCKS / PFS_BITS_PER_BLOCK + PFS_INODE_BLOCKS)
+#define PFS_SYNC_BATCH          16              // blocks staged per pfs_sync pass / boot read batch
+#define NODEFS_HASH_BUCKETS     64              // (parent, name) -> node; power of two
+#define VFS_DCACHE_SIZE         128             // direct-mapped dentry cache; power of two
 
 struct vfs_fd {
     int used;
@@ -19,49 +43,133 @@ struct vfs_fd {
 
 static struct vfs_fd fd_table[PROCS_MAX][FS_FD_MAX];
 
+// In-RAM node. File blocks are pool blocks allocated as the file grows; a pfs
+// node also knows where each of them lives on disk and which still need writing.
 struct fs_node {
     int used;
     int type;
     int parent;
     char name[FS_NAME_MAX];
     uint32_t size;
-    uint8_t data[FS_FILE_MAX_SIZE];
+    uint8_t *data[PFS_DIRECT];
+    uint8_t **ind_data;                 // blocks PFS_DIRECT.. (a pool block of pointers)
+    uint32_t disk[PFS_DIRECT];          // pfs only: volume block of each block (0: none)
+    uint32_t *ind_disk;                 // pfs only: RAM copy of the indirect block
+    uint32_t disk_ind;                  // pfs only: where that copy lives
+    uint32_t dirty[PFS_NODE_MAP_WORDS]; // pfs only: blocks to write (bit PFS_IND_SLOT: indirect)
+    // RAM-only directory links. 0 means none: the root is never a child.
+    int first_child;
+    int last_child;
+    int next_sibling;
+    int prev_sibling;
+    int hash_next;                      // next node in the same name bucket
 };
 
 struct nodefs {
     int mount_idx;
     int persistent;
     struct fs_node nodes[FS_MAX_NODES];
+    int hash_heads[NODEFS_HASH_BUCKETS];
 };
 
-struct pfs_image {
+struct pfs_super {
     uint32_t magic;
-    struct fs_node nodes[FS_MAX_NODES];
+    uint32_t version;
+    uint32_t total_blocks;
+    uint32_t bitmap_start;
+    uint32_t bitmap_blocks;
+    uint32_t inode_start;
+    uint32_t inode_blocks;
+    uint32_t data_start;
+};
+
+// On-disk inode; block pointers are volume block numbers (0: none).
+struct pfs_inode {
+    int used;
+    int type;
+    int parent;
+    char name[FS_NAME_MAX];
+    uint32_t size;
+    uint32_t direct[PFS_DIRECT];
+    uint32_t indirect;                  // block of PFS_PTRS_PER_BLOCK more pointers
 };
 
+_Static_assert(sizeof(struct pfs_inode) * PFS_INODES_PER_BLOCK == BLOCKDEV_BLOCK_SIZE,
+               "inodes must tile a block");
+_Static_assert(FS_FILE_MAX_SIZE == PFS_FILE_BLOCKS * BLOCKDEV_BLOCK_SIZE,
+               "FS_FILE_MAX_SIZE must match the pfs block pointers");
+_Static_assert(PFS_INODE_BLOCKS <= PFS_SYNC_BATCH, "boot reads the inode table in one batch");
+_Static_assert(PFS_MAX_BLOCKS / PFS_BITS_PER_BLOCK <= PFS_SYNC_BATCH, "boot reads the bitmap in one batch");
+_Static_assert(PFS_PTRS_PER_BLOCK * sizeof(uint8_t *) <= BLOCKDEV_BLOCK_SIZE,
+               "ind_data must fit a pool block");
+
+// Names are single components below a directory node of the same mount; the
+// VFS walks paths itself (through the dentry cache) and crosses mountpoints.
 struct vfs_ops {
-    int (*open)(void *ctx, const char *path, int flags, int *node_out, uint32_t *offset_out);
+    int (*lookup)(void *ctx, int dir, const char *name);
+    int (*open)(void *ctx, int dir, const char *name, int flags, int *node_out, uint32_t *offset_out);
     int (*read)(void *ctx, int node, uint32_t *offset, void *buf, size_t size);
     int (*write)(void *ctx, int node, uint32_t *offset, const void *buf, size_t size);
-    int (*mkdir)(void *ctx, const char *path);
-    int (*readdir)(void *ctx, const char *path, int index, struct fs_dirent *out);
-    int (*unlink)(void *ctx, const char *path);
-    int (*rmdir)(void *ctx, const char *path);
+    int (*mkdir)(void *ctx, int dir, const char *name);
+    int (*readdir)(void *ctx, int dir, int index, struct fs_dirent *out);
+    int (*unlink)(void *ctx, int dir, const char *name);
+    int (*rmdir)(void *ctx, int dir, const char *name);
+    int (*sync)(void *ctx);     // pending changes into the block cache, without fs_lock (NULL: volatile)
 };
 
 struct vfs_mount {
     int used;
-    char path[FS_PATH_MAX];
-    int path_len;
+    int covered_mount;          // directory hidden by this mount (-1: the root mount)
+    int covered_node;
     const struct vfs_ops *ops;
     void *ctx;
 };
 
+// (mount, parent dir, name) -> node, with mountpoints already crossed. Only hits
+// are cached, so creating a name needs no invalidation; unlink/rmdir drop theirs.
+struct vfs_dentry {
+    int used;
+    int mount_idx;
+    int parent;
+    char name[FS_NAME_MAX];
+    int target_mount;
+    int target_node;
+};
+
 static struct vfs_mount mounts[VFS_MOUNT_MAX];
+static int vfs_root_mount = -1;
+static struct vfs_dentry dcache[VFS_DCACHE_SIZE];
 static struct nodefs rootfs;
 static struct nodefs tmpfs;
 static struct nodefs procfs;
-static struct pfs_image pfs_work_img;
+// Whole-VFS lock. Recursive: opening a /proc file regenerates it through fs_open/fs_write.
+// Taken after proc_lock (procfs sync while scheduling) and before mem_lock.
+static struct spinlock fs_lock = SPINLOCK_INIT("fs");
+// Free 512B pool blocks (file data and pointer tables), linked through their first word.
+static void *fs_pool_head;
+static struct pfs_super pfs_sb;
+static uint32_t pfs_free_map[PFS_MAX_BLOCKS / 32];
+static uint32_t pfs_used_blocks;
+static uint32_t pfs_alloc_hint;                     // next data block to try
+static uint32_t pfs_meta_dirty[(PFS_META_MAX + 31) / 32];
+// pfs write-out: one writer owns the staging area; blocks dirtied meanwhile stay
+// marked and are picked up by the writer's next pass. pfs_io_lock is taken with
+// no other lock held (never under proc_lock), so writers can sleep on it.
+static struct spinlock pfs_io_lock = SPINLOCK_INIT("pfs_io");
+static bool pfs_io_busy;
+static struct wait_queue pfs_io_waiters;
+static struct pfs_stats pfs_stats;
+
+struct pfs_staged {
+    uint32_t block;
+    int node;                   // -1: metadata block
+    uint32_t slot;              // node block (PFS_IND_SLOT: indirect block)
+};
+
+static uint8_t pfs_stage_data[PFS_SYNC_BATCH][BLOCKDEV_BLOCK_SIZE];
+static struct pfs_staged pfs_stage[PFS_SYNC_BATCH];
+static struct blockdev_io pfs_load_ios[PFS_SYNC_BATCH];
+static int pfs_load_count;
 
 static int console_read_fallback(void *buf, size_t size) {
     if (!buf) {
@@ -89,10 +197,7 @@ static int console_write_fallback(const void *buf, size_t size) {
         return 0;
     }
 
-    const uint8_t *src = (const uint8_t *) buf;
-    for (size_t i = 0; i < size; i++) {
-        putchar((char) src[i]);
-    }
+    console_write((const char *) buf, size);
     return (int) size;
 }
 
@@ -136,200 +241,710 @@ static int next_component(const char *path, int *pos, char *out_name) {
     return 1;
 }
 
-static int pfs_block_count(void) {
-    return (int) ((sizeof(struct pfs_image) + BLOCKDEV_BLOCK_SIZE - 1) / BLOCKDEV_BLOCK_SIZE);
+static void fs_pool_free(void *block) {
+    *(void **) block = fs_pool_head;
+    fs_pool_head = block;
 }
 
-static int pfs_sync(struct nodefs *fs) {
-    if (!fs->persistent) {
-        return 0;
+// A zeroed 512B block. Pages are only taken from the page allocator as files
+// grow, so memory follows the data actually stored.
+static void *fs_pool_alloc(void) {
+    if (!fs_pool_head) {
+        uint8_t *page = (uint8_t *) alloc_pages(1);
+        for (int i = 0; i < PAGE_SIZE / BLOCKDEV_BLOCK_SIZE; i++) {
+            fs_pool_free(page + i * BLOCKDEV_BLOCK_SIZE);
+        }
     }
+    void *block = fs_pool_head;
+    fs_pool_head = *(void **) block;
+    memset(block, 0, BLOCKDEV_BLOCK_SIZE);
+    return block;
+}
 
-    struct pfs_image *img = &pfs_work_img;
-    img->magic = PFS_MAGIC;
-    memcpy(img->nodes, fs->nodes, sizeof(fs->nodes));
+static inline bool pfs_map_test(const uint32_t *map, uint32_t bit) {
+    return (map[bit / 32] >> (bit % 32)) & 1u;
+}
 
-    const uint8_t *src = (const uint8_t *) img;
-    uint8_t block[BLOCKDEV_BLOCK_SIZE];
-    int blocks = pfs_block_count();
+static inline void pfs_map_set(uint32_t *map, uint32_t bit) {
+    map[bit / 32] |= 1u << (bit % 32);
+}
 
-    if (blocks > BLOCKDEV_BLOCK_COUNT) {
-        return -1;
+static inline void pfs_map_clear(uint32_t *map, uint32_t bit) {
+    map[bit / 32] &= ~(1u << (bit % 32));
+}
+
+static void pfs_mark_meta(uint32_t block) {
+    pfs_map_set(pfs_meta_dirty, block);
+}
+
+static void pfs_mark_inode(struct nodefs *fs, int idx) {
+    if (fs->persistent) {
+        pfs_mark_meta(pfs_sb.inode_start + (uint32_t) idx / PFS_INODES_PER_BLOCK);
     }
+}
 
-    for (int i = 0; i < blocks; i++) {
-        memset(block, 0, sizeof(block));
-        int off = i * BLOCKDEV_BLOCK_SIZE;
-        int remain = (int) sizeof(*img) - off;
-        int copy_len = remain > BLOCKDEV_BLOCK_SIZE ? BLOCKDEV_BLOCK_SIZE : remain;
-        if (copy_len > 0) {
-            memcpy(block, src + off, copy_len);
-        }
-        if (blockdev_write((uint32_t) i, block) < 0) {
-            return -1;
-        }
+// slot: node block index, or PFS_IND_SLOT for the indirect block.
+static void pfs_mark_data(struct nodefs *fs, struct fs_node *n, uint32_t slot) {
+    if (fs->persistent) {
+        pfs_map_set(n->dirty, slot);
     }
+}
 
+// The first free data block at or after the rotor, so a growing file gets
+// consecutive blocks and write-back sends them as one run. 0: volume full.
+static uint32_t pfs_alloc_block(void) {
+    uint32_t span = pfs_sb.total_blocks - pfs_sb.data_start;
+    for (uint32_t k = 0; k < span; k++) {
+        uint32_t b = pfs_sb.data_start + (pfs_alloc_hint - pfs_sb.data_start + k) % span;
+        if (pfs_map_test(pfs_free_map, b)) {
+            continue;
+        }
+        pfs_map_set(pfs_free_map, b);
+        pfs_mark_meta(pfs_sb.bitmap_start + b / PFS_BITS_PER_BLOCK);
+        pfs_used_blocks++;
+        pfs_alloc_hint = b + 1;
+        return b;
+    }
     return 0;
 }
 
-static void nodefs_format(struct nodefs *fs) {
-    memset(fs->nodes, 0, sizeof(fs->nodes));
-    fs->nodes[0].used = 1;
-    fs->nodes[0].type = FS_TYPE_DIR;
-    fs->nodes[0].parent = -1;
-    fs->nodes[0].name[0] = '/';
-    fs->nodes[0].name[1] = '\0';
+static void pfs_free_block(uint32_t b) {
+    if (b < pfs_sb.data_start || b >= pfs_sb.total_blocks || !pfs_map_test(pfs_free_map, b)) {
+        return;
+    }
+    pfs_map_clear(pfs_free_map, b);
+    pfs_mark_meta(pfs_sb.bitmap_start + b / PFS_BITS_PER_BLOCK);
+    pfs_used_blocks--;
 }
 
-static void nodefs_init_instance(struct nodefs *fs, int persistent) {
-    memset(fs, 0, sizeof(*fs));
-    fs->mount_idx = -1;
-    fs->persistent = persistent;
+static uint8_t **nodefs_block_slot(struct fs_node *n, uint32_t i, bool alloc) {
+    if (i < PFS_DIRECT) {
+        return &n->data[i];
+    }
+    if (!n->ind_data) {
+        if (!alloc) {
+            return NULL;
+        }
+        n->ind_data = (uint8_t **) fs_pool_alloc();
+    }
+    return &n->ind_data[i - PFS_DIRECT];
+}
 
-    if (!persistent) {
-        nodefs_format(fs);
-        return;
+static uint32_t *pfs_disk_slot(struct fs_node *n, uint32_t i) {
+    if (i < PFS_DIRECT) {
+        return &n->disk[i];
     }
+    return n->ind_disk ? &n->ind_disk[i - PFS_DIRECT] : NULL;
+}
 
-    struct pfs_image *img = &pfs_work_img;
-    uint8_t *dst = (uint8_t *) img;
-    uint8_t block[BLOCKDEV_BLOCK_SIZE];
-    int blocks = pfs_block_count();
+// Give block i of a pfs file a place on disk (and the indirect block first if needed).
+static int pfs_map_block(struct nodefs *fs, int idx, uint32_t i) {
+    struct fs_node *n = &fs->nodes[idx];
 
-    if (blocks > BLOCKDEV_BLOCK_COUNT) {
-        PANIC("pfs image too large for blockdev");
+    if (i >= PFS_DIRECT && !n->ind_disk) {
+        uint32_t b = pfs_alloc_block();
+        if (b == 0) {
+            return -1;
+        }
+        n->ind_disk = (uint32_t *) fs_pool_alloc();
+        n->disk_ind = b;
+        pfs_mark_inode(fs, idx);
     }
 
-    for (int i = 0; i < blocks; i++) {
-        if (blockdev_read((uint32_t) i, block) < 0) {
-            PANIC("pfs block read failed");
-        }
-        int off = i * BLOCKDEV_BLOCK_SIZE;
-        int remain = (int) sizeof(*img) - off;
-        int copy_len = remain > BLOCKDEV_BLOCK_SIZE ? BLOCKDEV_BLOCK_SIZE : remain;
-        if (copy_len > 0) {
-            memcpy(dst + off, block, copy_len);
+    uint32_t b = pfs_alloc_block();
+    if (b == 0) {
+        return -1;
+    }
+    *pfs_disk_slot(n, i) = b;
+    if (i < PFS_DIRECT) {
+        pfs_mark_inode(fs, idx);
+    } else {
+        pfs_mark_data(fs, n, PFS_IND_SLOT);
+    }
+    pfs_mark_data(fs, n, i);
+    return 0;
+}
+
+// Block i of a file in RAM. With alloc, a missing block is created zeroed (and
+// placed on disk for pfs); NULL then means the file or the volume is full.
+static uint8_t *nodefs_get_block(struct nodefs *fs, int idx, uint32_t i, bool alloc) {
+    if (i >= PFS_FILE_BLOCKS) {
+        return NULL;
+    }
+
+    uint8_t **slot = nodefs_block_slot(&fs->nodes[idx], i, alloc);
+    if (!slot) {
+        return NULL;
+    }
+    if (!*slot && alloc) {
+        if (fs->persistent && pfs_map_block(fs, idx, i) < 0) {
+            return NULL;
         }
+        *slot = (uint8_t *) fs_pool_alloc();
     }
+    return *slot;
+}
 
-    if (img->magic != PFS_MAGIC) {
-        nodefs_format(fs);
-        if (pfs_sync(fs) < 0) {
-            PANIC("pfs initial sync failed");
+// Release every block of a file, in RAM and on disk, leaving it empty.
+static void nodefs_free_blocks(struct nodefs *fs, int idx) {
+    struct fs_node *n = &fs->nodes[idx];
+
+    for (uint32_t i = 0; i < PFS_FILE_BLOCKS; i++) {
+        uint8_t **slot = nodefs_block_slot(n, i, false);
+        if (slot && *slot) {
+            fs_pool_free(*slot);
+            *slot = NULL;
+        }
+        uint32_t *disk = pfs_disk_slot(n, i);
+        if (disk && *disk) {
+            pfs_free_block(*disk);
+            *disk = 0;
         }
+    }
+    if (n->ind_data) {
+        fs_pool_free(n->ind_data);
+        n->ind_data = NULL;
+    }
+    if (n->ind_disk) {
+        fs_pool_free(n->ind_disk);
+        n->ind_disk = NULL;
+        pfs_free_block(n->disk_ind);
+        n->disk_ind = 0;
+    }
+    memset(n->dirty, 0, sizeof(n->dirty));
+    n->size = 0;
+    pfs_mark_inode(fs, idx);
+}
+
+static void pfs_inode_from_node(struct pfs_inode *ino, const struct fs_node *n) {
+    memset(ino, 0, sizeof(*ino));
+    if (!n->used) {
         return;
     }
+    ino->used = 1;
+    ino->type = n->type;
+    ino->parent = n->parent;
+    memcpy(ino->name, n->name, sizeof(ino->name));
+    ino->size = n->size;
+    memcpy(ino->direct, n->disk, sizeof(ino->direct));
+    ino->indirect = n->disk_ind;
+}
 
-    memcpy(fs->nodes, img->nodes, sizeof(fs->nodes));
-    if (!fs->nodes[0].used || fs->nodes[0].type != FS_TYPE_DIR) {
-        nodefs_format(fs);
-        if (pfs_sync(fs) < 0) {
-            PANIC("pfs recovery sync failed");
+// Current contents of metadata block b.
+static void pfs_fill_meta(struct nodefs *fs, uint32_t b, uint8_t *out) {
+    memset(out, 0, BLOCKDEV_BLOCK_SIZE);
+    if (b == 0) {
+        memcpy(out, &pfs_sb, sizeof(pfs_sb));
+    } else if (b < pfs_sb.inode_start) {
+        memcpy(out, (const uint8_t *) pfs_free_map + (b - pfs_sb.bitmap_start) * BLOCKDEV_BLOCK_SIZE,
+               BLOCKDEV_BLOCK_SIZE);
+    } else {
+        struct pfs_inode *inodes = (struct pfs_inode *) out;
+        int first = (int) (b - pfs_sb.inode_start) * PFS_INODES_PER_BLOCK;
+        for (int k = 0; k < PFS_INODES_PER_BLOCK; k++) {
+            pfs_inode_from_node(&inodes[k], &fs->nodes[first + k]);
         }
     }
 }
 
-static int nodefs_find_child(struct nodefs *fs, int parent_idx, const char *name) {
-    for (int i = 0; i < FS_MAX_NODES; i++) {
-        if (!fs->nodes[i].used) {
+static bool pfs_node_dirty(const struct fs_node *n) {
+    for (int w = 0; w < PFS_NODE_MAP_WORDS; w++) {
+        if (n->dirty[w]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copy up to PFS_SYNC_BATCH dirty blocks into the staging area and clear their
+// marks. Returns how many were staged.
+static int pfs_stage_dirty(struct nodefs *fs) {
+    int count = 0;
+
+    for (uint32_t b = 0; b < pfs_sb.data_start && count < PFS_SYNC_BATCH; b++) {
+        if (!pfs_map_test(pfs_meta_dirty, b)) {
             continue;
         }
-        if (fs->nodes[i].parent != parent_idx) {
+        pfs_map_clear(pfs_meta_dirty, b);
+        pfs_fill_meta(fs, b, pfs_stage_data[count]);
+        pfs_stage[count++] = (struct pfs_staged) { .block = b, .node = -1 };
+    }
+
+    for (int idx = 0; idx < FS_MAX_NODES && count < PFS_SYNC_BATCH; idx++) {
+        struct fs_node *n = &fs->nodes[idx];
+        if (!pfs_node_dirty(n)) {
             continue;
         }
-        if (strcmp(fs->nodes[i].name, name) == 0) {
-            return i;
+        for (uint32_t i = 0; i <= PFS_IND_SLOT && count < PFS_SYNC_BATCH; i++) {
+            if (!pfs_map_test(n->dirty, i)) {
+                continue;
+            }
+            pfs_map_clear(n->dirty, i);
+
+            uint32_t block;
+            const void *src;
+            if (i == PFS_IND_SLOT) {
+                block = n->disk_ind;
+                src = n->ind_disk;
+            } else {
+                uint32_t *disk = pfs_disk_slot(n, i);
+                uint8_t **slot = nodefs_block_slot(n, i, false);
+                block = disk ? *disk : 0;
+                src = slot ? *slot : NULL;
+            }
+            if (block == 0) {
+                continue;
+            }
+            if (src) {
+                memcpy(pfs_stage_data[count], src, BLOCKDEV_BLOCK_SIZE);
+            } else {
+                memset(pfs_stage_data[count], 0, BLOCKDEV_BLOCK_SIZE);
+            }
+            pfs_stage[count++] = (struct pfs_staged) { .block = block, .node = idx, .slot = i };
         }
     }
-    return -1;
+    return count;
 }
 
-static int nodefs_alloc_node(struct nodefs *fs) {
-    for (int i = 1; i < FS_MAX_NODES; i++) {
-        if (!fs->nodes[i].used) {
-            fs->nodes[i].used = 1;
-            fs->nodes[i].type = 0;
-            fs->nodes[i].parent = -1;
-            fs->nodes[i].size = 0;
-            memset(fs->nodes[i].name, 0, sizeof(fs->nodes[i].name));
-            memset(fs->nodes[i].data, 0, sizeof(fs->nodes[i].data));
-            return i;
+// Mark staged blocks [from, count) dirty again, unless the block they came from is gone.
+static void pfs_unstage(struct nodefs *fs, int from, int count) {
+    for (int k = from; k < count; k++) {
+        struct pfs_staged *s = &pfs_stage[k];
+        if (s->node < 0) {
+            pfs_mark_meta(s->block);
+            continue;
+        }
+        struct fs_node *n = &fs->nodes[s->node];
+        uint32_t *disk = s->slot == PFS_IND_SLOT ? &n->disk_ind : pfs_disk_slot(n, s->slot);
+        if (n->used && disk && *disk == s->block) {
+            pfs_mark_data(fs, n, s->slot);
         }
     }
-    return -1;
 }
 
-static int nodefs_resolve_path(struct nodefs *fs, const char *path) {
-    if (!path || path[0] != '/') {
-        return -1;
+// Only blocks marked through pfs_mark_*() since their last write are passed on,
+// into the block cache; the cache may have to write back to make room and sleep
+// on the disk. VFS operations only mark blocks, so they stay atomic under
+// fs_lock; this runs between them (kflushd, fsync/sync, shutdown), takes fs_lock
+// just to stage a batch and drops it around bcache_write(). A caller that finds
+// a writer in flight waits for it, then stages until nothing is left, so every
+// block marked before the call is in the cache when it returns 0.
+static int pfs_sync(struct nodefs *fs) {
+    if (!fs->persistent) {
+        return 0;
+    }
+    if (spin_holding(&fs_lock)) {
+        PANIC("pfs_sync inside a VFS operation");
     }
 
-    int cur = 0;
-    int pos = 0;
-    char name[FS_NAME_MAX];
-
-    while (1) {
-        int t = next_component(path, &pos, name);
-        if (t < 0) {
+    spin_lock(&pfs_io_lock);
+    while (pfs_io_busy) {
+        if (!process_can_block()) {
+            spin_unlock(&pfs_io_lock);
             return -1;
         }
-        if (t == 0) {
-            return cur;
+        wait_queue_sleep(&pfs_io_waiters, PROC_WAIT_BLOCK_IO, -1, &pfs_io_lock);
+    }
+    pfs_io_busy = true;
+    spin_unlock(&pfs_io_lock);
+
+    int ret = 0;
+    uint32_t total = 0;
+    spin_lock_recursive(&fs_lock);
+    while (ret == 0) {
+        int count = pfs_stage_dirty(fs);
+        if (count == 0) {
+            break;
         }
 
-        int child = nodefs_find_child(fs, cur, name);
-        if (child < 0) {
-            return -1;
+        int written = 0;
+        spin_unlock_recursive(&fs_lock);
+        for (; written < count; written++) {
+            if (bcache_write(pfs_stage[written].block, pfs_stage_data[written]) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+        spin_lock_recursive(&fs_lock);
+
+        total += (uint32_t) written;
+        if (ret < 0) {
+            // keep the failed blocks for the next sync
+            pfs_stats.errors++;
+            pfs_unstage(fs, written, count);
         }
-        cur = child;
     }
+
+    if (total > 0) {
+        pfs_stats.syncs++;
+        pfs_stats.blocks_written += total;
+        pfs_stats.bytes_written += total * BLOCKDEV_BLOCK_SIZE;
+        pfs_stats.last_sync_bytes = total * BLOCKDEV_BLOCK_SIZE;
+    }
+    spin_unlock_recursive(&fs_lock);
+
+    spin_lock(&pfs_io_lock);
+    pfs_io_busy = false;
+    spin_unlock(&pfs_io_lock);
+    wait_queue_wake_all(&pfs_io_waiters);
+    return ret;
 }
 
-static int nodefs_resolve_parent_and_leaf(struct nodefs *fs,
-                                          const char *path,
-                                          int *parent_out,
-                                          char *leaf_out) {
-    if (!path || !parent_out || !leaf_out) {
-        return -1;
+static int pfs_layout(struct pfs_super *sb) {
+    uint32_t total = blockdev_block_count();
+    if (total > PFS_MAX_BLOCKS) {
+        total = PFS_MAX_BLOCKS;
+    }
+
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = PFS_MAGIC;
+    sb->version = PFS_VERSION;
+    sb->total_blocks = total;
+    sb->bitmap_start = 1;
+    sb->bitmap_blocks = (total + PFS_BITS_PER_BLOCK - 1) / PFS_BITS_PER_BLOCK;
+    sb->inode_start = sb->bitmap_start + sb->bitmap_blocks;
+    sb->inode_blocks = PFS_INODE_BLOCKS;
+    sb->data_start = sb->inode_start + sb->inode_blocks;
+    return sb->data_start < total ? 0 : -1;
+}
+
+static bool pfs_super_matches(const struct pfs_super *sb) {
+    return sb->magic == pfs_sb.magic && sb->version == pfs_sb.version &&
+           sb->total_blocks == pfs_sb.total_blocks && sb->bitmap_start == pfs_sb.bitmap_start &&
+           sb->bitmap_blocks == pfs_sb.bitmap_blocks && sb->inode_start == pfs_sb.inode_start &&
+           sb->inode_blocks == pfs_sb.inode_blocks && sb->data_start == pfs_sb.data_start;
+}
+
+// Take block b for a loaded node. false: outside the data area, or already
+// owned by an earlier pointer (the volume was cut off mid write-back).
+static bool pfs_claim_block(uint32_t b) {
+    if (b < pfs_sb.data_start || b >= pfs_sb.total_blocks || pfs_map_test(pfs_free_map, b)) {
+        return false;
     }
-    if (path[0] != '/' || path[1] == '\0') {
-        return -1;
+    pfs_map_set(pfs_free_map, b);
+    return true;
+}
+
+// Boot reads bypass the (still empty) block cache and go out in batches of
+// single-block requests.
+static void pfs_load_flush(void) {
+    if (pfs_load_count > 0 && blockdev_submit(pfs_load_ios, pfs_load_count) < 0) {
+        PANIC("pfs block read failed");
     }
+    pfs_load_count = 0;
+}
 
-    int cur = 0;
-    int pos = 0;
-    char comp[FS_NAME_MAX];
+static void pfs_load_queue(uint32_t block, void *buf) {
+    pfs_load_ios[pfs_load_count++] = (struct blockdev_io) { .block_index = block, .buf = buf };
+    if (pfs_load_count == PFS_SYNC_BATCH) {
+        pfs_load_flush();
+    }
+}
 
-    int t = next_component(path, &pos, comp);
-    if (t <= 0) {
+// FNV-1a over a name, seeded with the key it lives under.
+static uint32_t name_hash(uint32_t seed, const char *name) {
+    uint32_t h = 2166136261u ^ seed;
+    for (; *name; name++) {
+        h = (h ^ (uint8_t) *name) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t nodefs_hash(int parent, const char *name) {
+    return name_hash((uint32_t) parent, name) & (NODEFS_HASH_BUCKETS - 1);
+}
+
+// Link a named node into its parent's child list (at the tail, so readdir keeps
+// creation order) and into the name hash.
+static void nodefs_attach(struct nodefs *fs, int idx) {
+    struct fs_node *n = &fs->nodes[idx];
+    struct fs_node *dir = &fs->nodes[n->parent];
+
+    n->next_sibling = 0;
+    n->prev_sibling = dir->last_child;
+    if (dir->last_child) {
+        fs->nodes[dir->last_child].next_sibling = idx;
+    } else {
+        dir->first_child = idx;
+    }
+    dir->last_child = idx;
+
+    uint32_t h = nodefs_hash(n->parent, n->name);
+    n->hash_next = fs->hash_heads[h];
+    fs->hash_heads[h] = idx;
+}
+
+static void nodefs_detach(struct nodefs *fs, int idx) {
+    struct fs_node *n = &fs->nodes[idx];
+    struct fs_node *dir = &fs->nodes[n->parent];
+
+    if (n->prev_sibling) {
+        fs->nodes[n->prev_sibling].next_sibling = n->next_sibling;
+    } else {
+        dir->first_child = n->next_sibling;
+    }
+    if (n->next_sibling) {
+        fs->nodes[n->next_sibling].prev_sibling = n->prev_sibling;
+    } else {
+        dir->last_child = n->prev_sibling;
+    }
+
+    int *link = &fs->hash_heads[nodefs_hash(n->parent, n->name)];
+    while (*link && *link != idx) {
+        link = &fs->nodes[*link].hash_next;
+    }
+    if (*link) {
+        *link = n->hash_next;
+    }
+}
+
+static void nodefs_format(struct nodefs *fs) {
+    memset(fs->nodes, 0, sizeof(fs->nodes));
+    memset(fs->hash_heads, 0, sizeof(fs->hash_heads));
+    fs->nodes[0].used = 1;
+    fs->nodes[0].type = FS_TYPE_DIR;
+    fs->nodes[0].parent = -1;
+    fs->nodes[0].name[0] = '/';
+    fs->nodes[0].name[1] = '\0';
+}
+
+static void pfs_drop_node(struct nodefs *fs, int idx) {
+    memset(&fs->nodes[idx], 0, sizeof(fs->nodes[idx]));
+    pfs_mark_inode(fs, idx);
+}
+
+// A loaded node is kept only if its parent chain reaches the root through
+// directories; anything else could never be looked up again.
+static bool pfs_node_reachable(struct nodefs *fs, int idx) {
+    for (int steps = 0; steps < FS_MAX_NODES; steps++) {
+        int parent = fs->nodes[idx].parent;
+        if (parent < 0 || parent >= FS_MAX_NODES || parent == idx || !fs->nodes[parent].used ||
+            fs->nodes[parent].type != FS_TYPE_DIR) {
+            return false;
+        }
+        if (parent == 0) {
+            return true;
+        }
+        idx = parent;
+    }
+    return false;
+}
+
+// Bring the inode table and every block it points at into RAM. -1: the disk
+// holds no v2 volume of this size. A matching volume is never thrown away:
+// the bitmap is rebuilt from the inodes, and anything a torn write-back left
+// inconsistent (bad inodes, orphans, stray or shared pointers) is dropped and
+// marked dirty so the next sync writes the repair.
+static int pfs_load(struct nodefs *fs) {
+    struct pfs_super sb;
+    pfs_load_count = 0;
+    pfs_load_queue(0, pfs_stage_data[0]);
+    pfs_load_flush();
+    memcpy(&sb, pfs_stage_data[0], sizeof(sb));
+    if (!pfs_super_matches(&sb)) {
         return -1;
     }
 
-    while (1) {
-        int saved_pos = pos;
-        char peek[FS_NAME_MAX];
-        int has_more = next_component(path, &saved_pos, peek);
-        if (has_more < 0) {
-            return -1;
+    for (uint32_t k = 0; k < pfs_sb.inode_blocks; k++) {
+        pfs_load_queue(pfs_sb.inode_start + k, pfs_stage_data[k]);
+    }
+    pfs_load_flush();
+
+    int repairs = 0;
+    const struct pfs_inode *inodes = (const struct pfs_inode *) pfs_stage_data;
+    for (int idx = 0; idx < FS_MAX_NODES; idx++) {
+        const struct pfs_inode *ino = &inodes[idx];
+        struct fs_node *n = &fs->nodes[idx];
+        if (!ino->used) {
+            continue;
+        }
+        if (ino->type != FS_TYPE_FILE && ino->type != FS_TYPE_DIR) {
+            pfs_mark_inode(fs, idx);
+            repairs++;
+            continue;
+        }
+        n->used = 1;
+        n->type = ino->type;
+        n->parent = ino->parent;
+        memcpy(n->name, ino->name, sizeof(n->name));
+        n->name[FS_NAME_MAX - 1] = '\0';
+        n->size = ino->size;
+        if (n->size > FS_FILE_MAX_SIZE) {
+            n->size = FS_FILE_MAX_SIZE;
+            pfs_mark_inode(fs, idx);
+            repairs++;
+        }
+        memcpy(n->disk, ino->direct, sizeof(n->disk));
+        n->disk_ind = ino->indirect;
+    }
+    if (!fs->nodes[0].used || fs->nodes[0].type != FS_TYPE_DIR || fs->nodes[0].parent != -1) {
+        pfs_drop_node(fs, 0);
+        fs->nodes[0].used = 1;
+        fs->nodes[0].type = FS_TYPE_DIR;
+        fs->nodes[0].parent = -1;
+        fs->nodes[0].name[0] = '/';
+        repairs++;
+    }
+    for (int idx = 1; idx < FS_MAX_NODES; idx++) {
+        if (fs->nodes[idx].used && !pfs_node_reachable(fs, idx)) {
+            pfs_drop_node(fs, idx);
+            repairs++;
         }
+    }
 
-        if (has_more == 0) {
-            *parent_out = cur;
-            return copy_name(leaf_out, comp);
+    // the bitmap is rebuilt from what the surviving inodes point at
+    memset(pfs_free_map, 0, sizeof(pfs_free_map));
+    for (uint32_t b = 0; b < pfs_sb.data_start; b++) {
+        pfs_map_set(pfs_free_map, b);
+    }
+    for (int idx = 0; idx < FS_MAX_NODES; idx++) {
+        struct fs_node *n = &fs->nodes[idx];
+        if (!n->used) {
+            continue;
+        }
+        for (int i = 0; i < PFS_DIRECT; i++) {
+            if (n->disk[i] != 0 && !pfs_claim_block(n->disk[i])) {
+                n->disk[i] = 0;
+                pfs_mark_inode(fs, idx);
+                repairs++;
+            }
+        }
+        if (n->disk_ind != 0) {
+            if (pfs_claim_block(n->disk_ind)) {
+                n->ind_disk = (uint32_t *) fs_pool_alloc();
+                pfs_load_queue(n->disk_ind, n->ind_disk);
+            } else {
+                n->disk_ind = 0;
+                pfs_mark_inode(fs, idx);
+                repairs++;
+            }
         }
+    }
+    pfs_load_flush();
 
-        int child = nodefs_find_child(fs, cur, comp);
-        if (child < 0 || fs->nodes[child].type != FS_TYPE_DIR) {
-            return -1;
+    for (int idx = 0; idx < FS_MAX_NODES; idx++) {
+        struct fs_node *n = &fs->nodes[idx];
+        if (!n->used) {
+            continue;
         }
+        if (idx != 0) {
+            nodefs_attach(fs, idx);
+        }
+        for (uint32_t i = 0; i < PFS_FILE_BLOCKS; i++) {
+            uint32_t *disk = pfs_disk_slot(n, i);
+            if (!disk) {
+                break;
+            }
+            if (*disk == 0) {
+                continue;
+            }
+            // direct pointers were claimed above
+            if (i >= PFS_DIRECT && !pfs_claim_block(*disk)) {
+                *disk = 0;
+                pfs_mark_data(fs, n, PFS_IND_SLOT);
+                repairs++;
+                continue;
+            }
+            uint8_t **slot = nodefs_block_slot(n, i, true);
+            *slot = (uint8_t *) fs_pool_alloc();
+            pfs_load_queue(*disk, *slot);
+        }
+    }
+    pfs_load_flush();
+
+    // rewrite the bitmap blocks that differ from the rebuilt map (this also
+    // hands back blocks a torn write-back left allocated but unreferenced)
+    for (uint32_t k = 0; k < pfs_sb.bitmap_blocks; k++) {
+        pfs_load_queue(pfs_sb.bitmap_start + k, pfs_stage_data[k]);
+    }
+    pfs_load_flush();
+    pfs_used_blocks = 0;
+    for (uint32_t b = 0; b < pfs_sb.total_blocks; b++) {
+        pfs_used_blocks += pfs_map_test(pfs_free_map, b) ? 1 : 0;
+    }
+    for (uint32_t k = 0; k < pfs_sb.bitmap_blocks; k++) {
+        const uint32_t *disk_map = (const uint32_t *) pfs_stage_data[k];
+        const uint32_t *map = pfs_free_map + k * (BLOCKDEV_BLOCK_SIZE / 4);
+        for (int w = 0; w < BLOCKDEV_BLOCK_SIZE / 4; w++) {
+            if (disk_map[w] != map[w]) {
+                pfs_mark_meta(pfs_sb.bitmap_start + k);
+                break;
+            }
+        }
+    }
 
-        cur = child;
-        pos = saved_pos;
-        if (copy_name(comp, peek) < 0) {
-            return -1;
+    if (repairs > 0) {
+        printf("[pfs] repaired %d inconsistent entries\n", repairs);
+    }
+    return 0;
+}
+
+// Fresh volume: only the metadata is in use, and all of it needs writing.
+static void pfs_format(struct nodefs *fs) {
+    for (int idx = 0; idx < FS_MAX_NODES; idx++) {
+        nodefs_free_blocks(fs, idx);
+    }
+    nodefs_format(fs);
+
+    memset(pfs_free_map, 0, sizeof(pfs_free_map));
+    memset(pfs_meta_dirty, 0, sizeof(pfs_meta_dirty));
+    for (uint32_t b = 0; b < pfs_sb.data_start; b++) {
+        pfs_map_set(pfs_free_map, b);
+        pfs_mark_meta(b);
+    }
+    pfs_used_blocks = pfs_sb.data_start;
+    pfs_alloc_hint = pfs_sb.data_start;
+}
+
+static void nodefs_init_instance(struct nodefs *fs, int persistent) {
+    memset(fs, 0, sizeof(*fs));
+    fs->mount_idx = -1;
+    fs->persistent = persistent;
+
+    if (!persistent) {
+        nodefs_format(fs);
+        return;
+    }
+
+    if (pfs_layout(&pfs_sb) < 0) {
+        PANIC("block device too small for pfs");
+    }
+    pfs_alloc_hint = pfs_sb.data_start;
+    // only a missing or foreign superblock formats; anything else is repaired
+    if (pfs_load(fs) < 0) {
+        printf("[pfs] no v2 volume of %d blocks, formatting\n", (int) pfs_sb.total_blocks);
+        pfs_format(fs);
+        if (pfs_sync(fs) < 0) {
+            PANIC("pfs initial sync failed");
+        }
+    }
+}
+
+
+static int nodefs_find_child(struct nodefs *fs, int parent_idx, const char *name) {
+    int i = fs->hash_heads[nodefs_hash(parent_idx, name)];
+    for (; i; i = fs->nodes[i].hash_next) {
+        if (fs->nodes[i].parent == parent_idx && strcmp(fs->nodes[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int nodefs_alloc_node(struct nodefs *fs) {
+    for (int i = 1; i < FS_MAX_NODES; i++) {
+        if (!fs->nodes[i].used) {
+            memset(&fs->nodes[i], 0, sizeof(fs->nodes[i]));
+            fs->nodes[i].used = 1;
+            fs->nodes[i].parent = -1;
+            return i;
         }
     }
+    return -1;
+}
+
+static bool nodefs_is_dir(struct nodefs *fs, int idx) {
+    return idx >= 0 && idx < FS_MAX_NODES && fs->nodes[idx].used && fs->nodes[idx].type == FS_TYPE_DIR;
 }
 
 static int nodefs_is_node_open(struct nodefs *fs, int node_index) {
@@ -353,19 +968,21 @@ static int nodefs_is_node_open(struct nodefs *fs, int node_index) {
 }
 
 static int nodefs_is_dir_empty(struct nodefs *fs, int node_index) {
-    for (int i = 0; i < FS_MAX_NODES; i++) {
-        if (!fs->nodes[i].used) {
-            continue;
-        }
-        if (fs->nodes[i].parent == node_index) {
-            return 0;
-        }
+    return fs->nodes[node_index].first_child == 0;
+}
+
+static int nodefs_lookup(void *ctx, int dir, const char *name) {
+    struct nodefs *fs = (struct nodefs *) ctx;
+
+    if (!nodefs_is_dir(fs, dir)) {
+        return -1;
     }
-    return 1;
+    return nodefs_find_child(fs, dir, name);
 }
 
 static int nodefs_open(void *ctx,
-                       const char *path,
+                       int dir,
+                       const char *name,
                        int flags,
                        int *node_out,
                        uint32_t *offset_out) {
@@ -374,36 +991,29 @@ static int nodefs_open(void *ctx,
     if ((flags & (O_RDONLY | O_WRONLY)) == 0) {
         flags |= O_RDONLY;
     }
+    if (!nodefs_is_dir(fs, dir) || name[0] == '\0') {
+        return -1;
+    }
 
-    int node = nodefs_resolve_path(fs, path);
+    int node = nodefs_find_child(fs, dir, name);
     if (node < 0) {
         if ((flags & O_CREAT) == 0) {
             return -1;
         }
 
-        int parent = -1;
-        char leaf[FS_NAME_MAX];
-        if (nodefs_resolve_parent_and_leaf(fs, path, &parent, leaf) < 0) {
-            return -1;
-        }
-        if (nodefs_find_child(fs, parent, leaf) >= 0) {
-            return -1;
-        }
-
         int idx = nodefs_alloc_node(fs);
         if (idx < 0) {
             return -1;
         }
 
         fs->nodes[idx].type = FS_TYPE_FILE;
-        fs->nodes[idx].parent = parent;
-        if (copy_name(fs->nodes[idx].name, leaf) < 0) {
+        fs->nodes[idx].parent = dir;
+        if (copy_name(fs->nodes[idx].name, name) < 0) {
             fs->nodes[idx].used = 0;
             return -1;
         }
-        if (pfs_sync(fs) < 0) {
-            return -1;
-        }
+        nodefs_attach(fs, idx);
+        pfs_mark_inode(fs, idx);
         node = idx;
     }
 
@@ -412,11 +1022,7 @@ static int nodefs_open(void *ctx,
     }
 
     if ((flags & O_TRUNC) && (flags & O_WRONLY)) {
-        fs->nodes[node].size = 0;
-        memset(fs->nodes[node].data, 0, sizeof(fs->nodes[node].data));
-        if (pfs_sync(fs) < 0) {
-            return -1;
-        }
+        nodefs_free_blocks(fs, node);
     }
 
     *node_out = node;
@@ -446,7 +1052,22 @@ static int nodefs_read(void *ctx, int node, uint32_t *offset, void *buf, size_t
         to_read = remain;
     }
 
-    memcpy(buf, &n->data[*offset], to_read);
+    uint8_t *dst = (uint8_t *) buf;
+    for (uint32_t done = 0; done < to_read;) {
+        uint32_t pos = *offset + done;
+        uint32_t off = pos % BLOCKDEV_BLOCK_SIZE;
+        uint32_t chunk = BLOCKDEV_BLOCK_SIZE - off;
+        if (chunk > to_read - done) {
+            chunk = to_read - done;
+        }
+        const uint8_t *block = nodefs_get_block(fs, node, pos / BLOCKDEV_BLOCK_SIZE, false);
+        if (block) {
+            memcpy(dst + done, block + off, chunk);
+        } else {
+            memset(dst + done, 0, chunk);
+        }
+        done += chunk;
+    }
     *offset += to_read;
     return (int) to_read;
 }
@@ -477,30 +1098,43 @@ static int nodefs_write(void *ctx,
         to_write = writable;
     }
 
-    memcpy(&n->data[*offset], buf, to_write);
-    *offset += to_write;
+    const uint8_t *src = (const uint8_t *) buf;
+    uint32_t done = 0;
+    while (done < to_write) {
+        uint32_t pos = *offset + done;
+        uint32_t off = pos % BLOCKDEV_BLOCK_SIZE;
+        uint32_t chunk = BLOCKDEV_BLOCK_SIZE - off;
+        if (chunk > to_write - done) {
+            chunk = to_write - done;
+        }
+        uint8_t *block = nodefs_get_block(fs, node, pos / BLOCKDEV_BLOCK_SIZE, true);
+        if (!block) {
+            break;      // pfs volume full
+        }
+        memcpy(block + off, src + done, chunk);
+        pfs_mark_data(fs, n, pos / BLOCKDEV_BLOCK_SIZE);
+        done += chunk;
+    }
+    *offset += done;
     if (*offset > n->size) {
         n->size = *offset;
+        pfs_mark_inode(fs, node);
     }
 
-    if (pfs_sync(fs) < 0) {
+    if (done == 0 && to_write > 0) {
         return -1;
     }
 
-    return (int) to_write;
+    return (int) done;
 }
 
-static int nodefs_mkdir(void *ctx, const char *path) {
+static int nodefs_mkdir(void *ctx, int dir, const char *name) {
     struct nodefs *fs = (struct nodefs *) ctx;
 
-    int parent = -1;
-    char leaf[FS_NAME_MAX];
-
-    if (nodefs_resolve_parent_and_leaf(fs, path, &parent, leaf) < 0) {
+    if (!nodefs_is_dir(fs, dir) || name[0] == '\0') {
         return -1;
     }
-
-    if (nodefs_find_child(fs, parent, leaf) >= 0) {
+    if (nodefs_find_child(fs, dir, name) >= 0) {
         return -1;
     }
 
@@ -510,55 +1144,43 @@ static int nodefs_mkdir(void *ctx, const char *path) {
     }
 
     fs->nodes[idx].type = FS_TYPE_DIR;
-    fs->nodes[idx].parent = parent;
-    if (copy_name(fs->nodes[idx].name, leaf) < 0) {
+    fs->nodes[idx].parent = dir;
+    if (copy_name(fs->nodes[idx].name, name) < 0) {
         fs->nodes[idx].used = 0;
         return -1;
     }
+    nodefs_attach(fs, idx);
 
-    if (pfs_sync(fs) < 0) {
-        return -1;
-    }
-
+    pfs_mark_inode(fs, idx);
     return 0;
 }
 
-static int nodefs_readdir(void *ctx, const char *path, int index, struct fs_dirent *out) {
+static int nodefs_readdir(void *ctx, int dir, int index, struct fs_dirent *out) {
     struct nodefs *fs = (struct nodefs *) ctx;
 
-    if (index < 0) {
+    if (index < 0 || !nodefs_is_dir(fs, dir)) {
         return -1;
     }
 
-    int dir = nodefs_resolve_path(fs, path);
-    if (dir < 0 || fs->nodes[dir].type != FS_TYPE_DIR) {
-        return -1;
+    int i = fs->nodes[dir].first_child;
+    for (; i && index > 0; index--) {
+        i = fs->nodes[i].next_sibling;
     }
-
-    int seen = 0;
-    for (int i = 0; i < FS_MAX_NODES; i++) {
-        if (!fs->nodes[i].used || fs->nodes[i].parent != dir) {
-            continue;
-        }
-
-        if (seen == index) {
-            memset(out, 0, sizeof(*out));
-            copy_name(out->name, fs->nodes[i].name);
-            out->type = fs->nodes[i].type;
-            out->size = fs->nodes[i].size;
-            return 0;
-        }
-
-        seen++;
+    if (!i) {
+        return -1;
     }
 
-    return -1;
+    memset(out, 0, sizeof(*out));
+    copy_name(out->name, fs->nodes[i].name);
+    out->type = fs->nodes[i].type;
+    out->size = fs->nodes[i].size;
+    return 0;
 }
 
-static int nodefs_unlink(void *ctx, const char *path) {
+static int nodefs_unlink(void *ctx, int dir, const char *name) {
     struct nodefs *fs = (struct nodefs *) ctx;
 
-    int node = nodefs_resolve_path(fs, path);
+    int node = nodefs_lookup(ctx, dir, name);
     if (node <= 0) {
         return -1;
     }
@@ -569,17 +1191,17 @@ static int nodefs_unlink(void *ctx, const char *path) {
         return -1;
     }
 
+    nodefs_detach(fs, node);
+    nodefs_free_blocks(fs, node);
     memset(&fs->nodes[node], 0, sizeof(fs->nodes[node]));
-    if (pfs_sync(fs) < 0) {
-        return -1;
-    }
+    pfs_mark_inode(fs, node);
     return 0;
 }
 
-static int nodefs_rmdir(void *ctx, const char *path) {
+static int nodefs_rmdir(void *ctx, int dir, const char *name) {
     struct nodefs *fs = (struct nodefs *) ctx;
 
-    int node = nodefs_resolve_path(fs, path);
+    int node = nodefs_lookup(ctx, dir, name);
     if (node <= 0) {
         return -1;
     }
@@ -590,14 +1212,19 @@ static int nodefs_rmdir(void *ctx, const char *path) {
         return -1;
     }
 
+    nodefs_detach(fs, node);
+    nodefs_free_blocks(fs, node);
     memset(&fs->nodes[node], 0, sizeof(fs->nodes[node]));
-    if (pfs_sync(fs) < 0) {
-        return -1;
-    }
+    pfs_mark_inode(fs, node);
     return 0;
 }
 
+static int nodefs_sync(void *ctx) {
+    return pfs_sync((struct nodefs *) ctx);
+}
+
 static const struct vfs_ops nodefs_ops = {
+    .lookup = nodefs_lookup,
     .open = nodefs_open,
     .read = nodefs_read,
     .write = nodefs_write,
@@ -605,95 +1232,189 @@ static const struct vfs_ops nodefs_ops = {
     .readdir = nodefs_readdir,
     .unlink = nodefs_unlink,
     .rmdir = nodefs_rmdir,
+    .sync = nodefs_sync,
 };
 
-static int vfs_mount(const char *path, const struct vfs_ops *ops, void *ctx) {
-    if (!path || !ops || !ctx) {
-        return -1;
+static uint32_t vfs_dentry_slot(int mount_idx, int parent, const char *name) {
+    return name_hash(((uint32_t) mount_idx << 16) ^ (uint32_t) parent, name) & (VFS_DCACHE_SIZE - 1);
+}
+
+static void vfs_dcache_drop(int mount_idx, int parent, const char *name) {
+    struct vfs_dentry *d = &dcache[vfs_dentry_slot(mount_idx, parent, name)];
+    if (d->used && d->mount_idx == mount_idx && d->parent == parent && strcmp(d->name, name) == 0) {
+        d->used = 0;
+    }
+}
+
+// Step from directory (*m, *node) to its child `name`. A child that is a
+// mountpoint comes back as the root of the mount covering it.
+static int vfs_lookup(int *m, int *node, const char *name) {
+    struct vfs_dentry *d = &dcache[vfs_dentry_slot(*m, *node, name)];
+    if (d->used && d->mount_idx == *m && d->parent == *node && strcmp(d->name, name) == 0) {
+        *m = d->target_mount;
+        *node = d->target_node;
+        return 0;
     }
 
-    int path_len = str_len(path);
-    if (path_len <= 0 || path_len >= FS_PATH_MAX || path[0] != '/') {
+    int child = mounts[*m].ops->lookup(mounts[*m].ctx, *node, name);
+    if (child < 0) {
         return -1;
     }
 
+    d->used = 1;
+    d->mount_idx = *m;
+    d->parent = *node;
+    copy_name(d->name, name);
+    d->target_mount = *m;
+    d->target_node = child;
     for (int i = 0; i < VFS_MOUNT_MAX; i++) {
-        if (!mounts[i].used) {
-            mounts[i].used = 1;
-            mounts[i].path_len = path_len;
-            mounts[i].ops = ops;
-            mounts[i].ctx = ctx;
-            memset(mounts[i].path, 0, sizeof(mounts[i].path));
-            for (int j = 0; j < path_len; j++) {
-                mounts[i].path[j] = path[j];
-            }
-
-            ((struct nodefs *) ctx)->mount_idx = i;
-            return 0;
+        if (mounts[i].used && mounts[i].covered_mount == *m && mounts[i].covered_node == child) {
+            d->target_mount = i;
+            d->target_node = 0;
+            break;
         }
     }
 
-    return -1;
+    *m = d->target_mount;
+    *node = d->target_node;
+    return 0;
 }
 
-static int vfs_match_mount(struct vfs_mount *m, const char *path) {
-    if (m->path_len == 1 && m->path[0] == '/') {
-        return 1;
-    }
+// Walk every component of path but the last: (*m_out, *dir_out) is the
+// directory holding it and leaf_out its name. Absolute paths start at the root
+// mount, relative ones at pid's cwd node. A path that names a directory by
+// itself ("/", ".", a mountpoint) comes back as that directory with an empty
+// leaf. ".." is not understood here: the user runtime folds it away.
+static int vfs_walk(int pid, const char *path, int *m_out, int *dir_out, char *leaf_out) {
+    int m;
+    int dir;
 
-    for (int i = 0; i < m->path_len; i++) {
-        if (path[i] != m->path[i]) {
-            return 0;
+    if (!path || path[0] == '\0') {
+        return -1;
+    }
+    if (path[0] == '/') {
+        m = vfs_root_mount;
+        dir = 0;
+    } else {
+        if (pid < 0 || pid >= PROCS_MAX) {
+            return -1;
         }
+        m = procs[pid].cwd_mount_idx;
+        dir = procs[pid].cwd_node_idx;
     }
-
-    char next = path[m->path_len];
-    return next == '\0' || next == '/';
-}
-
-static int vfs_resolve_mount(const char *path,
-                             struct vfs_mount **mount_out,
-                             const char **subpath_out) {
-    if (!path || path[0] != '/') {
+    if (m < 0 || m >= VFS_MOUNT_MAX || !mounts[m].used) {
         return -1;
     }
 
-    struct vfs_mount *best = NULL;
-    int best_len = -1;
-
-    for (int i = 0; i < VFS_MOUNT_MAX; i++) {
-        if (!mounts[i].used) {
-            continue;
+    int pos = 0;
+    char name[FS_NAME_MAX];
+    leaf_out[0] = '\0';
+    while (1) {
+        int t = next_component(path, &pos, name);
+        if (t < 0) {
+            return -1;
+        }
+        if (t == 0) {
+            break;
         }
-        if (!vfs_match_mount(&mounts[i], path)) {
+        if (strcmp(name, ".") == 0) {
             continue;
         }
-        if (mounts[i].path_len > best_len) {
-            best = &mounts[i];
-            best_len = mounts[i].path_len;
+        if (strcmp(name, "..") == 0) {
+            return -1;
+        }
+        if (leaf_out[0] != '\0' && vfs_lookup(&m, &dir, leaf_out) < 0) {
+            return -1;
+        }
+        copy_name(leaf_out, name);
+    }
+
+    if (leaf_out[0] != '\0') {
+        int sub_m = m;
+        int sub_dir = dir;
+        if (vfs_lookup(&sub_m, &sub_dir, leaf_out) == 0 && sub_m != m) {
+            m = sub_m;
+            dir = sub_dir;
+            leaf_out[0] = '\0';
         }
     }
 
-    if (!best) {
+    *m_out = m;
+    *dir_out = dir;
+    return 0;
+}
+
+// Like vfs_walk, but down to the node the path names.
+static int vfs_walk_node(int pid, const char *path, int *m_out, int *node_out) {
+    char leaf[FS_NAME_MAX];
+
+    if (vfs_walk(pid, path, m_out, node_out, leaf) < 0) {
         return -1;
     }
+    if (leaf[0] != '\0' && vfs_lookup(m_out, node_out, leaf) < 0) {
+        return -1;
+    }
+    return 0;
+}
 
-    const char *subpath;
-    if (best_len == 1) {
-        subpath = path;
+static int vfs_mount(const char *path, const struct vfs_ops *ops, void *ctx) {
+    int covered_mount = -1;
+    int covered_node = -1;
+
+    if (!path || !ops || !ctx) {
+        return -1;
+    }
+
+    if (vfs_root_mount < 0) {
+        if (strcmp(path, "/") != 0) {
+            return -1;
+        }
     } else {
-        subpath = path + best_len;
-        if (*subpath == '\0') {
-            subpath = "/";
+        // the mountpoint must be a plain directory of an existing mount
+        char leaf[FS_NAME_MAX];
+        if (vfs_walk(-1, path, &covered_mount, &covered_node, leaf) < 0 || leaf[0] == '\0') {
+            return -1;
+        }
+        if (vfs_lookup(&covered_mount, &covered_node, leaf) < 0) {
+            return -1;
+        }
+        struct nodefs *fs = (struct nodefs *) mounts[covered_mount].ctx;
+        if (fs->nodes[covered_node].type != FS_TYPE_DIR) {
+            return -1;
         }
     }
 
-    if (subpath[0] != '/') {
-        return -1;
+    for (int i = 0; i < VFS_MOUNT_MAX; i++) {
+        if (!mounts[i].used) {
+            mounts[i].used = 1;
+            mounts[i].covered_mount = covered_mount;
+            mounts[i].covered_node = covered_node;
+            mounts[i].ops = ops;
+            mounts[i].ctx = ctx;
+            if (covered_mount < 0) {
+                vfs_root_mount = i;
+            }
+
+            ((struct nodefs *) ctx)->mount_idx = i;
+            // cached lookups of the mountpoint still lead to the covered directory
+            memset(dcache, 0, sizeof(dcache));
+            return 0;
+        }
     }
 
-    *mount_out = best;
-    *subpath_out = subpath;
+    return -1;
+}
+
+// rmdir must not pull the directory out from under a live process.
+static int vfs_is_cwd(int m, int node) {
+    for (int i = 0; i < PROCS_MAX; i++) {
+        if (procs[i].state == PROC_UNUSED || procs[i].state == PROC_EXITED) {
+            continue;
+        }
+        if (procs[i].cwd_mount_idx == m && procs[i].cwd_node_idx == node) {
+            return 1;
+        }
+    }
     return 0;
 }
 
@@ -721,6 +1442,8 @@ void fs_init(void) {
     printf("     [fs] reset fd/mount tables...");
     memset(fd_table, 0, sizeof(fd_table));
     memset(mounts, 0, sizeof(mounts));
+    memset(dcache, 0, sizeof(dcache));
+    vfs_root_mount = -1;
     printf("OK\n");
 
     printf("     [fs] init block device (virtio-blk)...");
@@ -751,9 +1474,9 @@ void fs_init(void) {
 
     // mount tmpfs
     // Ensure mountpoint exists in root namespace for `ls /`.
-    if (nodefs_resolve_path(&rootfs, "/tmp") < 0) {
+    if (nodefs_find_child(&rootfs, 0, "tmp") < 0) {
         printf("     [fs] create mountpoint: /tmp ...");
-        (void) nodefs_mkdir(&rootfs, "/tmp");
+        (void) nodefs_mkdir(&rootfs, 0, "tmp");
         printf("OK\n");
     }
     printf("     [fs] mount: tmpfs -> /tmp ...");
@@ -764,9 +1487,9 @@ void fs_init(void) {
 
     // mount procfs
     // Ensure mountpoint exists in root namespace for `ls /`.
-    if (nodefs_resolve_path(&rootfs, "/proc") < 0) {
+    if (nodefs_find_child(&rootfs, 0, "proc") < 0) {
         printf("      [fs] create mountpoint: /proc ...");
-        (void) nodefs_mkdir(&rootfs, "/proc");
+        (void) nodefs_mkdir(&rootfs, 0, "proc");
         printf("OK\n");
     }
     printf("     [fs] mount: procfs -> /proc ...");
@@ -776,7 +1499,7 @@ void fs_init(void) {
     printf("OK\n");
 }
 
-int fs_fork_copy_fds(int parent_pid, int child_pid) {
+static int fs_fork_copy_fds_locked(int parent_pid, int child_pid) {
     if (parent_pid < 0 || parent_pid >= PROCS_MAX) {
         return -1;
     }
@@ -790,27 +1513,31 @@ int fs_fork_copy_fds(int parent_pid, int child_pid) {
     return 0;
 }
 
-int fs_open(int pid, const char *path, int flags) {
-    struct vfs_mount *m = NULL;
-    const char *subpath = NULL;
+static int fs_open_locked(int pid, const char *path, int flags) {
+    int m;
+    int dir;
+    char leaf[FS_NAME_MAX];
 
     if (pid < 0 || pid >= PROCS_MAX || !path) {
         return -1;
     }
-    if (vfs_resolve_mount(path, &m, &subpath) < 0) {
+    if (vfs_walk(pid, path, &m, &dir, leaf) < 0) {
         return -1;
     }
+    if (mounts[m].ctx == &procfs && dir == 0 && leaf[0] != '\0' && (flags & O_WRONLY) == 0) {
+        (void) procfs_on_open(pid, leaf);
+    }
 
     int node = -1;
     uint32_t offset = 0;
-    if (m->ops->open(m->ctx, subpath, flags, &node, &offset) < 0) {
+    if (mounts[m].ops->open(mounts[m].ctx, dir, leaf, flags, &node, &offset) < 0) {
         return -1;
     }
 
-    return vfs_alloc_fd(pid, (int) (m - mounts), node, offset, flags);
+    return vfs_alloc_fd(pid, m, node, offset, flags);
 }
 
-int fs_close(int pid, int fd) {
+static int fs_close_locked(int pid, int fd) {
     if (pid < 0 || pid >= PROCS_MAX) {
         return -1;
     }
@@ -826,7 +1553,7 @@ int fs_close(int pid, int fd) {
     return 0;
 }
 
-int fs_read(int pid, int fd, void *buf, size_t size) {
+static int fs_read_locked(int pid, int fd, void *buf, size_t size) {
     if (pid < 0 || pid >= PROCS_MAX || !buf) {
         return -1;
     }
@@ -834,7 +1561,7 @@ int fs_read(int pid, int fd, void *buf, size_t size) {
         return -1;
     }
     if (!fd_table[pid][fd].used) {
-        return (fd == 0) ? console_read_fallback(buf, size) : -1;
+        return -1;
     }
 
     struct vfs_fd *f = &fd_table[pid][fd];
@@ -853,7 +1580,7 @@ int fs_read(int pid, int fd, void *buf, size_t size) {
                                           size);
 }
 
-int fs_write(int pid, int fd, const void *buf, size_t size) {
+static int fs_write_locked(int pid, int fd, const void *buf, size_t size) {
     if (pid < 0 || pid >= PROCS_MAX || !buf) {
         return -1;
     }
@@ -880,63 +1607,83 @@ int fs_write(int pid, int fd, const void *buf, size_t size) {
                                            size);
 }
 
-int fs_mkdir(const char *path) {
-    struct vfs_mount *m = NULL;
-    const char *subpath = NULL;
+static int fs_mkdir_locked(int pid, const char *path) {
+    int m;
+    int dir;
+    char leaf[FS_NAME_MAX];
 
-    if (!path) {
-        return -1;
-    }
-    if (vfs_resolve_mount(path, &m, &subpath) < 0) {
+    if (vfs_walk(pid, path, &m, &dir, leaf) < 0) {
         return -1;
     }
 
-    return m->ops->mkdir(m->ctx, subpath);
+    return mounts[m].ops->mkdir(mounts[m].ctx, dir, leaf);
 }
 
-int fs_readdir(const char *path, int index, struct fs_dirent *out) {
-    struct vfs_mount *m = NULL;
-    const char *subpath = NULL;
+static int fs_readdir_locked(int pid, const char *path, int index, struct fs_dirent *out) {
+    int m;
+    int dir;
 
-    if (!path || !out || index < 0) {
+    if (!out || index < 0) {
         return -1;
     }
-    if (vfs_resolve_mount(path, &m, &subpath) < 0) {
+    if (vfs_walk_node(pid, path, &m, &dir) < 0) {
         return -1;
     }
 
-    return m->ops->readdir(m->ctx, subpath, index, out);
+    return mounts[m].ops->readdir(mounts[m].ctx, dir, index, out);
 }
 
-int fs_unlink(const char *path) {
-    struct vfs_mount *m = NULL;
-    const char *subpath = NULL;
+static int fs_unlink_locked(int pid, const char *path) {
+    int m;
+    int dir;
+    char leaf[FS_NAME_MAX];
 
-    if (!path) {
+    if (vfs_walk(pid, path, &m, &dir, leaf) < 0) {
         return -1;
     }
-    if (vfs_resolve_mount(path, &m, &subpath) < 0) {
+    // backends fail only before detaching the node, so the entry is stale exactly on success
+    if (mounts[m].ops->unlink(mounts[m].ctx, dir, leaf) < 0) {
         return -1;
     }
 
-    return m->ops->unlink(m->ctx, subpath);
+    vfs_dcache_drop(m, dir, leaf);
+    return 0;
 }
 
-int fs_rmdir(const char *path) {
-    struct vfs_mount *m = NULL;
-    const char *subpath = NULL;
+static int fs_rmdir_locked(int pid, const char *path) {
+    int m;
+    int dir;
+    char leaf[FS_NAME_MAX];
+
+    if (vfs_walk(pid, path, &m, &dir, leaf) < 0 || leaf[0] == '\0') {
+        return -1;
+    }
 
-    if (!path) {
+    int node_m = m;
+    int node = dir;
+    if (vfs_lookup(&node_m, &node, leaf) < 0 || vfs_is_cwd(node_m, node)) {
         return -1;
     }
-    if (vfs_resolve_mount(path, &m, &subpath) < 0) {
+    if (mounts[m].ops->rmdir(mounts[m].ctx, dir, leaf) < 0) {
         return -1;
     }
 
-    return m->ops->rmdir(m->ctx, subpath);
+    vfs_dcache_drop(m, dir, leaf);
+    return 0;
 }
 
-int fs_dup2(int pid, int old_fd, int new_fd) {
+// Mount index of an open fd, or -1.
+static int fs_fd_mount_locked(int pid, int fd) {
+    if (pid < 0 || pid >= PROCS_MAX) {
+        return -1;
+    }
+    if (fd < 0 || fd >= FS_FD_MAX || !fd_table[pid][fd].used) {
+        return -1;
+    }
+    return fd_table[pid][fd].mount_idx;
+}
+
+static int fs_dup2_locked(int pid, int old_fd, int new_fd) {
     if (pid < 0 || pid >= PROCS_MAX) return -1;
     if ((old_fd < 0 || old_fd >= FS_FD_MAX) || !fd_table[pid][old_fd].used) return -1;
     if (new_fd < 0 || new_fd >= FS_FD_MAX) return -1;
@@ -945,7 +1692,7 @@ int fs_dup2(int pid, int old_fd, int new_fd) {
 
     // close if new fd is already used
     if (fd_table[pid][new_fd].used) {
-        if (fs_close(pid, new_fd) < 0) {
+        if (fs_close_locked(pid, new_fd) < 0) {
             return -1;
         }
     }
@@ -955,7 +1702,7 @@ int fs_dup2(int pid, int old_fd, int new_fd) {
     return new_fd;
 }
 
-void fs_on_process_recycle(int pid) {
+static void fs_on_process_recycle_locked(int pid) {
     if (pid < 0 || pid >= PROCS_MAX) {
         return;
     }
@@ -969,38 +1716,196 @@ void fs_on_process_recycle(int pid) {
     }
 }
 
-uint32_t fs_get_pfs_image_blocks(void) {
-    return (uint32_t) pfs_block_count();
+uint32_t fs_get_pfs_volume_blocks(void) {
+    return pfs_sb.total_blocks;
 }
 
-int fs_get_root_entry(int *mount_idx, int *node_idx) {
-    if (!mount_idx || !node_idx) return -1;
-    struct vfs_mount *m = NULL;
-    const char *subpath = NULL;
+uint32_t fs_get_pfs_used_blocks(void) {
+    spin_lock_recursive(&fs_lock);
+    uint32_t used = pfs_used_blocks;
+    spin_unlock_recursive(&fs_lock);
+    return used;
+}
 
-    if (vfs_resolve_mount("/", &m, &subpath) < 0) return -1;
+void fs_get_pfs_stats(struct pfs_stats *out) {
+    spin_lock_recursive(&fs_lock);
+    *out = pfs_stats;
+    out->used_blocks = pfs_used_blocks;
+    out->total_blocks = pfs_sb.total_blocks;
+    out->dirty_blocks = 0;
+    for (uint32_t b = 0; b < pfs_sb.data_start; b++) {
+        out->dirty_blocks += pfs_map_test(pfs_meta_dirty, b) ? 1 : 0;
+    }
+    for (int idx = 0; idx < FS_MAX_NODES; idx++) {
+        const struct fs_node *n = &rootfs.nodes[idx];
+        for (uint32_t i = 0; pfs_node_dirty(n) && i <= PFS_IND_SLOT; i++) {
+            out->dirty_blocks += pfs_map_test(n->dirty, i) ? 1 : 0;
+        }
+    }
+    spin_unlock_recursive(&fs_lock);
+}
 
-    struct nodefs *fs = (struct nodefs *)m->ctx;
-    int node = nodefs_resolve_path(fs, "/");
-    if (node < 0 || fs->nodes[node].type != FS_TYPE_DIR) return -1;
+static int fs_get_root_entry_locked(int *mount_idx, int *node_idx) {
+    if (!mount_idx || !node_idx) return -1;
+    if (vfs_root_mount < 0) return -1;
 
-    *mount_idx = fs->mount_idx;
-    *node_idx = node;
+    *mount_idx = vfs_root_mount;
+    *node_idx = 0;
     return 0;
 }
 
-int fs_get_path_entry(int *mount_idx, int *node_idx, const char *path) {
+static int fs_get_path_entry_locked(int pid, int *mount_idx, int *node_idx, const char *path) {
     if (!mount_idx || !node_idx || !path) return -1;
-    struct vfs_mount *m = NULL;
-    const char *subpath = NULL;
+    int m;
+    int node;
 
-    if (vfs_resolve_mount(path, &m, &subpath) < 0) return -1;
+    if (vfs_walk_node(pid, path, &m, &node) < 0) return -1;
 
-    struct nodefs *fs = (struct nodefs *)m->ctx;
-    int node = nodefs_resolve_path(fs, subpath);
-    if (node < 0 || fs->nodes[node].type != FS_TYPE_DIR) return -1;
+    struct nodefs *fs = (struct nodefs *)mounts[m].ctx;
+    if (fs->nodes[node].type != FS_TYPE_DIR) return -1;
 
-    *mount_idx = fs->mount_idx;
+    *mount_idx = m;
     *node_idx = node;
     return 0;
 }
+
+// Locked entry points.
+
+int fs_fork_copy_fds(int parent_pid, int child_pid) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_fork_copy_fds_locked(parent_pid, child_pid);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
+
+int fs_open(int pid, const char *path, int flags) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_open_locked(pid, path, flags);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
+
+int fs_close(int pid, int fd) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_close_locked(pid, fd);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
+
+int fs_read(int pid, int fd, void *buf, size_t size) {
+    spin_lock_recursive(&fs_lock);
+    // stdin without a redirect blocks on the console: never sleep holding fs_lock
+    bool console = pid >= 0 && pid < PROCS_MAX && fd == 0 && buf && !fd_table[pid][fd].used;
+    int ret = console ? 0 : fs_read_locked(pid, fd, buf, size);
+    spin_unlock_recursive(&fs_lock);
+
+    if (console) {
+        return console_read_fallback(buf, size);
+    }
+    return ret;
+}
+
+int fs_write(int pid, int fd, const void *buf, size_t size) {
+    spin_lock_recursive(&fs_lock);
+    // stdout without a redirect goes to the console as one bulk write, outside fs_lock
+    bool console = pid >= 0 && pid < PROCS_MAX && fd == 1 && buf && !fd_table[pid][fd].used;
+    int ret = console ? 0 : fs_write_locked(pid, fd, buf, size);
+    spin_unlock_recursive(&fs_lock);
+
+    if (console) {
+        return console_write_fallback(buf, size);
+    }
+    return ret;
+}
+
+int fs_mkdir(int pid, const char *path) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_mkdir_locked(pid, path);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
+
+int fs_readdir(int pid, const char *path, int index, struct fs_dirent *out) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_readdir_locked(pid, path, index, out);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
+
+int fs_unlink(int pid, const char *path) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_unlink_locked(pid, path);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
+
+int fs_rmdir(int pid, const char *path) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_rmdir_locked(pid, path);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
+
+// Pending fs changes reach the block cache through ops->sync, which takes
+// fs_lock itself; the cache is then written back (the flush sleeps on the
+// disk). One disk backs every persistent mount, so fsync flushes the whole cache.
+// The mount table is fixed after fs_init(), so it is read here without fs_lock.
+int fs_fsync(int pid, int fd) {
+    spin_lock_recursive(&fs_lock);
+    int m = fs_fd_mount_locked(pid, fd);
+    spin_unlock_recursive(&fs_lock);
+    if (m < 0) {
+        return -1;
+    }
+    if (mounts[m].ops->sync && mounts[m].ops->sync(mounts[m].ctx) < 0) {
+        return -1;
+    }
+    return bcache_flush();
+}
+
+// Every mount's pending changes into the block cache (kflushd, fs_sync).
+int fs_writeback(void) {
+    int ret = 0;
+    for (int i = 0; i < VFS_MOUNT_MAX; i++) {
+        struct vfs_mount *m = &mounts[i];
+        if (m->used && m->ops->sync && m->ops->sync(m->ctx) < 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int fs_sync(void) {
+    int ret = fs_writeback();
+    if (bcache_flush() < 0) {
+        return -1;
+    }
+    return ret;
+}
+
+int fs_dup2(int pid, int old_fd, int new_fd) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_dup2_locked(pid, old_fd, new_fd);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
+
+void fs_on_process_recycle(int pid) {
+    spin_lock_recursive(&fs_lock);
+    fs_on_process_recycle_locked(pid);
+    spin_unlock_recursive(&fs_lock);
+}
+
+int fs_get_root_entry(int *mount_idx, int *node_idx) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_get_root_entry_locked(mount_idx, node_idx);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
+
+int fs_get_path_entry(int pid, int *mount_idx, int *node_idx, const char *path) {
+    spin_lock_recursive(&fs_lock);
+    int ret = fs_get_path_entry_locked(pid, mount_idx, node_idx, path);
+    spin_unlock_recursive(&fs_lock);
+    return ret;
+}
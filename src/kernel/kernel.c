@@ -5,17 +5,19 @@
 #include "commonlibs.h"
 #include "memory.h"
 #include "process.h"
+#include "cpu.h"
 #include "sbi.h"
 #include "fs.h"
 #include "fs_internal.h"
 #include "blockdev.h"
+#include "bcache.h"
 #include "rtc.h"
+#include "plic.h"
+#include "uart.h"
+#include "user_apps.h"
 
 
 extern char __bss[], __bss_end[], __stack_top[];
-extern char _binary___bin_shell_bin_start[], _binary___bin_shell_bin_size[];
-extern struct process *current_proc;
-extern struct process *idle_proc;
 extern struct process *init_proc;
 
 static uint32_t kernel_total_pages;
@@ -24,15 +26,21 @@ __attribute__((naked))
 __attribute__((aligned(4)))
 void kernel_entry(void) {
     __asm__ __volatile__(
-        // Swap sp/sscratch only when trapped from U-mode (SPP=0).
-        // For S-mode traps, keep the current kernel stack pointer.
-        "csrr t0, sstatus\n"
-        "andi t0, t0, 0x100\n"
-        "bnez t0, 1f\n"
-        "csrrw sp, sscratch, sp\n"
+        // sscratch is this hart's struct cpu while in U-mode and 0 in S-mode,
+        // so the swap tells both apart without touching a general register.
+        "csrrw tp, sscratch, tp\n"
+        "bnez tp, 1f\n"
+
+        // from S-mode: keep the current kernel stack
+        "csrrw tp, sscratch, tp\n"
+        "sw sp, 8(tp)\n"               // cpu->trap_sp
+        "csrw sscratch, tp\n"          // tp to save
         "j 2f\n"
+
+        // from U-mode: sscratch now holds the user tp
         "1:\n"
-        "csrw sscratch, sp\n"
+        "sw sp, 8(tp)\n"               // cpu->trap_sp
+        "lw sp, 4(tp)\n"               // cpu->kernel_sp
         "2:\n"
 
         // Always run trap handler with interrupts disabled to avoid nested
@@ -42,7 +50,6 @@ void kernel_entry(void) {
         "addi sp, sp, -4 * 31\n"
         "sw ra,  4 * 0(sp)\n"
         "sw gp,  4 * 1(sp)\n"
-        "sw tp,  4 * 2(sp)\n"
         "sw t0,  4 * 3(sp)\n"
         "sw t1,  4 * 4(sp)\n"
         "sw t2,  4 * 5(sp)\n"
@@ -72,14 +79,22 @@ void kernel_entry(void) {
         "sw s11, 4 * 29(sp)\n"
 
         "csrr a0, sscratch\n"
-        "sw a0, 4 * 30(sp)\n"
-
-        "addi a0, sp, 4 * 31\n"
-        "csrw sscratch, a0\n"
+        "sw a0,  4 * 2(sp)\n"
+        "lw a0,  8(tp)\n"
+        "sw a0,  4 * 30(sp)\n"
+        "csrw sscratch, zero\n"
 
         "mv a0, sp\n"
         "call handle_trap\n"
 
+        // Returning to U-mode: re-arm sscratch with this hart, which may differ
+        // from the one trapped on if the process migrated while blocked.
+        "csrr t0, sstatus\n"
+        "andi t0, t0, 0x100\n"
+        "bnez t0, 3f\n"
+        "csrw sscratch, tp\n"
+        "3:\n"
+
         "lw ra,  4 * 0(sp)\n"
         "lw gp,  4 * 1(sp)\n"
         "lw tp,  4 * 2(sp)\n"
@@ -117,7 +132,9 @@ void kernel_entry(void) {
 
 
 void user_entry(void) {
+    scheduler_start_process();
     __asm__ __volatile__ (
+        "csrw sscratch, tp\n"
         "csrw sepc, %[sepc]\n"
         "csrw sstatus, %[sstatus]\n"
         "sret\n"
@@ -131,6 +148,9 @@ void user_entry(void) {
 __attribute__((noreturn))
 void kernel_shutdown(void) {
     printf("[*] kernel shutdown requested.\n");
+    if (fs_sync() < 0) {
+        printf("[*] fs sync failed, recent changes may be lost.\n");
+    }
     sbi_shutdown();
     __builtin_unreachable();
 }
@@ -151,25 +171,27 @@ void banner(void) {
 }
 
 
-void kernel_bootstrap(void) {
+void kernel_bootstrap(uint32_t hart_id) {
     printf("[*] kernel bootstrap started.\n");
 
     // init memory
     printf("[*] initialize memory...\n");
     printf("     [mem] bss zero clear...");
     memset(__bss, 0, (size_t) __bss_end - (size_t) __bss);
+    cpu_init_boot((int) hart_id);
     printf("OK\n");
     kernel_total_pages = memory_init();
+    printf("     [mem] build kernel page table...");
+    kernel_vm_init();
+    printf("OK\n");
 
     // set trap handler to stvec registry
     printf("[*] initialize trapvector...");
     WRITE_CSR(stvec, (uint32_t) kernel_entry);
     printf("OK\n");
 
-    // Ensure trap-entry stack swap source is valid before first timer interrupt.
-    uint32_t kernel_sp;
-    __asm__ __volatile__("mv %0, sp" : "=r"(kernel_sp));
-    WRITE_CSR(sscratch, kernel_sp);
+    // sscratch is 0 while in S-mode (see kernel_entry)
+    WRITE_CSR(sscratch, 0);
 
     // enable supervisor timer interrupt
     printf("[*] initialize timer interrupt...\n");
@@ -180,6 +202,14 @@ void kernel_bootstrap(void) {
     timer_set_next();
     printf("OK\n");
 
+    // interrupt-driven console; the SBI console remains the fallback
+    printf("[*] initialize console...");
+    if (uart_init() == 0) {
+        printf("OK (ns16550a)\n");
+    } else {
+        printf("SBI fallback\n");
+    }
+
     // initialize in-memory filesystem
     printf("[*] initialize filesystem...");
     fs_init();
@@ -193,13 +223,29 @@ void kernel_bootstrap(void) {
     unix_time_to_utc_str(rtc_now_sec(), ts, sizeof(ts));
     printf("OK\n");
 
+    // parse the embedded user programs while only this hart is running
+    printf("[*] initialize app images...\n");
+    app_image_init();
+
     // create idle process
     printf("[*] initialize process...");
-    idle_proc = create_process(NULL, 0, "idle");
-    idle_proc->pid = 0;
-    current_proc = idle_proc;
+    process_create_idle();
+    if (procfs_sync_meminfo(0) < 0 || procfs_sync_sched(0) < 0 || procfs_sync_pfs(0) < 0 ||
+        procfs_sync_bcache(0) < 0) {
+        printf("procfs sync failed\n");
+    }
     printf("OK\n");
 
+    // device interrupts are routed to every hart once their drivers are registered
+    plic_init_hart();
+
+    // bring up the other harts; each runs its own idle loop
+    printf("[*] start secondary harts...\n");
+    smp_start_secondaries();
+    if (procfs_sync_cpus(0) < 0) {
+        printf("procfs sync failed\n");
+    }
+
     // print kernel info
     printf("[*] kernel information:\n");
     printf("     version         : %s\n", KERNEL_VERSION);
@@ -208,16 +254,17 @@ void kernel_bootstrap(void) {
     printf("     page size       : %d bytes\n", PAGE_SIZE);
     printf("     kernel base     : 0x%x\n", KERNEL_BASE);
     printf("     user base       : 0x%x\n", USER_BASE);
+    printf("     cpus            : %d\n", cpu_count);
     printf("     proc max        : %d\n", PROCS_MAX);
     printf("     kernel stack    : %d bytes/proc\n", (int) sizeof(procs[0].stack));
     printf("     time slice      : %d ticks\n", SCHED_TIME_SLICE_TICKS);
     printf("     timer interval  : %d ms\n", (TIMER_INTERVAL / 10000));
     printf("     ramfs node max  : %d\n", FS_MAX_NODES);
     printf("     ramfs size max  : %d bytes\n", FS_FILE_MAX_SIZE);
-    printf("     pfs blk count   : %d\n", BLOCKDEV_BLOCK_COUNT);
+    printf("     pfs blk count   : %d\n", (int) fs_get_pfs_volume_blocks());
     printf("     pfs blk size    : %d bytes\n", BLOCKDEV_BLOCK_SIZE);
-    printf("     pfs img blks    : %d\n", (int) fs_get_pfs_image_blocks());
-    printf("     pfs img bytes   : %d\n", (int) (fs_get_pfs_image_blocks() * BLOCKDEV_BLOCK_SIZE));
+    printf("     pfs used blks   : %d\n", (int) fs_get_pfs_used_blocks());
+    printf("     pfs used bytes  : %d\n", (int) (fs_get_pfs_used_blocks() * BLOCKDEV_BLOCK_SIZE));
 
     printf("[*] kernel bootstrap completed.\n");
 }
@@ -248,22 +295,50 @@ void kernel_get_info(struct kernel_info *out) {
     out->ramfs_node_max = FS_MAX_NODES;
     out->ramfs_size_max = FS_FILE_MAX_SIZE;
     out->pfs_block_size = BLOCKDEV_BLOCK_SIZE;
-    out->pfs_block_count = BLOCKDEV_BLOCK_COUNT;
-    out->pfs_image_blocks = fs_get_pfs_image_blocks();
-    out->pfs_image_bytes = out->pfs_image_blocks * BLOCKDEV_BLOCK_SIZE;
+    out->pfs_block_count = fs_get_pfs_volume_blocks();
+    out->pfs_used_blocks = fs_get_pfs_used_blocks();
+    out->pfs_used_bytes = out->pfs_used_blocks * BLOCKDEV_BLOCK_SIZE;
+    out->cpu_count = (uint32_t) cpu_count;
 }
 
-void kernel_main(void) {
-    kernel_bootstrap();
+void kernel_main(uint32_t hart_id) {
+    kernel_bootstrap(hart_id);
     banner();
 
     // start shell (init)
-    init_proc = create_process(_binary___bin_shell_bin_start,
-                               (size_t) _binary___bin_shell_bin_size,
-                               "shell");
-    yield();
+    const struct app_image *shell = app_image_lookup(APP_ID_SHELL);
+    if (!shell) {
+        PANIC("shell image is not loadable");
+    }
+    init_proc = create_process(shell, APP_NAME_SHELL);
+    bcache_start_flusher();
+    enable_ipi();
 
-    __builtin_unreachable();
+    // boot hart's idle loop
+    for (;;) {
+        yield();
+    }
+}
+
+
+// Secondary harts enter here from secondary_entry (tp = its struct cpu). Like the boot
+// hart they run identity mapped with satp off until the first switch to a process.
+__attribute__((noreturn))
+void kernel_secondary_main(void) {
+    struct cpu *cpu = this_cpu();
+
+    WRITE_CSR(stvec, (uint32_t) kernel_entry);
+    process_create_idle();
+    enable_ipi();
+    enable_timer_interrupt();
+    plic_init_hart();
+
+    printf("     [smp] hart %d online\n", cpu->hart_id);
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+
+    for (;;) {
+        yield();
+    }
 }
 
 
@@ -271,10 +346,9 @@ __attribute__((section(".text.boot")))
 __attribute__((naked))
 void boot(void) {
     __asm__ __volatile__(
-        "mv sp, %[stack_top]\n"
-        "csrw sscratch, sp\n"       // init sscratch before interrupt
-        "j kernel_main\n"
-        :
-        : [stack_top] "r" (__stack_top)
+        "la sp, __stack_top\n"
+        "csrw sscratch, zero\n"     // S-mode: no trap stack to swap in
+        "la tp, cpus\n"             // struct cpu of the boot hart (cpus[0])
+        "j kernel_main\n"           // a0: hart id from OpenSBI
     );
 }
@@ -2,13 +2,30 @@
 #include "commonlibs.h"
 #include "memory.h"
 #include "kernel.h"
+#include "spinlock.h"
+#include "rtc.h"
+#include "plic.h"
 
-extern char __free_ram[], __free_ram_end[];
+extern char __kernel_base[], __free_ram[], __free_ram_end[];
+
+// Free blocks are linked through their first page (free RAM is identity mapped).
+struct buddy_block {
+    struct buddy_block *next;
+    struct buddy_block *prev;
+};
 
 static uint8_t *page_bitmap;
+static uint8_t *page_order;             // order of a free block head, BUDDY_ORDER_NONE otherwise
+static uint8_t *page_refs;              // mapping reference count per allocated page
+static struct buddy_block *free_lists[BUDDY_MAX_ORDER + 1];
+static uint32_t free_blocks[BUDDY_MAX_ORDER + 1];
 static paddr_t managed_base;
 static uint32_t managed_pages;
+static uint32_t total_ram_pages;
 static bool memory_initialized;
+static uint32_t *kernel_table1;         // kernel half shared by every process page table
+// Innermost lock: buddy lists, bitmap and refcounts. Page contents are not covered.
+static struct spinlock mem_lock = SPINLOCK_INIT("mem");
 
 static inline bool bitmap_test(uint32_t idx) {
     return (page_bitmap[idx / 8] >> (idx % 8)) & 1;
@@ -22,6 +39,87 @@ static inline void bitmap_clear(uint32_t idx) {
     page_bitmap[idx / 8] &= (uint8_t) ~(1u << (idx % 8));
 }
 
+static inline struct buddy_block *page_block(uint32_t idx) {
+    return (struct buddy_block *) (managed_base + idx * PAGE_SIZE);
+}
+
+static inline uint32_t block_index(const struct buddy_block *block) {
+    return ((paddr_t) block - managed_base) / PAGE_SIZE;
+}
+
+static void buddy_list_push(uint32_t idx, uint32_t order) {
+    struct buddy_block *block = page_block(idx);
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (free_lists[order]) {
+        free_lists[order]->prev = block;
+    }
+    free_lists[order] = block;
+    free_blocks[order]++;
+    page_order[idx] = (uint8_t) order;
+}
+
+static void buddy_list_remove(uint32_t idx, uint32_t order) {
+    struct buddy_block *block = page_block(idx);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    free_blocks[order]--;
+    page_order[idx] = BUDDY_ORDER_NONE;
+}
+
+// Insert a free block and merge it with its buddy as long as the buddy is free too.
+static void buddy_free_block(uint32_t idx, uint32_t order) {
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t buddy = idx ^ (1u << order);
+        if (buddy >= managed_pages || page_order[buddy] != order) {
+            break;
+        }
+        buddy_list_remove(buddy, order);
+        idx &= ~(1u << order);
+        order++;
+    }
+    buddy_list_push(idx, order);
+}
+
+// Release an arbitrary page range as the largest naturally aligned blocks that fit.
+static void buddy_free_range(uint32_t idx, uint32_t n) {
+    while (n > 0) {
+        uint32_t order = 0;
+        while (order < BUDDY_MAX_ORDER &&
+               (idx & ((2u << order) - 1)) == 0 &&
+               (2u << order) <= n) {
+            order++;
+        }
+        buddy_free_block(idx, order);
+        idx += 1u << order;
+        n -= 1u << order;
+    }
+}
+
+static uint32_t order_for_pages(uint32_t n) {
+    uint32_t order = 0;
+    while ((1u << order) < n) {
+        order++;
+    }
+    return order;
+}
+
+static void zero_pages(paddr_t paddr, uint32_t n) {
+    uint32_t *p = (uint32_t *) paddr;
+    uint32_t *end = (uint32_t *) (paddr + n * PAGE_SIZE);
+    while (p < end) {
+        p[0] = 0; p[1] = 0; p[2] = 0; p[3] = 0;
+        p[4] = 0; p[5] = 0; p[6] = 0; p[7] = 0;
+        p += 8;
+    }
+}
+
 uint32_t memory_init(void) {
     paddr_t free_start = (paddr_t) __free_ram;
     paddr_t free_end = (paddr_t) __free_ram_end;
@@ -41,20 +139,36 @@ uint32_t memory_init(void) {
 
     printf("     [mem] create bitmap...");
     uint32_t bitmap_bytes = (total_pages + 7) / 8;
-    uint32_t bitmap_pages = (bitmap_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t order_bytes = total_pages;
+    uint32_t ref_bytes = total_pages;
+    uint32_t meta_pages = (bitmap_bytes + order_bytes + ref_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    if (bitmap_pages >= total_pages) {
+    if (meta_pages >= total_pages) {
         PANIC("bitmap too large for free ram");
     }
 
     page_bitmap = (uint8_t *) free_start;
-    memset(page_bitmap, 0, bitmap_pages * PAGE_SIZE);
+    page_order = page_bitmap + bitmap_bytes;
+    page_refs = page_order + order_bytes;
+    memset(page_bitmap, 0, bitmap_bytes);
+    memset(page_order, BUDDY_ORDER_NONE, order_bytes);
+    memset(page_refs, 0, ref_bytes);
+    printf("OK\n");
+
+    managed_base = free_start + meta_pages * PAGE_SIZE;
+    managed_pages = total_pages - meta_pages;
+    total_ram_pages = total_pages;
+
+    printf("     [mem] build buddy free lists...");
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        free_lists[order] = NULL;
+        free_blocks[order] = 0;
+    }
+    buddy_free_range(0, managed_pages);
     printf("OK\n");
 
-    managed_base = free_start + bitmap_pages * PAGE_SIZE;
-    managed_pages = total_pages - bitmap_pages;
     memory_initialized = true;
-    
+
     return total_pages;
 }
 
@@ -62,34 +176,47 @@ paddr_t alloc_pages(uint32_t n) {
     if (!memory_initialized) {
         PANIC("memory allocator is not initialized");
     }
-    if (n == 0 || n > managed_pages) {
+    uint32_t order = order_for_pages(n);
+    if (n == 0 || n > managed_pages || order > BUDDY_MAX_ORDER) {
         PANIC("invalid alloc page count %d", n);
     }
 
-    uint32_t run = 0;
-    for (uint32_t i = 0; i < managed_pages; i++) {
-        if (bitmap_test(i)) {
-            run = 0;
-            continue;
-        }
+    spin_lock(&mem_lock);
+    uint32_t found = order;
+    while (found <= BUDDY_MAX_ORDER && !free_lists[found]) {
+        found++;
+    }
+    if (found > BUDDY_MAX_ORDER) {
+        PANIC("Out of Memory has been detected.");
+    }
 
-        run++;
-        if (run == n) {
-            uint32_t start = i + 1 - n;
-            for (uint32_t j = start; j <= i; j++) {
-                bitmap_set(j);
-            }
+    uint32_t start = block_index(free_lists[found]);
+    buddy_list_remove(start, found);
 
-            paddr_t paddr = managed_base + start * PAGE_SIZE;
-            memset((void *) paddr, 0, n * PAGE_SIZE);
-            return paddr;
-        }
+    // Split down to the requested order, returning upper halves to the free lists.
+    while (found > order) {
+        found--;
+        buddy_list_push(start + (1u << found), found);
+    }
+
+    // Non power-of-two requests give the unused tail back right away.
+    if ((1u << order) > n) {
+        buddy_free_range(start + n, (1u << order) - n);
+    }
+
+    for (uint32_t i = start; i < start + n; i++) {
+        bitmap_set(i);
+        page_refs[i] = 1;
     }
+    spin_unlock(&mem_lock);
 
-    PANIC("Out of Memory has been detected.");
+    // the block is ours now: clear it outside the lock
+    paddr_t paddr = managed_base + start * PAGE_SIZE;
+    zero_pages(paddr, n);
+    return paddr;
 }
 
-void free_pages(paddr_t paddr, uint32_t n) {
+static void free_pages_locked(paddr_t paddr, uint32_t n) {
     if (!memory_initialized) {
         PANIC("memory allocator is not initialized");
     }
@@ -114,7 +241,70 @@ void free_pages(paddr_t paddr, uint32_t n) {
             PANIC("double free detected paddr=%x", paddr + i * PAGE_SIZE);
         }
         bitmap_clear(idx);
+        page_refs[idx] = 0;
+    }
+
+    buddy_free_range(start, n);
+}
+
+void free_pages(paddr_t paddr, uint32_t n) {
+    spin_lock(&mem_lock);
+    free_pages_locked(paddr, n);
+    spin_unlock(&mem_lock);
+}
+
+static uint32_t page_ref_index(paddr_t paddr) {
+    if (!memory_initialized) {
+        PANIC("memory allocator is not initialized");
+    }
+    if (!is_aligned(paddr, PAGE_SIZE) || paddr < managed_base) {
+        PANIC("invalid page ref paddr %x", paddr);
+    }
+
+    uint32_t idx = (paddr - managed_base) / PAGE_SIZE;
+    if (idx >= managed_pages || !bitmap_test(idx)) {
+        PANIC("page ref on unallocated paddr %x", paddr);
     }
+    return idx;
+}
+
+void page_ref_inc(paddr_t paddr) {
+    spin_lock(&mem_lock);
+    uint32_t idx = page_ref_index(paddr);
+    if (page_refs[idx] == 0xff) {
+        PANIC("page ref overflow paddr=%x", paddr);
+    }
+    page_refs[idx]++;
+    spin_unlock(&mem_lock);
+}
+
+uint32_t page_ref_dec(paddr_t paddr) {
+    spin_lock(&mem_lock);
+    uint32_t idx = page_ref_index(paddr);
+    if (page_refs[idx] == 0) {
+        PANIC("page ref underflow paddr=%x", paddr);
+    }
+
+    uint32_t refs = --page_refs[idx];
+    if (refs == 0) {
+        free_pages_locked(paddr, 1);
+    }
+    spin_unlock(&mem_lock);
+    return refs;
+}
+
+uint32_t page_ref_count(paddr_t paddr) {
+    spin_lock(&mem_lock);
+    uint32_t refs = page_refs[page_ref_index(paddr)];
+    spin_unlock(&mem_lock);
+    return refs;
+}
+
+bool is_managed_page(paddr_t paddr) {
+    if (!memory_initialized || paddr < managed_base) {
+        return false;
+    }
+    return (paddr - managed_base) / PAGE_SIZE < managed_pages;
 }
 
 void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
@@ -136,6 +326,74 @@ void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
     table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
 }
 
+uint32_t *lookup_pte(uint32_t *table1, uint32_t vaddr) {
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if ((table1[vpn1] & PAGE_V) == 0) {
+        return NULL;
+    }
+    if (table1[vpn1] & (PAGE_R | PAGE_W | PAGE_X)) {
+        return NULL;    // megapage leaf, no second level
+    }
+
+    uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
+    uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
+    return &table0[vpn0];
+}
+
+static void map_kernel_range(paddr_t start, paddr_t end, uint32_t flags) {
+    paddr_t paddr = start;
+    while (paddr < end) {
+        // Use a 4 MiB megapage whenever the whole aligned window is inside the range.
+        if (is_aligned(paddr, MEGAPAGE_SIZE) && end - paddr >= MEGAPAGE_SIZE) {
+            uint32_t vpn1 = (paddr >> 22) & 0x3ff;
+            kernel_table1[vpn1] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+            paddr += MEGAPAGE_SIZE;
+            continue;
+        }
+
+        map_page(kernel_table1, paddr, paddr, flags);
+        paddr += PAGE_SIZE;
+    }
+}
+
+void kernel_vm_init(void) {
+    if (!memory_initialized) {
+        PANIC("memory allocator is not initialized");
+    }
+
+    kernel_table1 = (uint32_t *) alloc_pages(1);
+    map_kernel_range((paddr_t) __kernel_base, (paddr_t) __free_ram_end, PAGE_R | PAGE_W | PAGE_X);
+    // map MMIO region for device access while running in process page table.
+    map_kernel_range(MMIO_BASE, MMIO_END, PAGE_R | PAGE_W);
+    // map RTC MMIO
+    map_kernel_range(RTC_MMIO_BASE, RTC_MMIO_END, PAGE_R | PAGE_W);
+    // map PLIC MMIO (a single megapage)
+    map_kernel_range(PLIC_BASE, PLIC_MMIO_END, PAGE_R | PAGE_W);
+}
+
+void map_kernel_space(uint32_t *table1) {
+    if (!kernel_table1) {
+        PANIC("kernel page table is not initialized");
+    }
+
+    // Level-1 entries point at the shared level-0 tables (or are megapage leaves).
+    for (int vpn1 = 0; vpn1 < 1024; vpn1++) {
+        if (kernel_table1[vpn1] & PAGE_V) {
+            table1[vpn1] = kernel_table1[vpn1];
+        }
+    }
+}
+
+// Page table with only the kernel half, for processes that never enter U-mode
+// (the idle processes).
+uint32_t *kernel_page_table(void) {
+    return kernel_table1;
+}
+
+bool is_kernel_pde(const uint32_t *table1, uint32_t vpn1) {
+    return kernel_table1 && (table1[vpn1] & PAGE_V) && table1[vpn1] == kernel_table1[vpn1];
+}
+
 int bitmap_page_state(int index) {
     if (!memory_initialized) {
         PANIC("memory allocator is not initialized");
@@ -152,3 +410,22 @@ int bitmap_page_count(void) {
     }
     return (int) managed_pages;
 }
+
+void memory_get_stats(struct memory_stats *out) {
+    if (!out) {
+        return;
+    }
+    if (!memory_initialized) {
+        PANIC("memory allocator is not initialized");
+    }
+
+    out->total_pages = total_ram_pages;
+    out->managed_pages = managed_pages;
+    out->free_pages = 0;
+    spin_lock(&mem_lock);
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        out->free_blocks[order] = free_blocks[order];
+        out->free_pages += free_blocks[order] << order;
+    }
+    spin_unlock(&mem_lock);
+}
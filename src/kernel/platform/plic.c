@@ -0,0 +1,58 @@
+#include "kernel.h"
+#include "plic.h"
+#include "cpu.h"
+#include "commonlibs.h"
+
+#define PLIC_PRIORITY(irq)      (PLIC_BASE + 4 * (irq))
+#define PLIC_SENABLE(ctx)       (PLIC_BASE + 0x2000 + (ctx) * 0x80)
+#define PLIC_STHRESHOLD(ctx)    (PLIC_BASE + 0x200000 + (ctx) * 0x1000)
+#define PLIC_SCLAIM(ctx)        (PLIC_BASE + 0x200004 + (ctx) * 0x1000)
+
+#define SIE_SEIE                (1u << 9)
+
+static plic_handler_t plic_handlers[PLIC_IRQ_MAX];
+static uint32_t plic_enabled[PLIC_IRQ_MAX / 32];
+
+
+static inline volatile uint32_t *plic_reg(uint32_t addr) {
+    return (volatile uint32_t *) addr;
+}
+
+// QEMU virt: context 2 * hart is M-mode, 2 * hart + 1 is S-mode.
+static uint32_t plic_context(void) {
+    return 2 * (uint32_t) this_cpu()->hart_id + 1;
+}
+
+
+// Called by drivers during boot, before the harts run plic_init_hart().
+void plic_register(uint32_t irq, plic_handler_t handler) {
+    if (irq == 0 || irq >= PLIC_IRQ_MAX) {
+        PANIC("invalid plic irq %d", irq);
+    }
+
+    plic_handlers[irq] = handler;
+    plic_enabled[irq / 32] |= 1u << (irq % 32);
+    *plic_reg(PLIC_PRIORITY(irq)) = 1;
+}
+
+// Route every registered source to this hart's S-mode context. Each hart claims
+// independently; a hart that loses the race simply claims 0.
+void plic_init_hart(void) {
+    uint32_t ctx = plic_context();
+    for (uint32_t i = 0; i < PLIC_IRQ_MAX / 32; i++) {
+        *plic_reg(PLIC_SENABLE(ctx) + 4 * i) = plic_enabled[i];
+    }
+    *plic_reg(PLIC_STHRESHOLD(ctx)) = 0;
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_SEIE);
+}
+
+void plic_handle_irq(void) {
+    uint32_t ctx = plic_context();
+    uint32_t irq;
+    while ((irq = *plic_reg(PLIC_SCLAIM(ctx))) != 0) {
+        if (irq < PLIC_IRQ_MAX && plic_handlers[irq]) {
+            plic_handlers[irq]();
+        }
+        *plic_reg(PLIC_SCLAIM(ctx)) = irq;     // complete
+    }
+}
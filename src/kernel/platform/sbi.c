@@ -22,12 +22,21 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
 }
 
 
-void putchar(char ch) {
+// Legacy console extension: console fallback when no UART driver is active.
+void sbi_console_putchar(char ch) {
     sbi_call(ch, 0, 0, 0, 0, 0, 0, 1);
 }
 
 
-long getchar(void) {
+// Writes up to len bytes from a physical buffer in one call. Returns bytes written or < 0.
+long sbi_debug_console_write(const void *buf, unsigned long len) {
+    struct sbiret ret = sbi_call((long) len, (long) buf, 0, 0, 0, 0,
+                                 SBI_DBCN_CONSOLE_WRITE, SBI_EXT_DBCN);
+    return ret.error == SBI_SUCCESS ? ret.value : ret.error;
+}
+
+
+long sbi_console_getchar(void) {
     struct sbiret ret = sbi_call(0, 0, 0, 0, 0, 0, 0, 2);
     return ret.error;
 }
@@ -41,3 +50,25 @@ void sbi_shutdown(void) {
         __asm__ __volatile__("wfi");
     }
 }
+
+
+// 0 when the extension is missing.
+long sbi_probe_extension(long eid) {
+    struct sbiret ret = sbi_call(eid, 0, 0, 0, 0, 0, SBI_BASE_PROBE_EXTENSION, SBI_EXT_BASE);
+    return ret.error == SBI_SUCCESS ? ret.value : 0;
+}
+
+
+// The hart starts in S-mode at start_addr with a0 = hart id, a1 = opaque, satp = 0.
+long sbi_hart_start(unsigned long hart_id, unsigned long start_addr, unsigned long opaque) {
+    struct sbiret ret = sbi_call((long) hart_id, (long) start_addr, (long) opaque, 0, 0, 0,
+                                 SBI_HSM_HART_START, SBI_EXT_HSM);
+    return ret.error;
+}
+
+
+long sbi_send_ipi(unsigned long hart_mask, unsigned long hart_mask_base) {
+    struct sbiret ret = sbi_call((long) hart_mask, (long) hart_mask_base, 0, 0, 0, 0,
+                                 SBI_IPI_SEND_IPI, SBI_EXT_IPI);
+    return ret.error;
+}
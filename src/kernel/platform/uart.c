@@ -0,0 +1,208 @@
+#include "kernel.h"
+#include "uart.h"
+#include "plic.h"
+#include "sbi.h"
+#include "spinlock.h"
+#include "syscall.h"
+#include "commonlibs.h"
+
+// ns16550a registers (reg-shift 0)
+#define UART_RBR    0       // receive buffer (read)
+#define UART_THR    0       // transmit holding (write)
+#define UART_DLL    0       // divisor latch low (DLAB=1)
+#define UART_IER    1
+#define UART_DLM    1       // divisor latch high (DLAB=1)
+#define UART_FCR    2
+#define UART_LCR    3
+#define UART_MCR    4
+#define UART_LSR    5
+#define UART_SCR    7
+
+#define UART_IER_RDI        0x01    // receive data available
+#define UART_IER_THRI       0x02    // transmit holding register empty
+#define UART_FCR_ENABLE     0x01
+#define UART_FCR_CLEAR      0x06    // clear rx and tx FIFOs
+#define UART_LCR_8N1        0x03
+#define UART_LCR_DLAB       0x80
+#define UART_MCR_OUT2       0x08    // gates the interrupt line on a real 16550
+#define UART_MCR_RTS_DTR    0x03
+#define UART_LSR_DR         0x01
+#define UART_LSR_THRE       0x20    // tx FIFO empty
+
+static bool uart_enabled;
+static bool sbi_dbcn;                   // fallback: SBI debug console takes whole buffers
+static char tx_buf[UART_TX_BUF_SIZE];
+static uint32_t tx_head;
+static uint32_t tx_count;
+// Guards the UART registers and tx_buf. Never held while calling into the console layer.
+static struct spinlock uart_lock = SPINLOCK_INIT("uart");
+
+
+static inline uint8_t uart_read(uint32_t reg) {
+    return *(volatile uint8_t *) (UART0_BASE + reg);
+}
+
+static inline void uart_write_reg(uint32_t reg, uint8_t value) {
+    *(volatile uint8_t *) (UART0_BASE + reg) = value;
+}
+
+// Move up to one FIFO worth of queued bytes to the device.
+static void tx_fill_fifo_locked(void) {
+    if ((uart_read(UART_LSR) & UART_LSR_THRE) == 0) {
+        return;
+    }
+    for (int i = 0; i < UART_FIFO_SIZE && tx_count > 0; i++) {
+        uart_write_reg(UART_THR, (uint8_t) tx_buf[tx_head]);
+        tx_head = (tx_head + 1) % UART_TX_BUF_SIZE;
+        tx_count--;
+    }
+}
+
+// The THRE interrupt is wanted only while bytes are queued.
+static void tx_update_irq_locked(void) {
+    uart_write_reg(UART_IER, tx_count > 0 ? (UART_IER_RDI | UART_IER_THRI) : UART_IER_RDI);
+}
+
+static void tx_drain_locked(void) {
+    while (tx_count > 0) {
+        tx_fill_fifo_locked();
+    }
+}
+
+static void uart_handle_irq(void) {
+    char rx[UART_FIFO_SIZE];
+    int n = 0;
+
+    spin_lock(&uart_lock);
+    while (n < UART_FIFO_SIZE && (uart_read(UART_LSR) & UART_LSR_DR)) {
+        rx[n++] = (char) uart_read(UART_RBR);
+    }
+    tx_fill_fifo_locked();
+    tx_update_irq_locked();
+    spin_unlock(&uart_lock);
+
+    // Anything left in the rx FIFO keeps the line raised and is claimed again.
+    if (n > 0) {
+        console_receive(rx, n);
+    }
+}
+
+// Take over the console from SBI when a 16550 answers at UART0_BASE.
+int uart_init(void) {
+    uart_write_reg(UART_SCR, 0x5a);
+    if (uart_read(UART_SCR) != 0x5a) {
+        sbi_dbcn = sbi_probe_extension(SBI_EXT_DBCN) != 0;
+        return -1;
+    }
+
+    uart_write_reg(UART_IER, 0);
+    uart_write_reg(UART_LCR, UART_LCR_DLAB);
+    uart_write_reg(UART_DLL, 3);            // 38400 baud (ignored by QEMU)
+    uart_write_reg(UART_DLM, 0);
+    uart_write_reg(UART_LCR, UART_LCR_8N1);
+    uart_write_reg(UART_FCR, UART_FCR_ENABLE | UART_FCR_CLEAR);
+    uart_write_reg(UART_MCR, UART_MCR_OUT2 | UART_MCR_RTS_DTR);
+
+    plic_register(UART0_IRQ, uart_handle_irq);
+    uart_write_reg(UART_IER, UART_IER_RDI);
+    uart_enabled = true;
+    return 0;
+}
+
+bool uart_active(void) {
+    return uart_enabled;
+}
+
+
+// Kernel console output is synchronous: queued bytes go first so ordering holds,
+// and nothing is left in tx_buf if the kernel panics or shuts down right after.
+void putchar(char ch) {
+    if (!uart_enabled) {
+        sbi_console_putchar(ch);
+        return;
+    }
+
+    spin_lock(&uart_lock);
+    tx_drain_locked();
+    while ((uart_read(UART_LSR) & UART_LSR_THRE) == 0) {
+    }
+    uart_write_reg(UART_THR, (uint8_t) ch);
+    tx_update_irq_locked();
+    spin_unlock(&uart_lock);
+}
+
+long getchar(void) {
+    if (!uart_enabled) {
+        return sbi_console_getchar();
+    }
+
+    long ch = -1;
+    spin_lock(&uart_lock);
+    if (uart_read(UART_LSR) & UART_LSR_DR) {
+        ch = uart_read(UART_RBR);
+    }
+    spin_unlock(&uart_lock);
+    return ch;
+}
+
+// Process output: queued and drained by the THRE interrupt, a FIFO at a time.
+// Spins only when tx_buf is full. Without the UART, one SBI call per chunk where
+// the debug console extension exists.
+#define CONSOLE_CHUNK   128
+
+// chunk is a kernel stack buffer: identity mapped, so SBI can take its address.
+static void sbi_console_write_chunk(const char *chunk, size_t len) {
+    if (!sbi_dbcn) {
+        for (size_t i = 0; i < len; i++) {
+            sbi_console_putchar(chunk[i]);
+        }
+        return;
+    }
+
+    spin_lock(&uart_lock);
+    size_t done = 0;
+    while (done < len) {
+        long n = sbi_debug_console_write(chunk + done, len - done);
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t) n;
+    }
+    for (; done < len; done++) {
+        sbi_console_putchar(chunk[done]);
+    }
+    spin_unlock(&uart_lock);
+}
+
+static void uart_console_write_chunk(const char *chunk, size_t len) {
+    spin_lock(&uart_lock);
+    for (size_t i = 0; i < len; i++) {
+        while (tx_count == UART_TX_BUF_SIZE) {
+            tx_fill_fifo_locked();
+        }
+        tx_buf[(tx_head + tx_count) % UART_TX_BUF_SIZE] = chunk[i];
+        tx_count++;
+    }
+    tx_fill_fifo_locked();
+    tx_update_irq_locked();
+    spin_unlock(&uart_lock);
+}
+
+// buf may be a user buffer. It is copied out before uart_lock is taken, so a
+// fault on it (and the PANIC that may follow, whose printf needs uart_lock)
+// never happens with the lock held.
+void console_write(const char *buf, size_t len) {
+    char chunk[CONSOLE_CHUNK];
+
+    while (len > 0) {
+        size_t n = len < sizeof(chunk) ? len : sizeof(chunk);
+        memcpy(chunk, buf, n);
+        if (uart_enabled) {
+            uart_console_write_chunk(chunk, n);
+        } else {
+            sbi_console_write_chunk(chunk, n);
+        }
+        buf += n;
+        len -= n;
+    }
+}
@@ -0,0 +1,236 @@
+#include "stdtypes.h"
+#include "commonlibs.h"
+#include "kernel.h"
+#include "memory.h"
+#include "elf.h"
+#include "app_image.h"
+#include "user_apps.h"
+
+
+// apps address (stripped ELF, embedded page aligned)
+extern char _binary___bin_shell_img_start[], _binary___bin_shell_img_size[];        // shell
+extern char _binary___bin_ipc_rx_img_start[], _binary___bin_ipc_rx_img_size[];      // ipc_rx
+extern char _binary___bin_ps_img_start[], _binary___bin_ps_img_size[];              // ps
+extern char _binary___bin_date_img_start[], _binary___bin_date_img_size[];          // date
+extern char _binary___bin_ls_img_start[], _binary___bin_ls_img_size[];              // ls
+extern char _binary___bin_mkdir_img_start[], _binary___bin_mkdir_img_size[];        // mkdir
+extern char _binary___bin_rmdir_img_start[], _binary___bin_rmdir_img_size[];        // rmdir
+extern char _binary___bin_touch_img_start[], _binary___bin_touch_img_size[];        // touch
+extern char _binary___bin_rm_img_start[], _binary___bin_rm_img_size[];              // rm
+extern char _binary___bin_write_img_start[], _binary___bin_write_img_size[];        // write
+extern char _binary___bin_cat_img_start[], _binary___bin_cat_img_size[];            // cat
+extern char _binary___bin_kill_img_start[], _binary___bin_kill_img_size[];          // kill
+extern char _binary___bin_kernel_info_img_start[], _binary___bin_kernel_info_img_size[]; // kernel_info
+extern char _binary___bin_bitmap_img_start[], _binary___bin_bitmap_img_size[];      // bitmap
+extern char _binary___bin_nice_img_start[], _binary___bin_nice_img_size[];          // nice
+extern char _binary___bin_sleep_img_start[], _binary___bin_sleep_img_size[];        // sleep
+extern char _binary___bin_sync_img_start[], _binary___bin_sync_img_size[];          // sync
+
+#define APP_IMAGE(app, sym) \
+    { .id = APP_ID_##app, .name = APP_NAME_##app, \
+      .elf = (const uint8_t *) _binary___bin_##sym##_img_start, .elf_size = _binary___bin_##sym##_img_size }
+
+static struct app_image app_images[] = {
+    APP_IMAGE(SHELL, shell),
+    APP_IMAGE(IPC_RX, ipc_rx),
+    APP_IMAGE(PS, ps),
+    APP_IMAGE(DATE, date),
+    APP_IMAGE(LS, ls),
+    APP_IMAGE(MKDIR, mkdir),
+    APP_IMAGE(RMDIR, rmdir),
+    APP_IMAGE(TOUCH, touch),
+    APP_IMAGE(RM, rm),
+    APP_IMAGE(WRITE, write),
+    APP_IMAGE(CAT, cat),
+    APP_IMAGE(KILL, kill),
+    APP_IMAGE(KERNEL_INFO, kernel_info),
+    APP_IMAGE(BITMAP, bitmap),
+    APP_IMAGE(NICE, nice),
+    APP_IMAGE(SLEEP, sleep),
+    APP_IMAGE(SYNC, sync),
+};
+
+#define APP_IMAGE_COUNT ((int) (sizeof(app_images) / sizeof(app_images[0])))
+
+
+// Read-only segments can be mapped straight out of the embedded ELF when they sit
+// in the file at the same page offset as in memory (lld keeps PT_LOAD congruent).
+static void find_shared_text(struct app_image *image) {
+    size_t elf_size = (size_t) image->elf_size;
+    vaddr_t ro_start = USER_END;
+    vaddr_t ro_end = USER_BASE;
+    vaddr_t rw_start = USER_END;
+    uint32_t delta = 0;
+    bool have_ro = false;
+
+    for (int i = 0; i < image->segment_count; i++) {
+        const struct app_segment *seg = &image->segments[i];
+        if (seg->flags & PAGE_W) {
+            if (seg->vaddr < rw_start) {
+                rw_start = seg->vaddr;
+            }
+            continue;
+        }
+
+        // bss-like tails and non-contiguous file layouts go through the copy path
+        uint32_t seg_delta = (uint32_t) seg->data - seg->vaddr;
+        if (seg->file_size != seg->mem_size || (have_ro && seg_delta != delta)) {
+            return;
+        }
+        delta = seg_delta;
+        have_ro = true;
+
+        if (seg->vaddr < ro_start) {
+            ro_start = seg->vaddr;
+        }
+        if (seg->vaddr + seg->mem_size > ro_end) {
+            ro_end = seg->vaddr + seg->mem_size;
+        }
+    }
+    if (!have_ro) {
+        return;
+    }
+
+    // A page shared with a writable segment must stay private.
+    vaddr_t start = ro_start & ~(PAGE_SIZE - 1);
+    vaddr_t end = (ro_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (end > (rw_start & ~(PAGE_SIZE - 1))) {
+        end = rw_start & ~(PAGE_SIZE - 1);
+    }
+
+    const uint8_t *data = (const uint8_t *) (start + delta);
+    if (((uint32_t) data & (PAGE_SIZE - 1)) != 0 || data < image->elf) {
+        return;
+    }
+    while (end > start && (uint32_t) (data - image->elf) + (end - start) > elf_size) {
+        end -= PAGE_SIZE;
+    }
+    if (end <= start) {
+        return;
+    }
+
+    image->text_start = start;
+    image->text_end = end;
+    image->text_data = data;
+}
+
+static int parse_app_image(struct app_image *image) {
+    size_t size = (size_t) image->elf_size;
+    const struct elf32_ehdr *ehdr = (const struct elf32_ehdr *) image->elf;
+
+    if (size < sizeof(struct elf32_ehdr)) {
+        return -1;
+    }
+    if (ehdr->e_ident[0] != ELFMAG0 || ehdr->e_ident[1] != ELFMAG1 ||
+        ehdr->e_ident[2] != ELFMAG2 || ehdr->e_ident[3] != ELFMAG3 ||
+        ehdr->e_ident[4] != ELFCLASS32 || ehdr->e_ident[5] != ELFDATA2LSB) {
+        return -1;
+    }
+    // user_entry() and exec always enter at USER_BASE
+    if (ehdr->e_type != ET_EXEC || ehdr->e_machine != EM_RISCV || ehdr->e_entry != USER_BASE) {
+        return -1;
+    }
+    if (ehdr->e_phentsize != sizeof(struct elf32_phdr) || ehdr->e_phoff > size ||
+        ehdr->e_phnum > (size - ehdr->e_phoff) / sizeof(struct elf32_phdr)) {
+        return -1;
+    }
+
+    const struct elf32_phdr *phdrs = (const struct elf32_phdr *) (image->elf + ehdr->e_phoff);
+    image->segment_count = 0;
+    image->end = USER_BASE;
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        const struct elf32_phdr *ph = &phdrs[i];
+        if (ph->p_type != PT_LOAD || ph->p_memsz == 0) {
+            continue;
+        }
+        if (image->segment_count >= APP_SEGMENTS_MAX || ph->p_filesz > ph->p_memsz ||
+            ph->p_offset > size || ph->p_filesz > size - ph->p_offset ||
+            ph->p_vaddr < USER_BASE || ph->p_vaddr >= USER_END ||
+            ph->p_memsz > USER_END - ph->p_vaddr) {
+            return -1;
+        }
+
+        struct app_segment *seg = &image->segments[image->segment_count++];
+        seg->vaddr = ph->p_vaddr;
+        seg->file_size = ph->p_filesz;
+        seg->mem_size = ph->p_memsz;
+        seg->data = image->elf + ph->p_offset;
+        seg->flags = 0;
+        if (ph->p_flags & PF_R) seg->flags |= PAGE_R;
+        if (ph->p_flags & PF_W) seg->flags |= PAGE_W;
+        if (ph->p_flags & PF_X) seg->flags |= PAGE_X;
+
+        if (seg->vaddr + seg->mem_size > image->end) {
+            image->end = seg->vaddr + seg->mem_size;
+        }
+    }
+    if (image->segment_count == 0) {
+        return -1;
+    }
+
+    find_shared_text(image);
+    return 0;
+}
+
+// Parse every embedded image once at boot, before any other hart or process can
+// look one up, so that app_image_lookup only reads the table.
+void app_image_init(void) {
+    for (int i = 0; i < APP_IMAGE_COUNT; i++) {
+        struct app_image *image = &app_images[i];
+        image->valid = parse_app_image(image) == 0;
+        if (!image->valid) {
+            printf("[app] %s: unsupported ELF image\n", image->name);
+        }
+    }
+}
+
+const struct app_image *app_image_lookup(int app_id) {
+    for (int i = 0; i < APP_IMAGE_COUNT; i++) {
+        const struct app_image *image = &app_images[i];
+        if (image->id == app_id) {
+            return image->valid ? image : NULL;
+        }
+    }
+    return NULL;
+}
+
+uint32_t app_image_pages(const struct app_image *image) {
+    return (image->end - USER_BASE + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+// Physical page backing a shared text page, or 0 when the page needs a private copy.
+paddr_t app_image_shared_page(const struct app_image *image, vaddr_t page_vaddr) {
+    if (!image->text_data || page_vaddr < image->text_start || page_vaddr >= image->text_end) {
+        return 0;
+    }
+    return (paddr_t) (image->text_data + (page_vaddr - image->text_start));
+}
+
+// Copy the file-backed bytes of every segment overlapping page_vaddr into a zeroed page.
+int app_image_fill_page(const struct app_image *image, vaddr_t page_vaddr, uint8_t *page, uint32_t *flags_out) {
+    uint32_t flags = 0;
+    vaddr_t page_end = page_vaddr + PAGE_SIZE;
+
+    for (int i = 0; i < image->segment_count; i++) {
+        const struct app_segment *seg = &image->segments[i];
+        if (seg->vaddr + seg->mem_size <= page_vaddr || seg->vaddr >= page_end) {
+            continue;
+        }
+        flags |= seg->flags;
+
+        vaddr_t from = seg->vaddr > page_vaddr ? seg->vaddr : page_vaddr;
+        vaddr_t to = seg->vaddr + seg->file_size;
+        if (to > page_end) {
+            to = page_end;
+        }
+        if (from < to) {
+            memcpy(page + (from - page_vaddr), seg->data + (from - seg->vaddr), to - from);
+        }
+    }
+
+    if (flags == 0) {
+        return -1;
+    }
+    *flags_out = flags;
+    return 0;
+}
@@ -2,20 +2,32 @@
 #include "commonlibs.h"
 #include "kernel.h"
 #include "memory.h"
+#include "timer.h"
 #include "process.h"
 #include "fs_internal.h"
-#include "rtc.h"
+#include "bcache.h"
+#include "uart.h"
 
-
-extern char __kernel_base[], __free_ram_end[];
+#define SSTATUS_SIE (1u << 1)
 
 
 struct process procs[PROCS_MAX];
-struct process *current_proc;
-struct process *idle_proc;
 struct process *init_proc;
 
-static bool need_resched;
+// proc_lock guards procs[], every queue below, the sleep heap and the scheduler counters.
+// It is held across switch_context(); the process switched to releases it.
+// Lock order: console_lock -> proc_lock -> fs_lock -> mem_lock.
+static struct spinlock proc_lock = SPINLOCK_INIT("proc");
+
+static bool need_boost;
+static uint32_t sched_ticks;
+static uint64_t sched_clock;                                // time of the last global tick
+
+static struct proc_queue run_queues[CPUS_MAX][SCHED_LEVELS]; // per hart: RUNNABLE and not running, per level
+static struct proc_queue exited_queue;                      // EXITED, not yet recycled
+static uint32_t wait_counts[PROC_WAIT_REASON_MAX];          // WAITTING processes per wait_reason
+static struct process *sleep_heap[PROCS_MAX + 1];           // armed timers, min-heap on wakeup_time (1-based)
+static int sleep_heap_len;
 
 static void set_process_name(struct process *proc, const char *name) {
     for (int i = 0; i < PROC_NAME_MAX; i++) {
@@ -83,15 +95,273 @@ static struct process *find_process_by_pid(int pid) {
         return NULL;
     }
 
-    for (int i = 0; i < PROCS_MAX; i++) {
-        if (procs[i].pid == pid && procs[i].state != PROC_UNUSED) {
-            return &procs[i];
+    // pid is the slot index
+    if (pid >= PROCS_MAX || procs[pid].pid != pid || procs[pid].state == PROC_UNUSED) {
+        return NULL;
+    }
+    return &procs[pid];
+}
+
+
+static void proc_queue_push(struct proc_queue *q, struct process *proc) {
+    proc->queue = q;
+    proc->queue_prev = q->tail;
+    proc->queue_next = NULL;
+    if (q->tail) {
+        q->tail->queue_next = proc;
+    } else {
+        q->head = proc;
+    }
+    q->tail = proc;
+    q->length++;
+}
+
+static void proc_queue_remove(struct process *proc) {
+    struct proc_queue *q = proc->queue;
+    if (!q) {
+        return;
+    }
+
+    if (proc->queue_prev) {
+        proc->queue_prev->queue_next = proc->queue_next;
+    } else {
+        q->head = proc->queue_next;
+    }
+    if (proc->queue_next) {
+        proc->queue_next->queue_prev = proc->queue_prev;
+    } else {
+        q->tail = proc->queue_prev;
+    }
+    q->length--;
+
+    proc->queue = NULL;
+    proc->queue_prev = NULL;
+    proc->queue_next = NULL;
+}
+
+static struct process *proc_queue_pop(struct proc_queue *q) {
+    struct process *proc = q->head;
+    if (proc) {
+        proc_queue_remove(proc);
+    }
+    return proc;
+}
+
+// All state changes of live processes go through here so wait_counts stays exact.
+static void set_proc_state(struct process *proc, int state, int wait_reason, int wait_pid) {
+    if (proc->state == PROC_WAITTING) {
+        wait_counts[proc->wait_reason]--;
+    }
+    proc->state = state;
+    proc->wait_reason = wait_reason;
+    proc->wait_pid = wait_pid;
+    if (state == PROC_WAITTING) {
+        wait_counts[wait_reason]++;
+    }
+}
+
+static void sleep_heap_set(int index, struct process *proc) {
+    sleep_heap[index] = proc;
+    proc->timer_index = index;
+}
+
+static void sleep_heap_sift_up(int index) {
+    struct process *proc = sleep_heap[index];
+    while (index > 1 && sleep_heap[index / 2]->wakeup_time > proc->wakeup_time) {
+        sleep_heap_set(index, sleep_heap[index / 2]);
+        index /= 2;
+    }
+    sleep_heap_set(index, proc);
+}
+
+static void sleep_heap_sift_down(int index) {
+    struct process *proc = sleep_heap[index];
+    while (index * 2 <= sleep_heap_len) {
+        int child = index * 2;
+        if (child < sleep_heap_len && sleep_heap[child + 1]->wakeup_time < sleep_heap[child]->wakeup_time) {
+            child++;
         }
+        if (sleep_heap[child]->wakeup_time >= proc->wakeup_time) {
+            break;
+        }
+        sleep_heap_set(index, sleep_heap[child]);
+        index = child;
+    }
+    sleep_heap_set(index, proc);
+}
+
+// Wake proc at deadline even if it is also linked on a wait queue (timeouts).
+static void timer_arm(struct process *proc, uint64_t deadline) {
+    if (proc->timer_index != 0) {
+        PANIC("timer already armed for pid %d", proc->pid);
+    }
+    proc->wakeup_time = deadline;
+    sleep_heap_len++;
+    sleep_heap_set(sleep_heap_len, proc);
+    sleep_heap_sift_up(sleep_heap_len);
+
+    // The boot hart owns the sleep deadline: make it re-arm for a new earliest sleeper.
+    if (sleep_heap[1] == proc && this_cpu() != &cpus[0]) {
+        smp_send_ipi(&cpus[0]);
     }
+}
+
+static void timer_cancel(struct process *proc) {
+    int index = proc->timer_index;
+    if (index == 0) {
+        return;
+    }
+
+    struct process *last = sleep_heap[sleep_heap_len];
+    sleep_heap[sleep_heap_len] = NULL;
+    sleep_heap_len--;
+    proc->timer_index = 0;
+    if (last == proc) {
+        return;
+    }
+
+    sleep_heap_set(index, last);
+    if (index > 1 && sleep_heap[index / 2]->wakeup_time > last->wakeup_time) {
+        sleep_heap_sift_up(index);
+    } else {
+        sleep_heap_sift_down(index);
+    }
+}
+
+static uint32_t sched_slice(const struct process *proc) {
+    return SCHED_TIME_SLICE_TICKS << proc->sched_level;
+}
 
+// Processes go back to the queue of the hart they last ran on (cache affinity).
+static void enqueue_runnable(struct process *proc) {
+    proc->runnable_since = sched_ticks;
+    proc_queue_push(&run_queues[proc->last_cpu][proc->sched_level], proc);
+}
+
+static uint32_t cpu_runqueue_length(int cpu_id) {
+    uint32_t length = 0;
+    for (int level = 0; level < SCHED_LEVELS; level++) {
+        length += run_queues[cpu_id][level].length;
+    }
+    return length;
+}
+
+static uint32_t runqueue_length(void) {
+    uint32_t length = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        length += cpu_runqueue_length(i);
+    }
+    return length;
+}
+
+// Out of local work: move half (rounded up) of the longest other queue here,
+// taking the most recently queued entries and the highest levels first.
+static void steal_work(struct cpu *thief) {
+    int victim = -1;
+    uint32_t most = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        uint32_t length = cpu_runqueue_length(i);
+        if (i != thief->id && length > most) {
+            victim = i;
+            most = length;
+        }
+    }
+    if (victim < 0) {
+        return;
+    }
+
+    uint32_t want = (most + 1) / 2;
+    for (int level = 0; level < SCHED_LEVELS && want > 0; level++) {
+        struct proc_queue *q = &run_queues[victim][level];
+        while (q->tail && want > 0) {
+            struct process *proc = q->tail;
+            uint32_t since = proc->runnable_since;
+            proc_queue_remove(proc);
+            proc->last_cpu = thief->id;
+            enqueue_runnable(proc);
+            proc->runnable_since = since;
+            thief->migrations++;
+            want--;
+        }
+    }
+    thief->steals++;
+}
+
+static struct process *dequeue_runnable(struct cpu *cpu) {
+    if (cpu_runqueue_length(cpu->id) == 0) {
+        steal_work(cpu);
+    }
+
+    for (int level = 0; level < SCHED_LEVELS; level++) {
+        struct process *proc = proc_queue_pop(&run_queues[cpu->id][level]);
+        if (proc) {
+            proc->wait_ticks += sched_ticks - proc->runnable_since;
+            return proc;
+        }
+    }
     return NULL;
 }
 
+static void program_timer(void);
+
+static bool cpu_is_idle(const struct cpu *cpu) {
+    return cpu->online && cpu->current == cpu->idle;
+}
+
+// Wake one hart sitting in its idle loop so it steals the new work.
+static void kick_idle_cpu(const struct cpu *busy) {
+    struct cpu *self = this_cpu();
+    for (int i = 0; i < cpu_count; i++) {
+        struct cpu *cpu = &cpus[i];
+        if (cpu != self && cpu != busy && cpu_is_idle(cpu)) {
+            smp_send_ipi(cpu);
+            return;
+        }
+    }
+}
+
+static void make_runnable(struct process *proc) {
+    struct cpu *self = this_cpu();
+    struct cpu *home = &cpus[proc->last_cpu];
+
+    proc_queue_remove(proc);
+    timer_cancel(proc);
+    set_proc_state(proc, PROC_RUNNABLE, PROC_WAIT_NONE, -1);
+    enqueue_runnable(proc);
+
+    // An idle home hart picks it up itself (this hart's idle loop is already looking).
+    if (cpu_is_idle(home)) {
+        if (home != self) {
+            smp_send_ipi(home);
+        }
+        return;
+    }
+
+    // preempt at the next tick if a higher level became runnable
+    if (home->current->pid > 0 && proc->sched_level < home->current->sched_level) {
+        home->need_resched = true;
+    }
+    // a second runnable process needs slice ticks again; the IPI handler re-arms remotely
+    if (home->tick_stopped) {
+        if (home == self) {
+            program_timer();
+        } else {
+            smp_send_ipi(home);
+        }
+    }
+    // home is busy: let an idle hart steal it
+    kick_idle_cpu(home);
+}
+
+
+// Drop one mapping of a user page. Shared text lives in the kernel image and is not refcounted.
+static void release_user_page(uint32_t *pte) {
+    paddr_t page = PTE_PADDR(*pte);
+    if (is_managed_page(page)) {
+        page_ref_dec(page);
+    }
+    *pte = 0;
+}
 
 static void free_process_memory(struct process *proc) {
     if (!proc || !proc->page_table) {
@@ -100,31 +370,26 @@ static void free_process_memory(struct process *proc) {
 
     uint32_t *table1 = proc->page_table;
 
-    // Free mapped user pages.
+    // Drop mapped user pages (shared COW pages are freed by the last owner).
     for (uint32_t i = 0; i < proc->user_pages; i++) {
-        uint32_t vaddr = USER_BASE + i * PAGE_SIZE;
-        uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
-        uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
-
-        if ((table1[vpn1] & PAGE_V) == 0) {
-            continue;
-        }
-
-        uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
-        if ((table0[vpn0] & PAGE_V) == 0) {
+        uint32_t *pte = lookup_pte(table1, USER_BASE + i * PAGE_SIZE);
+        if (!pte || (*pte & PAGE_V) == 0) {
             continue;
         }
 
-        paddr_t paddr = (paddr_t) ((table0[vpn0] >> 10) * PAGE_SIZE);
-        free_pages(paddr, 1);
-        table0[vpn0] = 0;
+        release_user_page(pte);
     }
 
     // Free second-level page tables owned by this process.
+    // Kernel entries are shared with every other page table and stay alive.
     for (int vpn1 = 0; vpn1 < 1024; vpn1++) {
         if ((table1[vpn1] & PAGE_V) == 0) {
             continue;
         }
+        if (is_kernel_pde(table1, vpn1)) {
+            table1[vpn1] = 0;
+            continue;
+        }
 
         paddr_t table0_paddr = (paddr_t) ((table1[vpn1] >> 10) * PAGE_SIZE);
         free_pages(table0_paddr, 1);
@@ -136,6 +401,7 @@ static void free_process_memory(struct process *proc) {
 
     proc->page_table = NULL;
     proc->user_pages = 0;
+    proc->image = NULL;
 }
 
 
@@ -149,16 +415,21 @@ static void recycle_process_slot(struct process *proc) {
     }
     fs_on_process_recycle(proc->pid);
     free_process_memory(proc);
-    proc->state = PROC_UNUSED;
+    proc_queue_remove(proc);
+    timer_cancel(proc);
+    set_proc_state(proc, PROC_UNUSED, PROC_WAIT_NONE, -1);
     set_process_name(proc, NULL);
-    proc->wait_reason = PROC_WAIT_NONE;
-    proc->wait_pid = -1;
     proc->parent_pid = 0;
     proc->pid = 0;
     proc->sp = 0;
+    proc->sched_level = 0;
+    proc->nice = 0;
     proc->time_slice = SCHED_TIME_SLICE_TICKS;
     proc->run_ticks = 0;
     proc->schedule_count = 0;
+    proc->wait_ticks = 0;
+    proc->killed = false;
+    proc->in_syscall = false;
     proc->ipc_has_message = 0;
     proc->ipc_from_pid = 0;
     proc->ipc_message = 0;
@@ -167,16 +438,16 @@ static void recycle_process_slot(struct process *proc) {
 
 
 static void reap_exited_processes(void) {
-    for (int i = 0; i < PROCS_MAX; i++) {
-        if (procs[i].state != PROC_EXITED) {
-            continue;
-        }
+    struct process *proc = exited_queue.head;
+    while (proc) {
+        struct process *next = proc->queue_next;
 
         // Processes with no parent can be reclaimed immediately.
         // Parented processes are kept as zombies until waitpid() collects them.
-        if (procs[i].parent_pid == 0) {
-            recycle_process_slot(&procs[i]);
+        if (proc->parent_pid == 0 && !proc->cpu) {
+            recycle_process_slot(proc);
         }
+        proc = next;
     }
 }
 
@@ -234,12 +505,17 @@ void switch_context(uint32_t *prev_sp, uint32_t *next_sp) {
 }
 
 
-struct process *create_process(const void *image, size_t image_size, const char *name) {
+// idle: a hart's idle process. It gets pid 0, runs on the kernel page table and
+// has no /proc entry. The boot hart's idle takes slot 0 and the secondary harts'
+// idles the highest free slots, so pids handed out otherwise still start at 1.
+static struct process *create_process_locked(const struct app_image *image, const char *name,
+                                             void (*entry)(void), bool idle) {
     struct process *proc = NULL;
     int i;
 
     reap_exited_processes();
-    for (i = 0; i < PROCS_MAX; i++) {
+    for (int k = 0; k < PROCS_MAX; k++) {
+        i = (idle && k > 0) ? PROCS_MAX - k : k;
         if (procs[i].state == PROC_UNUSED) {
             proc = &procs[i];
             break;
@@ -263,59 +539,45 @@ struct process *create_process(const void *image, size_t image_size, const char
     *--sp = 0;                          // s2
     *--sp = 0;                          // s1
     *--sp = 0;                          // s0
-    *--sp = (uint32_t) user_entry;      // ra
+    *--sp = (uint32_t) entry;           // ra
     // Keep interrupts disabled while running kernel context after first schedule-in.
     // user_entry() sets the user-visible sstatus before sret.
     *--sp = 0;                          // sstatus
 
-    uint32_t *page_table = (uint32_t *) alloc_pages(1);
-    for (paddr_t paddr = (paddr_t) __kernel_base;
-         paddr < (paddr_t) __free_ram_end;
-         paddr += PAGE_SIZE) {
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
-    }
-
-    // map MMIO region for device access while running in process page table.
-    for (paddr_t paddr = MMIO_BASE; paddr < MMIO_END; paddr += PAGE_SIZE) {
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W);
-    }
-    // map RTC MMIO
-    for (paddr_t paddr = RTC_MMIO_BASE; paddr < RTC_MMIO_END; paddr += PAGE_SIZE) {
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W);
-    }
-    // map user page
-    uint32_t user_pages = (image_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
-        paddr_t page = alloc_pages(1);
-
-        size_t remaining = image_size - off;
-        size_t copy_size = PAGE_SIZE <= remaining ? PAGE_SIZE : remaining;
-
-        memcpy((void *) page, image + off, copy_size);
-
-        map_page(page_table, USER_BASE + off, page,
-                 PAGE_U | PAGE_R | PAGE_W | PAGE_X);
-    }
-
-    // get root mount/node index
+    // get root mount/node index; nothing is allocated yet and the slot stays unused
     int root_mount_idx, root_node_idx;
     if (fs_get_root_entry(&root_mount_idx, &root_node_idx) < 0) {
-        recycle_process_slot(proc);
         return NULL;
     }
 
-    proc->pid = i;
+    uint32_t *page_table = kernel_page_table();
+    if (!idle) {
+        page_table = (uint32_t *) alloc_pages(1);
+        map_kernel_space(page_table);
+    }
+    // user pages are left unmapped and filled from the image on first access
+    uint32_t user_pages = image ? app_image_pages(image) : 0;
+
+    proc->pid = idle ? 0 : i;
     proc->state = PROC_RUNNABLE;
     set_process_name(proc, name);
     proc->wait_reason = PROC_WAIT_NONE;
     proc->wait_pid = -1;
     proc->parent_pid = 0;
     proc->user_pages = user_pages;
+    proc->image = image;
+    proc->kthread_fn = NULL;
     proc->sp = (uint32_t) sp;
     proc->page_table = page_table;
+    proc->sched_level = 0;
+    proc->nice = 0;
     proc->time_slice = SCHED_TIME_SLICE_TICKS;
     proc->run_ticks = 0;
     proc->schedule_count = 0;
+    proc->wait_ticks = 0;
+    proc->killed = false;
+    proc->in_syscall = false;
+    proc->last_cpu = this_cpu()->id;
     proc->ipc_has_message = 0;
     proc->ipc_from_pid = 0;
     proc->ipc_message = 0;
@@ -327,9 +589,65 @@ struct process *create_process(const void *image, size_t image_size, const char
     proc->cwd_node_idx = root_node_idx;
     strcpy_s(proc->cwd_path, FS_PATH_MAX, "/");
 
+    // idle (no image) only runs when the run queue is empty and is never queued
+    if (image) {
+        make_runnable(proc);
+    }
+
     // write process status to procfs
-    procfs_sync_best_effort(proc);
+    if (!idle) {
+        procfs_sync_best_effort(proc);
+    }
+
+    return proc;
+}
 
+struct process *create_process(const struct app_image *image, const char *name) {
+    spin_lock(&proc_lock);
+    struct process *proc = create_process_locked(image, name, user_entry, false);
+    spin_unlock(&proc_lock);
+    return proc;
+}
+
+// The calling hart's idle process: pid 0, never queued, runs whenever nothing else can.
+// Its context is the hart's boot stack, saved on the first switch away.
+struct process *process_create_idle(void) {
+    struct cpu *cpu = this_cpu();
+
+    spin_lock(&proc_lock);
+    struct process *idle = create_process_locked(NULL, "idle", user_entry, true);
+    if (!idle) {
+        PANIC("no process slot for idle of hart %d", cpu->hart_id);
+    }
+    idle->cpu = cpu;
+    cpu->idle = idle;
+    cpu->current = idle;
+    cpu->last_tick_time = timer_now();
+    if (sched_clock == 0) {
+        sched_clock = cpu->last_tick_time;
+    }
+    spin_unlock(&proc_lock);
+    return idle;
+}
+
+
+// First code of a kernel thread. The body runs in S-mode with interrupts off and
+// gives up the cpu only by sleeping; it must never return.
+static void kthread_entry(void) {
+    scheduler_start_process();
+    current_proc->kthread_fn();
+    PANIC("kernel thread %s returned", current_proc->name);
+}
+
+// A process without a user image that runs fn on its own kernel stack.
+struct process *process_create_kthread(const char *name, void (*fn)(void)) {
+    spin_lock(&proc_lock);
+    struct process *proc = create_process_locked(NULL, name, kthread_entry, false);
+    if (proc) {
+        proc->kthread_fn = fn;
+        make_runnable(proc);
+    }
+    spin_unlock(&proc_lock);
     return proc;
 }
 
@@ -339,6 +657,8 @@ static void fork_child_trap_return(void) {
     __asm__ __volatile__(
         // s11: child resume sepc (= parent sepc + 4)
         // s0 : struct trap_frame *child_tf
+        "call scheduler_start_process\n"
+        "csrw sscratch, tp\n"          // this hart, for the next trap from U-mode
         "csrw sepc, s11\n"
         "mv gp, s0\n"
 
@@ -402,6 +722,7 @@ struct process *alloc_proc_slot() {
 }
 
 int process_fork(struct trap_frame *parent_tf) {
+    spin_lock(&proc_lock);
     struct process *child = alloc_proc_slot();
     if (!child || !parent_tf || !current_proc) goto fail;
     if (current_proc->state != PROC_RUNNABLE && current_proc->state != PROC_WAITTING) goto fail;
@@ -428,35 +749,31 @@ int process_fork(struct trap_frame *parent_tf) {
     uint32_t *page_table = (uint32_t *)alloc_pages(1);
     if (!page_table) goto fail;
 
-    for (paddr_t p = (paddr_t)__kernel_base; p < (paddr_t)__free_ram_end; p += PAGE_SIZE)
-        map_page(page_table, p, p, PAGE_R | PAGE_W | PAGE_X);
-    for (paddr_t p = MMIO_BASE; p < MMIO_END; p += PAGE_SIZE)
-        map_page(page_table, p, p, PAGE_R | PAGE_W);
-    for (paddr_t p = RTC_MMIO_BASE; p < RTC_MMIO_END; p += PAGE_SIZE)
-        map_page(page_table, p, p, PAGE_R | PAGE_W);
+    map_kernel_space(page_table);
 
     child->page_table = page_table;
-    child->user_pages = current_proc->user_pages;
+    child->user_pages = 0;
+    child->image = current_proc->image;
 
-    for (uint32_t i = 0; i < child->user_pages; i++) {
+    // Share user pages copy-on-write: both sides lose PAGE_W until the first store.
+    // Pages the parent never touched stay unmapped and are demand-loaded by the child.
+    for (uint32_t i = 0; i < current_proc->user_pages; i++) {
         uint32_t vaddr = USER_BASE + i * PAGE_SIZE;
-        uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
-        uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
+        uint32_t *pte = lookup_pte(current_proc->page_table, vaddr);
+        child->user_pages = i + 1;
+        if (!pte || (*pte & PAGE_V) == 0) continue;
 
-        uint32_t *pt1 = current_proc->page_table;
-        if ((pt1[vpn1] & PAGE_V) == 0) goto fail;
-        uint32_t *pt0 = (uint32_t *)((pt1[vpn1] >> 10) * PAGE_SIZE);
-        if ((pt0[vpn0] & PAGE_V) == 0) goto fail;
-
-        paddr_t parent_page = (paddr_t)((pt0[vpn0] >> 10) * PAGE_SIZE);
-        paddr_t child_page = alloc_pages(1);
-        if (!child_page) goto fail;
-
-        memcpy((void *)child_page, (const void *)parent_page, PAGE_SIZE);
+        if (*pte & PAGE_W) {
+            *pte = (*pte & ~PAGE_W) | PAGE_COW;
+        }
 
-        uint32_t flags = (pt0[vpn0] & 0x3ff) & ~PAGE_V;
-        map_page(child->page_table, vaddr, child_page, flags);
+        paddr_t page = PTE_PADDR(*pte);
+        if (is_managed_page(page)) {
+            page_ref_inc(page);
+        }
+        map_page(child->page_table, vaddr, page, PTE_FLAGS(*pte) & ~PAGE_V);
     }
+    __asm__ __volatile__("sfence.vma");
 
     // child trap-return context build
     uint8_t *kstack_top = &child->stack[sizeof(child->stack)];
@@ -482,201 +799,531 @@ int process_fork(struct trap_frame *parent_tf) {
     }
 
     // finalize
-    child->state = PROC_RUNNABLE;
-    child->time_slice = SCHED_TIME_SLICE_TICKS;
+    child->nice = current_proc->nice;
+    child->sched_level = current_proc->sched_level;
     child->run_ticks = 0;
     child->schedule_count = 0;
+    child->wait_ticks = 0;
+    child->time_slice = sched_slice(child);
+    child->last_cpu = this_cpu()->id;
+    make_runnable(child);
 
     // sync procfs
     procfs_sync_best_effort(child);
 
-    return child->pid;
+    // the child may run (and exit) on another hart as soon as the lock drops
+    int child_pid = child->pid;
+    spin_unlock(&proc_lock);
+    return child_pid;
 
 fail:
     recycle_process_slot(child);
+    spin_unlock(&proc_lock);
     return -1;
 }
 
 static void free_user_pages_only(struct process *proc) {
     if (!proc || !proc->page_table) return;
 
-    uint32_t *table1 = proc->page_table;
     for (uint32_t i = 0; i < proc->user_pages; i++) {
-        uint32_t vaddr = (USER_BASE + i * PAGE_SIZE);
-        uint32_t vpn1 = (vaddr >> 22) &0x3ff;
-        uint32_t vpn0 = (vaddr >> 12) &0x3ff;
+        uint32_t *pte = lookup_pte(proc->page_table, USER_BASE + i * PAGE_SIZE);
+        if (!pte || (*pte & PAGE_V) == 0) continue;
 
-        if ((table1[vpn1] & PAGE_V) == 0) continue;
-        uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
-        if ((table0[vpn0] & PAGE_V) == 0) continue;
-
-        paddr_t paddr = (paddr_t)((table0[vpn0] >> 10) * PAGE_SIZE);
-        free_pages(paddr, 1);
-        table0[vpn0] = 0;
+        release_user_page(pte);
     }
     proc->user_pages = 0;
+    __asm__ __volatile__("sfence.vma");
 }
 
-int process_exec(const void *image,
-                 size_t image_size,
-                 const char *name,
+int process_exec(const struct app_image *image,
                  int argc,
                  const char argv[PROC_EXEC_ARGV_MAX][PROC_EXEC_ARG_LEN]) {
-    if (!current_proc || !image || image_size == 0) {
+    if (!current_proc || !image) {
         return -1;
     }
 
+    spin_lock(&proc_lock);
+
     // free old user page
     free_user_pages_only(current_proc);
 
-    // map new image
-    uint32_t pages = (uint32_t)((image_size + PAGE_SIZE - 1) / PAGE_SIZE);
-    for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
-        paddr_t page = alloc_pages(1);
-        if (!page) {
-            return -1;
-        }
-        size_t remain = image_size - off;
-        size_t copy_size = remain < PAGE_SIZE ? remain : PAGE_SIZE;
-        memcpy((void *)page, (const uint8_t *)image + off, copy_size);
-
-        map_page(current_proc->page_table, USER_BASE + off, page, PAGE_U | PAGE_R | PAGE_W | PAGE_X);
-    }
+    // record the new image; its pages are demand-loaded on first access
+    uint32_t pages = app_image_pages(image);
 
     // update meta
     current_proc->user_pages = pages;
-    set_process_name(current_proc, name);
+    current_proc->image = image;
+    set_process_name(current_proc, image->name);
     current_proc->wait_reason = PROC_WAIT_NONE;
     current_proc->wait_pid = -1;
-    current_proc->time_slice = SCHED_TIME_SLICE_TICKS;
+    current_proc->time_slice = sched_slice(current_proc);
     current_proc->run_ticks = 0;
     set_exec_args(current_proc, argc, argv);
 
     // sync procfs
     procfs_sync_best_effort(current_proc);
+    spin_unlock(&proc_lock);
 
     WRITE_CSR(sepc, USER_BASE);
 
     return 0;
 }
 
+static int handle_cow_fault(uint32_t *pte) {
+    paddr_t old_page = PTE_PADDR(*pte);
+    uint32_t flags = (PTE_FLAGS(*pte) & ~(PAGE_V | PAGE_COW)) | PAGE_W;
+
+    // Last owner keeps the page and just regains write permission.
+    if (page_ref_count(old_page) == 1) {
+        *pte = ((old_page / PAGE_SIZE) << 10) | flags | PAGE_V;
+        return 0;
+    }
+
+    paddr_t new_page = alloc_pages(1);
+    if (!new_page) {
+        return -1;
+    }
+    memcpy((void *) new_page, (const void *) old_page, PAGE_SIZE);
+    *pte = ((new_page / PAGE_SIZE) << 10) | flags | PAGE_V;
+    page_ref_dec(old_page);
+    return 0;
+}
+
+static int load_image_page(struct process *proc, vaddr_t page_vaddr) {
+    if (!proc->image) {
+        return -1;
+    }
+
+    // Read-only text is mapped straight from the embedded image and shared by every instance.
+    paddr_t shared = app_image_shared_page(proc->image, page_vaddr);
+    if (shared) {
+        map_page(proc->page_table, page_vaddr, shared, PAGE_U | PAGE_R | PAGE_X);
+        return 0;
+    }
+
+    // data/bss get a private copy; bytes past the file-backed part stay zero-filled.
+    paddr_t page = alloc_pages(1);
+    if (!page) {
+        return -1;
+    }
+
+    uint32_t flags = 0;
+    if (app_image_fill_page(proc->image, page_vaddr, (uint8_t *) page, &flags) < 0) {
+        free_pages(page, 1);
+        return -1;
+    }
+
+    map_page(proc->page_table, page_vaddr, page, PAGE_U | flags);
+    return 0;
+}
+
+int process_handle_page_fault(struct process *proc, uint32_t scause, vaddr_t addr) {
+    if (!proc || !proc->page_table || proc->pid <= 0) {
+        return -1;
+    }
+
+    vaddr_t page_vaddr = addr & ~(PAGE_SIZE - 1);
+    if (page_vaddr < USER_BASE || page_vaddr >= USER_BASE + proc->user_pages * PAGE_SIZE) {
+        return -1;
+    }
+
+    // No proc_lock: this also runs for faults on user buffers inside fs calls (fs_lock held).
+    // Only the owner touches its page table, and COW sharers meet in the mem_lock refcounts.
+    int ret = -1;
+    uint32_t *pte = lookup_pte(proc->page_table, page_vaddr);
+    if (!pte || (*pte & PAGE_V) == 0) {
+        ret = load_image_page(proc, page_vaddr);
+    } else if (scause == SCAUSE_STORE_AMO_PAGE_FAULT && (*pte & PAGE_COW)) {
+        ret = handle_cow_fault(pte);
+    }
+
+    if (ret == 0) {
+        __asm__ __volatile__("sfence.vma %0, zero" :: "r"(page_vaddr) : "memory");
+    }
+    return ret;
+}
+
+// Charge the ticks elapsed since the last timer interrupt on this hart.
+// Several ticks arrive at once after a tickless gap.
 void scheduler_on_timer_tick(void) {
-    if (!current_proc || current_proc->state != PROC_RUNNABLE || current_proc->pid <= 0) {
+    struct cpu *cpu = this_cpu();
+
+    spin_lock(&proc_lock);
+    // sched_ticks follows real time whichever hart takes the interrupt
+    uint32_t prev_ticks = sched_ticks;
+    sched_ticks += timer_consume_ticks(&sched_clock);
+    if (sched_ticks / SCHED_BOOST_TICKS != prev_ticks / SCHED_BOOST_TICKS) {
+        need_boost = true;
+        cpu->need_resched = true;
+    }
+
+    uint32_t ticks = timer_consume_ticks(&cpu->last_tick_time);
+    struct process *proc = cpu->current;
+    if (!proc || proc->state != PROC_RUNNABLE || proc->pid <= 0 || ticks == 0) {
+        spin_unlock(&proc_lock);
         return;
     }
 
-    current_proc->run_ticks++;
+    proc->run_ticks += ticks;
+
+    // No one waiting for this hart: the slice is not charged.
+    if (cpu_runqueue_length(cpu->id) == 0) {
+        spin_unlock(&proc_lock);
+        return;
+    }
+
+    if (proc->time_slice > ticks) {
+        proc->time_slice -= ticks;
+    } else {
+        proc->time_slice = 0;
+    }
+
+    // Used the whole slice: treat as cpu-bound and demote to a longer slice.
+    if (proc->time_slice == 0) {
+        if (proc->sched_level < SCHED_LEVELS - 1) {
+            proc->sched_level++;
+        }
+        cpu->need_resched = true;
+    }
+    spin_unlock(&proc_lock);
+}
+
+
+// Anti-starvation: periodically lift every process back to its nice level.
+static void sched_boost_all(void) {
+    need_boost = false;
+    for (int i = 0; i < PROCS_MAX; i++) {
+        struct process *proc = &procs[i];
+        if (proc->state != PROC_RUNNABLE && proc->state != PROC_WAITTING) {
+            continue;
+        }
+        if (proc->sched_level == proc->nice) {
+            continue;
+        }
+
+        proc->sched_level = proc->nice;
+        if (proc->state == PROC_RUNNABLE && proc->queue) {
+            uint32_t since = proc->runnable_since;
+            proc_queue_remove(proc);
+            enqueue_runnable(proc);
+            proc->runnable_since = since;
+        }
+    }
+}
+
 
-    if (current_proc->time_slice > 0) {
-        current_proc->time_slice--;
+int process_set_nice(int pid, int nice) {
+    if (nice < 0 || nice > SCHED_NICE_MAX) {
+        return -1;
     }
 
-    if (current_proc->time_slice == 0) {
-        need_resched = true;
+    spin_lock(&proc_lock);
+    struct process *proc = (pid == 0) ? current_proc : find_process_by_pid(pid);
+    if (!proc || proc->pid <= 0 || proc->state == PROC_EXITED) {
+        spin_unlock(&proc_lock);
+        return -1;
+    }
+
+    int old = proc->nice;
+    proc->nice = nice;
+    if (proc->sched_level < nice) {
+        proc->sched_level = nice;
+        if (proc->state == PROC_RUNNABLE && proc->queue) {
+            proc_queue_remove(proc);
+            enqueue_runnable(proc);
+        }
     }
+    procfs_sync_best_effort(proc);
+    spin_unlock(&proc_lock);
+    return old;
 }
 
 
 bool scheduler_should_yield(void) {
-    return need_resched;
+    return this_cpu()->need_resched;
 }
 
 
-void yield(void) {
+// Tickless: periodic ticks only while processes compete for this hart.
+// Otherwise the only deadlines are console polling for a blocked reader (SBI console
+// only) and sleepers, both watched by the boot hart alone so other idle harts stay asleep.
+static void program_timer(void) {
+    struct cpu *cpu = this_cpu();
+    bool running = cpu->current && cpu->current->pid > 0 && cpu->current->state == PROC_RUNNABLE;
+    uint32_t runnable = cpu_runqueue_length(cpu->id) + (running ? 1 : 0);
+    bool timekeeper = cpu->id == 0;
+
+    cpu->tick_stopped = runnable <= 1;
+    bool console_poll = timekeeper && !uart_active() && wait_counts[PROC_WAIT_CONSOLE_INPUT] > 0;
+    bool periodic = !cpu->tick_stopped || console_poll;
+
+    // The earliest sleeper wins when it is due before the next periodic tick.
+    if (timekeeper && sleep_heap_len > 0) {
+        uint64_t deadline = sleep_heap[1]->wakeup_time;
+        if (!periodic || deadline < timer_now() + TIMER_INTERVAL) {
+            timer_arm_at(deadline);
+            return;
+        }
+    }
+
+    if (periodic) {
+        timer_set_next();
+    } else {
+        timer_disarm();
+    }
+}
+
+void scheduler_program_timer(void) {
+    spin_lock(&proc_lock);
+    program_timer();
+    spin_unlock(&proc_lock);
+}
+
+
+uint32_t scheduler_runqueue_length(void) {
+    return runqueue_length();
+}
+
+
+// Runs on the new stack right after switch_context(): the previous process is now
+// off this hart and may be picked or reaped elsewhere.
+static void finish_switch(void) {
+    struct cpu *cpu = this_cpu();
+    if (cpu->switch_prev) {
+        cpu->switch_prev->cpu = NULL;
+        cpu->switch_prev = NULL;
+    }
+}
+
+// First code of a new process (user_entry, fork child): drop the lock sched() held.
+void scheduler_start_process(void) {
+    finish_switch();
+    spin_unlock(&proc_lock);
+}
+
+
+// Fold idle rdtime counts into whole milliseconds using 32-bit division only.
+static void account_idle(struct cpu *cpu, uint64_t counts) {
+    const uint32_t per_ms = TIMER_FREQ_HZ / 1000;
+    while (counts > 0) {
+        uint32_t chunk = counts > 0x7fffffffu ? 0x7fffffffu : (uint32_t) counts;
+        uint32_t total = cpu->idle_rem + chunk;     // idle_rem < per_ms: no overflow
+        cpu->idle_ms += total / per_ms;
+        cpu->idle_rem = total % per_ms;
+        counts -= chunk;
+    }
+}
+
+// Pick the next process for this hart. Called and returns with proc_lock held.
+static void sched(void) {
     reap_exited_processes();
+    if (need_boost) {
+        sched_boost_all();
+    }
 
     while (1) {
-        struct process *next = NULL;
-        for (int i = 0; i < PROCS_MAX; i++) {
-            struct process *proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-            if (proc->state == PROC_RUNNABLE && proc->pid > 0) {
-                next = proc;
-                break;
-            }
+        struct cpu *cpu = this_cpu();
+        struct process *prev = cpu->current;
+
+        // The running process goes to the back of the queue unless it blocked or exited.
+        // Nobody else can dequeue it before finish_switch(): the lock is held until then.
+        if (prev->state == PROC_RUNNABLE && prev->pid > 0 && !prev->queue) {
+            enqueue_runnable(prev);
         }
 
+        struct process *next = dequeue_runnable(cpu);
+        if (!next && prev != cpu->idle) {
+            // Blocked or exited: park on the idle stack, so another hart may resume prev
+            // as soon as it is woken.
+            next = cpu->idle;
+        }
         if (!next) {
-            uint32_t sstatus = READ_CSR(sstatus);
-
-            // Keep sscratch on a stable trap-entry stack pointer for the current process.
-            WRITE_CSR(sscratch, (uint32_t) &current_proc->stack[sizeof(current_proc->stack)]);
+            // Idle with nothing runnable: sleep until the next real deadline only.
+            program_timer();
+            spin_unlock(&proc_lock);
 
-            WRITE_CSR(sstatus, sstatus | (1 << 1));
+            uint64_t idle_start = timer_now();
+            uint32_t sstatus = READ_CSR(sstatus);
+            WRITE_CSR(sstatus, sstatus | SSTATUS_SIE);
             __asm__ __volatile__("wfi");
             WRITE_CSR(sstatus, sstatus);
+
+            spin_lock(&proc_lock);
+            account_idle(cpu, timer_now() - idle_start);
             continue;
         }
 
-        if (next == current_proc) {
-            if (current_proc->time_slice == 0) {
-                current_proc->time_slice = SCHED_TIME_SLICE_TICKS;
+        if (next == prev) {
+            if (prev->time_slice == 0) {
+                prev->time_slice = sched_slice(prev);
             }
-            WRITE_CSR(sscratch, (uint32_t) &current_proc->stack[sizeof(current_proc->stack)]);
-            need_resched = false;
+            cpu->kernel_sp = (uint32_t) &prev->stack[sizeof(prev->stack)];
+            cpu->need_resched = false;
             return;
         }
+        if (next->cpu) {
+            PANIC("pid %d picked while running on hart %d", next->pid, next->cpu->hart_id);
+        }
 
-        next->time_slice = SCHED_TIME_SLICE_TICKS;
+        next->time_slice = sched_slice(next);
         next->schedule_count++;
-        need_resched = false;
+        cpu->need_resched = false;
 
         __asm__ __volatile__(
             "sfence.vma\n"
             "csrw satp, %[satp]\n"
             "sfence.vma\n"
-            "csrw sscratch, %[sscratch]\n"
             :
-            : [satp] "r" (SATP_SV32 | ((uint32_t) next->page_table / PAGE_SIZE)),
-              [sscratch] "r" ((uint32_t) &next->stack[sizeof(next->stack)])
+            : [satp] "r" (SATP_SV32 | ((uint32_t) next->page_table / PAGE_SIZE))
         );
+        cpu->kernel_sp = (uint32_t) &next->stack[sizeof(next->stack)];
 
-        struct process *prev = current_proc;
-        current_proc = next;
+        cpu->switch_prev = prev;
+        cpu->current = next;
+        next->cpu = cpu;
         switch_context(&prev->sp, &next->sp);
+
+        // prev resumed, possibly on another hart
+        finish_switch();
         return;
     }
 }
 
+void yield(void) {
+    spin_lock(&proc_lock);
+    sched();
+    spin_unlock(&proc_lock);
+}
 
-void wakeup_input_waiters(void) {
-    for (int i = 0; i < PROCS_MAX; i++) {
-        if (procs[i].state == PROC_WAITTING &&
-            procs[i].wait_reason == PROC_WAIT_CONSOLE_INPUT) {
-            procs[i].state = PROC_RUNNABLE;
-            procs[i].wait_reason = PROC_WAIT_NONE;
-            procs[i].wait_pid = -1;
-            procfs_sync_best_effort(&procs[i]);
-        }
+
+// Block the current process on wq. proc_lock held.
+static void sleep_on(struct wait_queue *wq, int wait_reason, int wait_pid) {
+    if (wait_reason <= PROC_WAIT_NONE || wait_reason >= PROC_WAIT_REASON_MAX) {
+        PANIC("invalid wait reason %d", wait_reason);
+    }
+
+    proc_queue_remove(current_proc);
+    set_proc_state(current_proc, PROC_WAITTING, wait_reason, wait_pid);
+    proc_queue_push(&wq->waiters, current_proc);
+    procfs_sync_best_effort(current_proc);
+    // without the UART RX interrupt, console input is polled from the boot hart's tick
+    if (wait_reason == PROC_WAIT_CONSOLE_INPUT && !uart_active() && this_cpu() != &cpus[0]) {
+        smp_send_ipi(&cpus[0]);
     }
+    sched();
+}
+
+// Block the current process on wq until a wake_one/wake_all picks it.
+// lk (may be NULL) guards the caller's condition: it is dropped only once the process
+// is on wq, so a wakeup between the check and the sleep is not lost. Re-taken on return.
+// Callers re-check their condition after returning: wakeups may be shared.
+void wait_queue_sleep(struct wait_queue *wq, int wait_reason, int wait_pid, struct spinlock *lk) {
+    spin_lock(&proc_lock);
+    if (lk) {
+        spin_unlock(lk);
+    }
+    sleep_on(wq, wait_reason, wait_pid);
+    spin_unlock(&proc_lock);
+    if (lk) {
+        spin_lock(lk);
+    }
+}
+
+
+static void wake_one(struct wait_queue *wq) {
+    struct process *proc = wq->waiters.head;
+    if (!proc) {
+        return;
+    }
+
+    // Interactive waits (console input, IPC) earn a boost back to the nice level.
+    if (proc->wait_reason == PROC_WAIT_CONSOLE_INPUT || proc->wait_reason == PROC_WAIT_IPC_RECV) {
+        proc->sched_level = proc->nice;
+    }
+    make_runnable(proc);
+    procfs_sync_best_effort(proc);
+}
+
+static void wake_all(struct wait_queue *wq) {
+    while (wq->waiters.head) {
+        wake_one(wq);
+    }
+}
+
+void wait_queue_wake_one(struct wait_queue *wq) {
+    spin_lock(&proc_lock);
+    wake_one(wq);
+    spin_unlock(&proc_lock);
+}
+
+void wait_queue_wake_all(struct wait_queue *wq) {
+    spin_lock(&proc_lock);
+    wake_all(wq);
+    spin_unlock(&proc_lock);
+}
+
+// A driver may sleep when it runs for a real process and holds exactly one spinlock:
+// the one it hands to wait_queue_sleep(). Boot code and the idle loop poll instead.
+bool process_can_block(void) {
+    struct process *proc = current_proc;
+    return proc && proc->pid > 0 && this_cpu()->irq_depth == 1;
+}
+
+
+// Block the current process until timer_now() reaches deadline.
+void process_sleep_until(uint64_t deadline) {
+    spin_lock(&proc_lock);
+    while (timer_now() < deadline) {
+        proc_queue_remove(current_proc);
+        set_proc_state(current_proc, PROC_WAITTING, PROC_WAIT_TIMER, -1);
+        timer_arm(current_proc, deadline);
+        procfs_sync_best_effort(current_proc);
+        sched();
+    }
+    spin_unlock(&proc_lock);
 }
 
 
-void notify_child_exit(struct process *child) {
+// Timer interrupt path: wake every process whose deadline has passed.
+void scheduler_expire_timers(void) {
+    spin_lock(&proc_lock);
+    uint64_t now = timer_now();
+    while (sleep_heap_len > 0 && sleep_heap[1]->wakeup_time <= now) {
+        struct process *proc = sleep_heap[1];
+        make_runnable(proc);
+        procfs_sync_best_effort(proc);
+    }
+    spin_unlock(&proc_lock);
+}
+
+
+static void mark_exited(struct process *proc) {
+    proc_queue_remove(proc);
+    timer_cancel(proc);
+    set_proc_state(proc, PROC_EXITED, PROC_WAIT_NONE, -1);
+    proc_queue_push(&exited_queue, proc);
+}
+
+
+static void notify_child_exit(struct process *child) {
     if (!child || child->parent_pid <= 0) {
         return;
     }
 
-    int parent_pid = child->parent_pid;
-    for (int i = 0; i < PROCS_MAX; i++) {
-        struct process *proc = &procs[i];
-        if (proc->pid != parent_pid || proc->state != PROC_WAITTING) {
-            continue;
-        }
-        if (proc->wait_reason != PROC_WAIT_CHILD_EXIT) {
-            continue;
-        }
+    struct process *parent = find_process_by_pid(child->parent_pid);
+    if (!parent) {
+        return;
+    }
 
-        if (proc->wait_pid == -1 || proc->wait_pid == child->pid) {
-            proc->state = PROC_RUNNABLE;
-            proc->wait_reason = PROC_WAIT_NONE;
-            proc->wait_pid = -1;
-            procfs_sync_best_effort(proc);
-        }
+    // Only wake a waitpid() that can collect this child.
+    struct process *waiter = parent->child_exit_waiters.waiters.head;
+    if (waiter && (waiter->wait_pid == -1 || waiter->wait_pid == child->pid)) {
+        wake_all(&parent->child_exit_waiters);
     }
 }
 
 
-void orphan_children(int parent_pid) {
+static void orphan_children(int parent_pid) {
     if (parent_pid <= 0) {
         return;
     }
@@ -689,11 +1336,53 @@ void orphan_children(int parent_pid) {
 }
 
 
+// Exit the current process. proc_lock held; the slot stays EXITED and on this hart
+// until finish_switch() on the next process, so no other hart reaps a live stack.
+__attribute__((noreturn))
+static void exit_current(void) {
+    struct process *proc = current_proc;
+
+    // Treat pid=1 as init process. When init exits, shut down kernel.
+    if (proc == init_proc) {
+        // kernel_shutdown() flushes the fs and may sleep on the disk, so init stays
+        // a live process until the machine powers off.
+        spin_unlock(&proc_lock);
+        kernel_shutdown();
+    }
+
+    orphan_children(proc->pid);
+    mark_exited(proc);
+    procfs_sync_best_effort(proc);
+    notify_child_exit(proc);
+    // kill command semantics: nobody collects a killed process
+    if (proc->killed) {
+        proc->parent_pid = 0;
+    }
+    sched();
+    PANIC("exited process resumed unexpectedly");
+}
+
+void process_exit(void) {
+    spin_lock(&proc_lock);
+    exit_current();
+}
+
+// A kill aimed at this process while it ran on another hart takes effect here,
+// on the way back to user mode.
+void process_exit_if_killed(void) {
+    struct process *proc = current_proc;
+    if (proc && proc->pid > 0 && proc->killed) {
+        process_exit();
+    }
+}
+
+
 int wait_for_child_exit(int parent_pid, int target_pid) {
     if (parent_pid <= 0) {
         return -1;
     }
 
+    spin_lock(&proc_lock);
     while (1) {
         bool has_child = false;
 
@@ -711,30 +1400,31 @@ int wait_for_child_exit(int parent_pid, int target_pid) {
             if (proc->state == PROC_EXITED) {
                 int exited_pid = proc->pid;
                 recycle_process_slot(proc);
+                spin_unlock(&proc_lock);
                 return exited_pid;
             }
         }
 
         if (!has_child) {
+            spin_unlock(&proc_lock);
             return -1;
         }
 
-        current_proc->wait_reason = PROC_WAIT_CHILD_EXIT;
-        current_proc->wait_pid = target_pid;
-        current_proc->state = PROC_WAITTING;
-        procfs_sync_best_effort(current_proc);
-        yield();
+        sleep_on(&current_proc->child_exit_waiters, PROC_WAIT_CHILD_EXIT, target_pid);
     }
 }
 
 
 int process_ipc_send(int src_pid, int dst_pid, uint32_t message) {
+    spin_lock(&proc_lock);
     struct process *dst = find_process_by_pid(dst_pid);
     if (!dst || dst->state == PROC_EXITED) {
+        spin_unlock(&proc_lock);
         return -1;
     }
 
     if (dst->ipc_has_message) {
+        spin_unlock(&proc_lock);
         return -2;
     }
 
@@ -742,41 +1432,39 @@ int process_ipc_send(int src_pid, int dst_pid, uint32_t message) {
     dst->ipc_from_pid = src_pid;
     dst->ipc_message = message;
 
-    if (dst->state == PROC_WAITTING && dst->wait_reason == PROC_WAIT_IPC_RECV) {
-        dst->state = PROC_RUNNABLE;
-        dst->wait_reason = PROC_WAIT_NONE;
-        dst->wait_pid = -1;
-        procfs_sync_best_effort(dst);
-    }
+    wake_one(&dst->ipc_waiters);
+    spin_unlock(&proc_lock);
 
     return 0;
 }
 
 
 int process_ipc_recv(int self_pid, int *from_pid, uint32_t *message) {
+    spin_lock(&proc_lock);
     struct process *self = find_process_by_pid(self_pid);
     if (!self) {
+        spin_unlock(&proc_lock);
         return -1;
     }
 
     while (!self->ipc_has_message) {
-        self->wait_reason = PROC_WAIT_IPC_RECV;
-        self->wait_pid = -1;
-        self->state = PROC_WAITTING;
-        procfs_sync_best_effort(self);
-        yield();
+        sleep_on(&self->ipc_waiters, PROC_WAIT_IPC_RECV, -1);
     }
 
+    int from = self->ipc_from_pid;
+    uint32_t msg = self->ipc_message;
+    self->ipc_has_message = 0;
+    self->ipc_from_pid = 0;
+    self->ipc_message = 0;
+    spin_unlock(&proc_lock);
+
+    // user pointers are written outside the lock
     if (from_pid) {
-        *from_pid = self->ipc_from_pid;
+        *from_pid = from;
     }
     if (message) {
-        *message = self->ipc_message;
+        *message = msg;
     }
-
-    self->ipc_has_message = 0;
-    self->ipc_from_pid = 0;
-    self->ipc_message = 0;
     return 0;
 }
 
@@ -785,36 +1473,56 @@ int process_kill(int target_pid) {
         return -1;
     }
 
+    spin_lock(&proc_lock);
     struct process *target = find_process_by_pid(target_pid);
     if (!target || target->state == PROC_EXITED) {
+        spin_unlock(&proc_lock);
         return -2;
     }
 
-    if (target == init_proc) {
+    if (target == init_proc || target->kthread_fn) {
+        spin_unlock(&proc_lock);
         return -3;
     }
 
     int killed_pid = target->pid;
-    orphan_children(target->pid);
-    target->state = PROC_EXITED;
-    target->wait_reason = PROC_WAIT_NONE;
-    target->wait_pid = -1;
-    procfs_sync_best_effort(target);
-    notify_child_exit(target);
+    target->killed = true;
 
     if (target == current_proc) {
         // Self-kill cannot free current stack/context immediately.
-        target->parent_pid = 0;
-        yield();
-        PANIC("killed process resumed unexpectedly");
+        exit_current();
     }
 
+    if (target->cpu) {
+        // Running on another hart: it exits itself on its next return to user mode.
+        smp_send_ipi(target->cpu);
+        spin_unlock(&proc_lock);
+        return killed_pid;
+    }
+
+    // Asleep on block I/O, or woken but not yet back from its syscall: it may own
+    // in-kernel state (a request on its stack in blk_pending, the pfs or bcache
+    // writer slot). Let it finish and exit at the user-return boundary.
+    if (target->in_syscall &&
+        (target->state == PROC_RUNNABLE || target->wait_reason == PROC_WAIT_BLOCK_IO)) {
+        if (target->state == PROC_WAITTING) {
+            make_runnable(target);      // I/O waits re-check their condition
+        }
+        spin_unlock(&proc_lock);
+        return killed_pid;
+    }
+
+    orphan_children(target->pid);
+    mark_exited(target);
+    procfs_sync_best_effort(target);
+    notify_child_exit(target);
+
     // kill command semantics: reclaim target slot immediately.
     target->parent_pid = 0;
     recycle_process_slot(target);
+    spin_unlock(&proc_lock);
     return killed_pid;
 }
-
 static const char *proc_state_str(int state) {
     switch (state) {
         case PROC_UNUSED:   return "UNUSED";
@@ -831,6 +1539,8 @@ static const char *proc_wait_reason_str(int wait_reason) {
         case PROC_WAIT_CONSOLE_INPUT: return "CONSOLE_INPUT";
         case PROC_WAIT_CHILD_EXIT:    return "CHILD_EXIT";
         case PROC_WAIT_IPC_RECV:      return "IPC_RECV";
+        case PROC_WAIT_TIMER:         return "TIMER";
+        case PROC_WAIT_BLOCK_IO:      return "BLOCK_IO";
         default:                      return "UNKNOWN";
     }
 }
@@ -843,6 +1553,19 @@ static int str_len_k(const char *s) {
     return n;
 }
 
+// Replace the contents of a /proc file with a generated text.
+static int procfs_write_file(int pid, const char *path, const char *content) {
+    int fd = fs_open(pid, path, O_CREAT | O_WRONLY | O_TRUNC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int len = str_len_k(content);
+    int written = fs_write(pid, fd, content, (size_t) len);
+    (void) fs_close(pid, fd);
+    return (written == len) ? 0 : -1;
+}
+
 static int append_char_k(char *out, size_t out_size, size_t *pos, char c) {
     if (!out || !pos || *pos + 1 >= out_size) {
         return -1;
@@ -901,24 +1624,6 @@ static int append_key_val_str(char *out, size_t out_size, size_t *pos,
     return 0;
 }
 
-struct process *process_from_trap_frame(struct trap_frame *f) {
-    if (!f) {
-        return NULL;
-    }
-
-    uint32_t addr = (uint32_t) f;
-    for (int i = 0; i < PROCS_MAX; i++) {
-        struct process *proc = &procs[i];
-        uint32_t stack_base = (uint32_t) &proc->stack[0];
-        uint32_t stack_end = (uint32_t) (&proc->stack[sizeof(proc->stack)]);
-        if (addr >= stack_base && addr < stack_end) {
-            return proc;
-        }
-    }
-
-    return NULL;
-}
-
 int procfs_sync_process(const struct process *proc) {
     if (!proc) {
         return -1;
@@ -929,7 +1634,7 @@ int procfs_sync_process(const struct process *proc) {
 
     char dir_path[FS_PATH_MAX];
     char status_path[FS_PATH_MAX];
-    char content[256];
+    char content[384];
     size_t pos = 0;
 
     // Ensure /proc/<pid> exists (ignore EEXIST-like failures).
@@ -939,7 +1644,7 @@ int procfs_sync_process(const struct process *proc) {
     if (append_u32_k(dir_path, sizeof(dir_path), &pos, (uint32_t) proc->pid) < 0) {
         return -1;
     }
-    (void) fs_mkdir(dir_path);
+    (void) fs_mkdir(proc->pid, dir_path);
 
     strcpy_s(status_path, sizeof(status_path), dir_path);
     strcat_s(status_path, sizeof(status_path), "/status");
@@ -953,17 +1658,12 @@ int procfs_sync_process(const struct process *proc) {
     if (append_key_val_str(content, sizeof(content), &pos, "state", proc_state_str(proc->state)) < 0) return -1;
     if (append_key_val_u32(content, sizeof(content), &pos, "wait_reason_id", (uint32_t) proc->wait_reason) < 0) return -1;
     if (append_key_val_str(content, sizeof(content), &pos, "wait_reason", proc_wait_reason_str(proc->wait_reason)) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "priority", (uint32_t) proc->sched_level) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "nice", (uint32_t) proc->nice) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "wait_ticks", proc->wait_ticks) < 0) return -1;
     if (append_key_val_str(content, sizeof(content), &pos, "cwd", proc->cwd_path) < 0) return -1;
 
-    int fd = fs_open(proc->pid, status_path, O_CREAT | O_WRONLY | O_TRUNC);
-    if (fd < 0) {
-        return -1;
-    }
-
-    int len = str_len_k(content);
-    int written = fs_write(proc->pid, fd, content, (size_t) len);
-    (void) fs_close(proc->pid, fd);
-    return (written == len) ? 0 : -1;
+    return procfs_write_file(proc->pid, status_path, content);
 }
 
 int procfs_cleanup(const struct process *proc) {
@@ -986,8 +1686,178 @@ int procfs_cleanup(const struct process *proc) {
     strcpy_s(status_path, sizeof(status_path), dir_path);
     strcat_s(status_path, sizeof(status_path), "/status");
 
-    (void) fs_unlink(status_path);
-    (void) fs_rmdir(dir_path);
+    (void) fs_unlink(proc->pid, status_path);
+    (void) fs_rmdir(proc->pid, dir_path);
+
+    return 0;
+}
+
+int procfs_sync_meminfo(int pid) {
+    struct memory_stats stats;
+    memory_get_stats(&stats);
+
+    char content[512];
+    size_t pos = 0;
+    content[0] = '\0';
+    if (append_key_val_u32(content, sizeof(content), &pos, "total_pages", stats.total_pages) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "managed_pages", stats.managed_pages) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "free_pages", stats.free_pages) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "used_pages", stats.managed_pages - stats.free_pages) < 0) return -1;
+
+    // free_order_<n>: <free blocks>  (each block is 2^n pages)
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        char key[16];
+        size_t key_pos = 0;
+        key[0] = '\0';
+        if (append_str_k(key, sizeof(key), &key_pos, "free_order_") < 0) return -1;
+        if (append_u32_k(key, sizeof(key), &key_pos, order) < 0) return -1;
+        if (append_key_val_u32(content, sizeof(content), &pos, key, stats.free_blocks[order]) < 0) return -1;
+    }
+
+    return procfs_write_file(pid, "/proc/meminfo", content);
+}
+
+int procfs_sync_sched(int pid) {
+    char content[512];
+    size_t pos = 0;
+    content[0] = '\0';
+    // Snapshot without proc_lock: fs_lock is held here and nests inside it.
+    uint32_t running = 0;
+    uint32_t online = 0;
+    uint32_t tick_stopped = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        struct cpu *cpu = &cpus[i];
+        if (!cpu->online) {
+            continue;
+        }
+        struct process *cur = cpu->current;
+        online++;
+        if (cur && cur->pid > 0 && cur->state == PROC_RUNNABLE) {
+            running++;
+        }
+        if (cpu->tick_stopped) {
+            tick_stopped++;
+        }
+    }
+    if (append_key_val_u32(content, sizeof(content), &pos, "cpus_online", online) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "runqueue_length", scheduler_runqueue_length()) < 0) return -1;
+    for (int level = 0; level < SCHED_LEVELS; level++) {
+        char key[24];
+        size_t key_pos = 0;
+        key[0] = '\0';
+        if (append_str_k(key, sizeof(key), &key_pos, "runqueue_level") < 0) return -1;
+        if (append_u32_k(key, sizeof(key), &key_pos, (uint32_t) level) < 0) return -1;
+        uint32_t length = 0;
+        for (int i = 0; i < cpu_count; i++) {
+            length += run_queues[i][level].length;
+        }
+        if (append_key_val_u32(content, sizeof(content), &pos, key, length) < 0) return -1;
+    }
+    if (append_key_val_u32(content, sizeof(content), &pos, "running", running) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "wait_console_input", wait_counts[PROC_WAIT_CONSOLE_INPUT]) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "wait_child_exit", wait_counts[PROC_WAIT_CHILD_EXIT]) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "wait_ipc_recv", wait_counts[PROC_WAIT_IPC_RECV]) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "wait_timer", wait_counts[PROC_WAIT_TIMER]) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "wait_block_io", wait_counts[PROC_WAIT_BLOCK_IO]) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "exited", exited_queue.length) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "tick_stopped", tick_stopped) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "sched_ticks", sched_ticks) < 0) return -1;
+
+    return procfs_write_file(pid, "/proc/sched", content);
+}
+
+static int append_cpu_key_val_u32(char *out, size_t out_size, size_t *pos,
+                                  int cpu_id, const char *name, uint32_t value) {
+    char key[24];
+    size_t key_pos = 0;
+    key[0] = '\0';
+    if (append_str_k(key, sizeof(key), &key_pos, "cpu") < 0) return -1;
+    if (append_u32_k(key, sizeof(key), &key_pos, (uint32_t) cpu_id) < 0) return -1;
+    if (append_char_k(key, sizeof(key), &key_pos, '_') < 0) return -1;
+    if (append_str_k(key, sizeof(key), &key_pos, name) < 0) return -1;
+    return append_key_val_u32(out, out_size, pos, key, value);
+}
 
+// Per-hart load balancing counters. Same unlocked snapshot as /proc/sched.
+int procfs_sync_cpus(int pid) {
+    char content[768];
+    size_t pos = 0;
+    content[0] = '\0';
+    for (int i = 0; i < cpu_count; i++) {
+        struct cpu *cpu = &cpus[i];
+        struct process *cur = cpu->current;
+        if (!cpu->online) {
+            continue;
+        }
+        if (append_cpu_key_val_u32(content, sizeof(content), &pos, i, "hart", (uint32_t) cpu->hart_id) < 0) return -1;
+        if (append_cpu_key_val_u32(content, sizeof(content), &pos, i, "pid", cur ? (uint32_t) cur->pid : 0) < 0) return -1;
+        if (append_cpu_key_val_u32(content, sizeof(content), &pos, i, "runqueue", cpu_runqueue_length(i)) < 0) return -1;
+        if (append_cpu_key_val_u32(content, sizeof(content), &pos, i, "steals", cpu->steals) < 0) return -1;
+        if (append_cpu_key_val_u32(content, sizeof(content), &pos, i, "migrations", cpu->migrations) < 0) return -1;
+        if (append_cpu_key_val_u32(content, sizeof(content), &pos, i, "idle_ms", cpu->idle_ms) < 0) return -1;
+    }
+
+    return procfs_write_file(pid, "/proc/cpus", content);
+}
+
+// pfs change volume handed to the block cache, and how full the volume is.
+int procfs_sync_pfs(int pid) {
+    struct pfs_stats stats;
+    fs_get_pfs_stats(&stats);
+
+    char content[256];
+    size_t pos = 0;
+    content[0] = '\0';
+    if (append_key_val_u32(content, sizeof(content), &pos, "syncs", stats.syncs) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "blocks_written", stats.blocks_written) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "bytes_written", stats.bytes_written) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "last_sync_bytes", stats.last_sync_bytes) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "errors", stats.errors) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "dirty_blocks", stats.dirty_blocks) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "used_blocks", stats.used_blocks) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "total_blocks", stats.total_blocks) < 0) return -1;
+
+    return procfs_write_file(pid, "/proc/pfs", content);
+}
+
+// Write-back cache counters; dirty_blocks drops to 0 after each kflushd pass.
+int procfs_sync_bcache(int pid) {
+    struct bcache_stats stats;
+    bcache_get_stats(&stats);
+
+    char content[256];
+    size_t pos = 0;
+    content[0] = '\0';
+    if (append_key_val_u32(content, sizeof(content), &pos, "blocks", BCACHE_BLOCKS) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "evictions", stats.evictions) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "dirty_blocks", stats.dirty_blocks) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "flushes", stats.flushes) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "blocks_flushed", stats.blocks_flushed) < 0) return -1;
+    if (append_key_val_u32(content, sizeof(content), &pos, "errors", stats.errors) < 0) return -1;
+
+    return procfs_write_file(pid, "/proc/bcache", content);
+}
+
+int procfs_on_open(int pid, const char *name) {
+    if (!name) {
+        return -1;
+    }
+
+    // Global /proc files are regenerated right before a reader opens them.
+    if (strcmp(name, "meminfo") == 0) {
+        return procfs_sync_meminfo(pid);
+    }
+    if (strcmp(name, "sched") == 0) {
+        return procfs_sync_sched(pid);
+    }
+    if (strcmp(name, "cpus") == 0) {
+        return procfs_sync_cpus(pid);
+    }
+    if (strcmp(name, "pfs") == 0) {
+        return procfs_sync_pfs(pid);
+    }
+    if (strcmp(name, "bcache") == 0) {
+        return procfs_sync_bcache(pid);
+    }
     return 0;
 }
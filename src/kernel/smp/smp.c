@@ -0,0 +1,85 @@
+#include "kernel.h"
+#include "commonlibs.h"
+#include "memory.h"
+#include "timer.h"
+#include "sbi.h"
+#include "cpu.h"
+
+#define SIE_SSIE        (1u << 1)
+#define SIP_SSIP        (1u << 1)
+#define SMP_ONLINE_TIMEOUT  TIMER_FREQ_HZ   // 1s
+
+struct cpu cpus[CPUS_MAX];
+int cpu_count = 1;
+
+
+// tp already points at cpus[0] (set in boot()); fill it once bss is cleared.
+void cpu_init_boot(int hart_id) {
+    struct cpu *cpu = &cpus[0];
+    cpu->id = 0;
+    cpu->hart_id = hart_id;
+    cpu->online = true;
+}
+
+
+// SBI HSM entry: a0 = hart id, a1 = struct cpu *, MMU off.
+__attribute__((naked))
+static void secondary_entry(void) {
+    __asm__ __volatile__(
+        "mv tp, a1\n"
+        "lw sp, 0(a1)\n"            // cpu->boot_sp
+        "csrw sscratch, zero\n"
+        "j kernel_secondary_main\n"
+    );
+}
+
+
+void smp_start_secondaries(void) {
+    if (!sbi_probe_extension(SBI_EXT_HSM)) {
+        printf("     [smp] SBI HSM not available, single hart\n");
+        return;
+    }
+
+    for (int hart_id = 0; hart_id < SMP_HART_ID_MAX && cpu_count < CPUS_MAX; hart_id++) {
+        if (hart_id == cpus[0].hart_id) {
+            continue;
+        }
+
+        struct cpu *cpu = &cpus[cpu_count];
+        paddr_t stack = alloc_pages(SMP_BOOT_STACK_PAGES);
+        cpu->id = cpu_count;
+        cpu->hart_id = hart_id;
+        cpu->boot_sp = stack + SMP_BOOT_STACK_PAGES * PAGE_SIZE;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        // Missing hart ids fail with INVALID_PARAM; try the next one.
+        long err = sbi_hart_start((unsigned long) hart_id, (unsigned long) secondary_entry, (unsigned long) cpu);
+        if (err != SBI_SUCCESS) {
+            free_pages(stack, SMP_BOOT_STACK_PAGES);
+            memset(cpu, 0, sizeof(*cpu));
+            continue;
+        }
+
+        uint64_t deadline = timer_now() + SMP_ONLINE_TIMEOUT;
+        while (!cpu->online) {
+            if (timer_now() > deadline) {
+                PANIC("hart %d did not come online", hart_id);
+            }
+        }
+        cpu_count++;
+    }
+    printf("     [smp] %d hart(s) online\n", cpu_count);
+}
+
+
+void smp_send_ipi(struct cpu *cpu) {
+    (void) sbi_send_ipi(1, (unsigned long) cpu->hart_id);
+}
+
+void enable_ipi(void) {
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_SSIE);
+}
+
+void clear_ipi(void) {
+    WRITE_CSR(sip, READ_CSR(sip) & ~SIP_SSIP);
+}
@@ -0,0 +1,86 @@
+#include "kernel.h"
+#include "commonlibs.h"
+#include "cpu.h"
+#include "spinlock.h"
+
+#define SSTATUS_SIE (1u << 1)
+
+
+// Kernel code normally runs with interrupts off already; this keeps the idle loop,
+// which opens an interrupt window, from taking a trap while a lock is held.
+void irq_push_off(void) {
+    uint32_t sstatus = READ_CSR(sstatus);
+    WRITE_CSR(sstatus, sstatus & ~SSTATUS_SIE);
+
+    struct cpu *cpu = this_cpu();
+    if (cpu->irq_depth == 0) {
+        cpu->irq_enabled = (sstatus & SSTATUS_SIE) != 0;
+    }
+    cpu->irq_depth++;
+}
+
+void irq_pop_off(void) {
+    struct cpu *cpu = this_cpu();
+    if (READ_CSR(sstatus) & SSTATUS_SIE) {
+        PANIC("irq_pop_off: interrupts enabled");
+    }
+    if (cpu->irq_depth == 0) {
+        PANIC("irq_pop_off: unbalanced");
+    }
+
+    cpu->irq_depth--;
+    if (cpu->irq_depth == 0 && cpu->irq_enabled) {
+        WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SIE);
+    }
+}
+
+
+bool spin_holding(const struct spinlock *lk) {
+    return lk->locked && lk->owner == this_cpu();
+}
+
+void spin_lock(struct spinlock *lk) {
+    irq_push_off();
+    if (spin_holding(lk)) {
+        PANIC("spin_lock: %s already held by this hart", lk->name);
+    }
+
+    while (__atomic_exchange_n(&lk->locked, 1, __ATOMIC_ACQUIRE) != 0) {
+        // spin
+    }
+    lk->owner = this_cpu();
+}
+
+void spin_unlock(struct spinlock *lk) {
+    if (!spin_holding(lk)) {
+        PANIC("spin_unlock: %s not held", lk->name);
+    }
+
+    lk->owner = NULL;
+    __atomic_store_n(&lk->locked, 0, __ATOMIC_RELEASE);
+    irq_pop_off();
+}
+
+
+// For subsystems whose entry points call each other (the fs and procfs regeneration).
+void spin_lock_recursive(struct spinlock *lk) {
+    irq_push_off();
+    if (spin_holding(lk)) {
+        lk->depth++;
+        irq_pop_off();
+        return;
+    }
+    spin_lock(lk);
+    lk->depth = 1;
+    irq_pop_off();
+}
+
+void spin_unlock_recursive(struct spinlock *lk) {
+    if (!spin_holding(lk) || lk->depth == 0) {
+        PANIC("spin_unlock_recursive: %s not held", lk->name);
+    }
+    if (--lk->depth > 0) {
+        return;
+    }
+    spin_unlock(lk);
+}
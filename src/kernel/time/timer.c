@@ -7,10 +7,8 @@ void enable_timer_interrupt(void) {
     uint32_t sie = READ_CSR(sie);
     sie |= (1 << 5);
     WRITE_CSR(sie, sie);
-
-    uint32_t sstatus = READ_CSR(sstatus);
-    sstatus |= (1 << 1);
-    WRITE_CSR(sstatus, sstatus);
+    // sstatus.SIE stays off in the kernel: interrupts are taken in user mode
+    // (SPIE on sret) and in the idle loop's wfi window.
 }
 
 
@@ -28,16 +26,50 @@ static inline uint64_t rdtime(void) {
 static inline void wrtimecmp(uint64_t val) {
     uint32_t lo = val & 0xffffffff;
     uint32_t hi = val >> 32;
+    // Park the low half at max first so no intermediate value is in the past.
     __asm__ __volatile__ (
-        "csrw stimecmp, %0\n"
+        "csrw stimecmp, %2\n"
         "csrw stimecmph, %1\n"
+        "csrw stimecmp, %0\n"
         :
-        : "r"(lo), "r"(hi)
+        : "r"(lo), "r"(hi), "r"(0xffffffff)
     );
 }
 
 
+// stimecmp is per hart: every call arms the calling hart only.
 void timer_set_next() {
+    wrtimecmp(rdtime() + TIMER_INTERVAL);
+}
+
+
+// One-shot interrupt at an absolute time (sleep deadlines).
+void timer_arm_at(uint64_t deadline) {
+    wrtimecmp(deadline);
+}
+
+
+uint64_t timer_now(void) {
+    return rdtime();
+}
+
+
+// Tickless: no timer interrupt until the next timer_set_next().
+void timer_disarm(void) {
+    wrtimecmp(0xffffffffffffffffULL);
+}
+
+
+// Whole TIMER_INTERVAL periods since *last_tick_time, so tick-based accounting stays
+// in real time across tickless gaps. 0 for an early (sleep deadline) interrupt.
+uint32_t timer_consume_ticks(uint64_t *last_tick_time) {
     uint64_t now = rdtime();
-    wrtimecmp(now + TIMER_INTERVAL);
+    uint64_t elapsed64 = now - *last_tick_time;
+    uint32_t elapsed = (elapsed64 > 0xffffffffULL) ? 0xffffffff : (uint32_t) elapsed64;
+    uint32_t ticks = elapsed / TIMER_INTERVAL;
+    if (ticks == 0) {
+        return 0;
+    }
+    *last_tick_time += (uint64_t) ticks * TIMER_INTERVAL;
+    return ticks;
 }
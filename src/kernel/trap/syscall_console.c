@@ -1,14 +1,18 @@
 #include "syscall_internal.h"
 #include "syscall.h"
 #include "process.h"
+#include "spinlock.h"
+#include "uart.h"
 #include "commonlibs.h"
 
-extern struct process *current_proc;
 
 static char input_buf[64];
 static uint32_t input_head;
 static uint32_t input_tail;
 static uint32_t input_count;
+static struct wait_queue input_waiters;
+// Guards the input ring; taken before proc_lock and uart_lock.
+static struct spinlock console_lock = SPINLOCK_INIT("console");
 
 static bool input_pop(char *ch) {
     if (input_count == 0) {
@@ -21,40 +25,65 @@ static bool input_pop(char *ch) {
     return true;
 }
 
-void poll_console_input(void) {
+static void input_push(char ch) {
+    input_buf[input_tail] = ch;
+    input_tail = (input_tail + 1) % sizeof(input_buf);
+    input_count++;
+}
+
+static void poll_input_locked(void) {
     while (input_count < sizeof(input_buf)) {
         long ch = getchar();
         if (ch < 0) {
             break;
         }
+        input_push((char) ch);
+    }
 
-        input_buf[input_tail] = (char) ch;
-        input_tail = (input_tail + 1) % sizeof(input_buf);
-        input_count++;
+    if (input_count > 0) {
+        wait_queue_wake_all(&input_waiters);
     }
+}
 
+// Timer-tick polling, needed only on the SBI console (no RX interrupt).
+void poll_console_input(void) {
+    if (uart_active()) {
+        return;
+    }
+    spin_lock(&console_lock);
+    poll_input_locked();
+    spin_unlock(&console_lock);
+}
+
+// UART RX interrupt. Bytes that do not fit the ring are dropped.
+void console_receive(const char *buf, int len) {
+    spin_lock(&console_lock);
+    for (int i = 0; i < len && input_count < sizeof(input_buf); i++) {
+        input_push(buf[i]);
+    }
     if (input_count > 0) {
-        wakeup_input_waiters();
+        wait_queue_wake_all(&input_waiters);
     }
+    spin_unlock(&console_lock);
 }
 
 void syscall_handle_putchar(struct trap_frame *f) {
-    putchar(f->a0);
+    char ch = (char) f->a0;
+    console_write(&ch, 1);
 }
 
 void syscall_handle_getchar(struct trap_frame *f) {
     char ch;
+    spin_lock(&console_lock);
     while (!input_pop(&ch)) {
-        poll_console_input();
+        poll_input_locked();
         if (input_pop(&ch)) {
             break;
         }
 
-        current_proc->wait_reason = PROC_WAIT_CONSOLE_INPUT;
-        current_proc->state = PROC_WAITTING;
-        yield();
+        wait_queue_sleep(&input_waiters, PROC_WAIT_CONSOLE_INPUT, -1, &console_lock);
     }
+    spin_unlock(&console_lock);
 
-    current_proc->wait_reason = PROC_WAIT_NONE;
     f->a0 = (uint8_t) ch;
 }
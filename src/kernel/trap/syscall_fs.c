@@ -4,9 +4,6 @@
 #include "fs_internal.h"
 #include "commonlibs.h"
 
-#define SSTATUS_SUM (1u << 18)
-
-extern struct process *current_proc;
 
 void syscall_handle_open(struct trap_frame *f) {
     if (!current_proc) {
@@ -22,10 +19,7 @@ void syscall_handle_open(struct trap_frame *f) {
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
     int ret = fs_open(current_proc->pid, path, flags);
-    WRITE_CSR(sstatus, sstatus);
 
     f->a0 = ret;
 }
@@ -54,10 +48,7 @@ void syscall_handle_read(struct trap_frame *f) {
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
     int ret = fs_read(current_proc->pid, fd, buf, size);
-    WRITE_CSR(sstatus, sstatus);
 
     f->a0 = ret;
 }
@@ -77,10 +68,7 @@ void syscall_handle_write(struct trap_frame *f) {
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
     int ret = fs_write(current_proc->pid, fd, buf, size);
-    WRITE_CSR(sstatus, sstatus);
 
     f->a0 = ret;
 }
@@ -92,10 +80,7 @@ void syscall_handle_mkdir(struct trap_frame *f) {
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
-    int ret = fs_mkdir(path);
-    WRITE_CSR(sstatus, sstatus);
+    int ret = fs_mkdir(current_proc->pid, path);
 
     f->a0 = ret;
 }
@@ -110,10 +95,7 @@ void syscall_handle_readdir(struct trap_frame *f) {
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
-    int ret = fs_readdir(path, index, out);
-    WRITE_CSR(sstatus, sstatus);
+    int ret = fs_readdir(current_proc->pid, path, index, out);
 
     f->a0 = ret;
 }
@@ -125,10 +107,7 @@ void syscall_handle_unlink(struct trap_frame *f) {
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
-    int ret = fs_unlink(path);
-    WRITE_CSR(sstatus, sstatus);
+    int ret = fs_unlink(current_proc->pid, path);
 
     f->a0 = ret;
 }
@@ -140,14 +119,19 @@ void syscall_handle_rmdir(struct trap_frame *f) {
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
-    int ret = fs_rmdir(path);
-    WRITE_CSR(sstatus, sstatus);
+    int ret = fs_rmdir(current_proc->pid, path);
 
     f->a0 = ret;
 }
 
+void syscall_handle_fsync(struct trap_frame *f) {
+    f->a0 = fs_fsync(current_proc->pid, (int) f->a0);
+}
+
+void syscall_handle_sync(struct trap_frame *f) {
+    f->a0 = fs_sync();
+}
+
 void syscall_handle_dup2(struct trap_frame *f) {
     int fd1 = f->a0;
     int fd2 = f->a1;
@@ -172,10 +156,7 @@ void syscall_handle_getcwd(struct trap_frame *f) {
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
     strcpy_s(cwd_path, FS_PATH_MAX, current_proc->cwd_path);
-    WRITE_CSR(sstatus, sstatus);
 
     f->a0 = 0;
 }
@@ -193,13 +174,15 @@ void syscall_handle_chdir(struct trap_frame *f) {
     }
 
     char path[FS_PATH_MAX];
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
     strcpy_s(path, sizeof(path), user_path);
-    WRITE_CSR(sstatus, sstatus);
+    // cwd_path is reported by getcwd as-is, so it has to stay absolute
+    if (path[0] != '/') {
+        f->a0 = -1;
+        return;
+    }
 
     int mount_idx, node_idx;
-    if (fs_get_path_entry(&mount_idx, &node_idx, path) < 0) {
+    if (fs_get_path_entry(current_proc->pid, &mount_idx, &node_idx, path) < 0) {
         f->a0 = -1;
         return;
     }
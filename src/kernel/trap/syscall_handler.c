@@ -1,119 +1,99 @@
 #include "kernel.h"
 #include "syscall.h"
 #include "syscall_internal.h"
+#include "process.h"
+#include "cpu.h"
 #include "commonlibs.h"
 
-void handle_syscall(struct trap_frame *f) {
-    switch (f->a3) {
-        case SYSCALL_PUTCHAR:
-            syscall_handle_putchar(f);
-            break;
-
-        case SYSCALL_GETCHAR:
-            syscall_handle_getchar(f);
-            break;
-
-        case SYSCALL_EXIT:
-            syscall_handle_exit(f);
-            return;
-
-        case SYSCALL_PS:
-            syscall_handle_ps(f);
-            break;
-
-        case SYSCALL_CLONE:
-            syscall_handle_clone(f);
-            break;
-
-        case SYSCALL_WAITPID:
-            syscall_handle_waitpid(f);
-            break;
-
-        case SYSCALL_IPC_SEND:
-            syscall_handle_ipc_send(f);
-            break;
-
-        case SYSCALL_IPC_RECV:
-            syscall_handle_ipc_recv(f);
-            break;
-
-        case SYSCALL_BITMAP:
-            syscall_handle_bitmap(f);
-            break;
-
-        case SYSCALL_KILL:
-            syscall_handle_kill(f);
-            break;
-
-        case SYSCALL_KERNEL_INFO:
-            syscall_handle_kernel_info(f);
-            break;
-
-        case SYSCALL_OPEN:
-            syscall_handle_open(f);
-            break;
-
-        case SYSCALL_CLOSE:
-            syscall_handle_close(f);
-            break;
-
-        case SYSCALL_READ:
-            syscall_handle_read(f);
-            break;
-
-        case SYSCALL_WRITE:
-            syscall_handle_write(f);
-            break;
-
-        case SYSCALL_MKDIR:
-            syscall_handle_mkdir(f);
-            break;
-
-        case SYSCALL_READDIR:
-            syscall_handle_readdir(f);
-            break;
-
-        case SYSCALL_UNLINK:
-            syscall_handle_unlink(f);
-            break;
-
-        case SYSCALL_RMDIR:
-            syscall_handle_rmdir(f);
-            break;
-
-        case SYSCALL_GETTIME:
-            syscall_handle_gettime(f);
-            break;
-        
-        case SYSCALL_FORK:
-            syscall_handle_fork(f);
-            break;
-
-        case SYSCALL_EXEC:
-            syscall_handle_exec(f);
-            break;
-
-        case SYSCALL_DUP2:
-            syscall_handle_dup2(f);
-            break;
-
-        case SYSCALL_EXECV:
-            syscall_handle_execv(f);
-            break;
+#define SYSCALL_ENTRY(num, fn, nargs, fl) \
+    [num] = { .handler = syscall_handle_##fn, .name = #fn, .argc = (nargs), .flags = (fl) }
+
+static const struct syscall_desc syscall_table[] = {
+    SYSCALL_ENTRY(SYSCALL_PUTCHAR,     putchar,     1, 0),
+    SYSCALL_ENTRY(SYSCALL_GETCHAR,     getchar,     0, SYSCALL_F_BLOCK),
+    SYSCALL_ENTRY(SYSCALL_EXIT,        exit,        0, SYSCALL_F_BLOCK),
+    SYSCALL_ENTRY(SYSCALL_PS,          ps,          2, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_CLONE,       clone,       1, 0),
+    SYSCALL_ENTRY(SYSCALL_BITMAP,      bitmap,      1, 0),
+    SYSCALL_ENTRY(SYSCALL_WAITPID,     waitpid,     1, SYSCALL_F_BLOCK),
+    SYSCALL_ENTRY(SYSCALL_IPC_SEND,    ipc_send,    2, 0),
+    SYSCALL_ENTRY(SYSCALL_IPC_RECV,    ipc_recv,    1, SYSCALL_F_SUM | SYSCALL_F_BLOCK),
+    SYSCALL_ENTRY(SYSCALL_KILL,        kill,        1, SYSCALL_F_BLOCK),     // self-kill exits
+    SYSCALL_ENTRY(SYSCALL_KERNEL_INFO, kernel_info, 1, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_OPEN,        open,        2, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_CLOSE,       close,       1, 0),
+    SYSCALL_ENTRY(SYSCALL_READ,        read,        3, SYSCALL_F_SUM | SYSCALL_F_BLOCK), // console stdin
+    SYSCALL_ENTRY(SYSCALL_WRITE,       write,       3, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_MKDIR,       mkdir,       1, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_READDIR,     readdir,     3, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_UNLINK,      unlink,      1, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_RMDIR,       rmdir,       1, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_GETTIME,     gettime,     1, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_FORK,        fork,        0, 0),
+    SYSCALL_ENTRY(SYSCALL_EXEC,        exec,        1, SYSCALL_F_EXEC),
+    SYSCALL_ENTRY(SYSCALL_DUP2,        dup2,        2, 0),
+    SYSCALL_ENTRY(SYSCALL_EXECV,       execv,       2, SYSCALL_F_SUM | SYSCALL_F_EXEC),
+    SYSCALL_ENTRY(SYSCALL_GETARGS,     getargs,     1, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_GETCWD,      getcwd,      1, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_CHDIR,       chdir,       1, SYSCALL_F_SUM),
+    SYSCALL_ENTRY(SYSCALL_NICE,        nice,        2, 0),
+    SYSCALL_ENTRY(SYSCALL_SLEEP_NS,    sleep_ns,    2, SYSCALL_F_BLOCK),
+    SYSCALL_ENTRY(SYSCALL_FSYNC,       fsync,       1, SYSCALL_F_BLOCK),
+    SYSCALL_ENTRY(SYSCALL_SYNC,        sync,        0, SYSCALL_F_BLOCK),
+};
+
+#define SYSCALL_TABLE_SIZE (sizeof(syscall_table) / sizeof(syscall_table[0]))
+
+
+static const struct syscall_desc *syscall_lookup(uint32_t sysno) {
+    if (sysno >= SYSCALL_TABLE_SIZE || !syscall_table[sysno].handler) {
+        return NULL;
+    }
+    return &syscall_table[sysno];
+}
 
-        case SYSCALL_GETARGS:
-            syscall_handle_getargs(f);
-            break;
+// User memory is reachable (sstatus.SUM) only for entries that declare it.
+// SUM is part of the sstatus switch_context() saves, so it survives a block.
+static void syscall_invoke(const struct syscall_desc *desc, struct trap_frame *f) {
+    if (desc->flags & SYSCALL_F_SUM) {
+        WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SUM);
+        desc->handler(f);
+        WRITE_CSR(sstatus, READ_CSR(sstatus) & ~SSTATUS_SUM);
+    } else {
+        desc->handler(f);
+    }
+}
 
-        case SYSCALL_GETCWD:
-            syscall_handle_getcwd(f);
-            break;
+// Returns the user pc to resume at: past the ecall, or the new image entry after exec.
+uint32_t handle_syscall(struct trap_frame *f, uint32_t pc) {
+    const struct syscall_desc *desc = syscall_lookup(f->a3);
+    if (!desc) {
+        PANIC("undefined system call %d", f->a3);
+    }
 
-        case SYSCALL_CHDIR:
-            syscall_handle_chdir(f);
-            break;
+    // process_kill() leaves a process that sleeps in here to exit on its own
+    current_proc->in_syscall = true;
+    syscall_invoke(desc, f);
+    current_proc->in_syscall = false;
+    if ((desc->flags & SYSCALL_F_EXEC) && f->a0 == 0) {
+        return USER_BASE;
+    }
+    return pc + 4;
+}
 
-        default:
-            PANIC("undefined system call");
+// Lean ecall path for syscalls that neither block nor replace the image: no scause
+// decoding and no per-trap bookkeeping, only sepc needs updating.
+// Returns false to fall back to handle_trap()'s full path.
+bool handle_syscall_fast(struct trap_frame *f) {
+    const struct syscall_desc *desc = syscall_lookup(f->a3);
+    if (!desc || (desc->flags & (SYSCALL_F_BLOCK | SYSCALL_F_EXEC))) {
+        return false;
     }
+
+    // sepc is per hart, not per process: read it before anything can switch away
+    uint32_t pc = READ_CSR(sepc);
+    syscall_invoke(desc, f);
+    process_exit_if_killed();
+    WRITE_CSR(sepc, pc + 4);
+    return true;
 }
@@ -2,6 +2,21 @@
 
 #include "kernel.h"
 
+// struct syscall_desc flags
+#define SYSCALL_F_SUM       (1u << 0)   // dereferences user pointers: run with sstatus.SUM set
+#define SYSCALL_F_BLOCK     (1u << 1)   // may sleep or switch away: needs the full trap path
+#define SYSCALL_F_EXEC      (1u << 2)   // on success (a0 == 0) resumes at the new image entry
+
+struct syscall_desc {
+    void        (*handler)(struct trap_frame *f);
+    const char  *name;
+    uint8_t     argc;                   // argument registers used (a0..)
+    uint8_t     flags;                  // SYSCALL_F_*
+};
+
+uint32_t handle_syscall(struct trap_frame *f, uint32_t pc);
+bool handle_syscall_fast(struct trap_frame *f);
+
 void syscall_handle_putchar(struct trap_frame *f);
 void syscall_handle_getchar(struct trap_frame *f);
 void syscall_handle_exit(struct trap_frame *f);
@@ -21,11 +36,15 @@ void syscall_handle_mkdir(struct trap_frame *f);
 void syscall_handle_readdir(struct trap_frame *f);
 void syscall_handle_unlink(struct trap_frame *f);
 void syscall_handle_rmdir(struct trap_frame *f);
+void syscall_handle_fsync(struct trap_frame *f);
+void syscall_handle_sync(struct trap_frame *f);
 void syscall_handle_gettime(struct trap_frame *f);
+void syscall_handle_sleep_ns(struct trap_frame *f);
 void syscall_handle_fork(struct trap_frame *f);
 void syscall_handle_exec(struct trap_frame *f);
 void syscall_handle_dup2(struct trap_frame *f);
 void syscall_handle_execv(struct trap_frame *f);
 void syscall_handle_getargs(struct trap_frame *f);
 void syscall_handle_getcwd(struct trap_frame *f);
-void syscall_handle_chdir(struct trap_frame *f);
\ No newline at end of file
+void syscall_handle_chdir(struct trap_frame *f);
+void syscall_handle_nice(struct trap_frame *f);
\ No newline at end of file
@@ -1,16 +1,6 @@
 #include "syscall_internal.h"
 #include "process.h"
 
-#define SSTATUS_SUM (1u << 18)
-
-extern struct process *current_proc;
-
-static void write_user_int(int *user_ptr, int value) {
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
-    *user_ptr = value;
-    WRITE_CSR(sstatus, sstatus);
-}
 
 void syscall_handle_ipc_send(struct trap_frame *f) {
     int dst_pid = (int) f->a0;
@@ -41,7 +31,7 @@ void syscall_handle_ipc_recv(struct trap_frame *f) {
     }
 
     if (from_pid_ptr) {
-        write_user_int(from_pid_ptr, from_pid);
+        *from_pid_ptr = from_pid;
     }
 
     f->a0 = (int) message;
@@ -1,110 +1,9 @@
 #include "syscall_internal.h"
 #include "syscall.h"
-#include "user_apps.h"
 #include "process.h"
 #include "kernel.h"
 #include "commonlibs.h"
 
-extern struct process *current_proc;
-extern struct process *init_proc;
-
-// apps address
-extern char _binary___bin_shell_bin_start[], _binary___bin_shell_bin_size[];        // shell
-extern char _binary___bin_ipc_rx_bin_start[], _binary___bin_ipc_rx_bin_size[];      // ipc_rx
-extern char _binary___bin_ps_bin_start[], _binary___bin_ps_bin_size[];              // ps
-extern char _binary___bin_date_bin_start[], _binary___bin_date_bin_size[];          // date
-extern char _binary___bin_ls_bin_start[], _binary___bin_ls_bin_size[];              // ls
-extern char _binary___bin_mkdir_bin_start[], _binary___bin_mkdir_bin_size[];        // mkdir
-extern char _binary___bin_rmdir_bin_start[], _binary___bin_rmdir_bin_size[];        // rmdir
-extern char _binary___bin_touch_bin_start[], _binary___bin_touch_bin_size[];        // touch
-extern char _binary___bin_rm_bin_start[], _binary___bin_rm_bin_size[];              // rm
-extern char _binary___bin_write_bin_start[], _binary___bin_write_bin_size[];        // write
-extern char _binary___bin_cat_bin_start[], _binary___bin_cat_bin_size[];            // cat
-extern char _binary___bin_kill_bin_start[], _binary___bin_kill_bin_size[];          // kill
-extern char _binary___bin_kernel_info_bin_start[], _binary___bin_kernel_info_bin_size[]; // kernel_info
-extern char _binary___bin_bitmap_bin_start[], _binary___bin_bitmap_bin_size[];      // bitmap
-
-static int resolve_app_image(int app_id, const void **image_out, size_t *size_out, const char **name_out) {
-    if (!image_out || !size_out || !name_out) {
-        return -1;
-    }
-
-    switch (app_id) {
-        case APP_ID_SHELL:
-            *image_out = _binary___bin_shell_bin_start;
-            *size_out = (size_t) _binary___bin_shell_bin_size;
-            *name_out = APP_NAME_SHELL;
-            return 0;
-        case APP_ID_IPC_RX:
-            *image_out = _binary___bin_ipc_rx_bin_start;
-            *size_out = (size_t) _binary___bin_ipc_rx_bin_size;
-            *name_out = APP_NAME_IPC_RX;
-            return 0;
-        case APP_ID_PS:
-            *image_out = _binary___bin_ps_bin_start;
-            *size_out = (size_t) _binary___bin_ps_bin_size;
-            *name_out = APP_NAME_PS;
-            return 0;
-        case APP_ID_DATE:
-            *image_out = _binary___bin_date_bin_start;
-            *size_out = (size_t) _binary___bin_date_bin_size;
-            *name_out = APP_NAME_DATE;
-            return 0;
-        case APP_ID_LS:
-            *image_out = _binary___bin_ls_bin_start;
-            *size_out = (size_t) _binary___bin_ls_bin_size;
-            *name_out = APP_NAME_LS;
-            return 0;
-        case APP_ID_MKDIR:
-            *image_out = _binary___bin_mkdir_bin_start;
-            *size_out = (size_t) _binary___bin_mkdir_bin_size;
-            *name_out = APP_NAME_MKDIR;
-            return 0;
-        case APP_ID_RMDIR:
-            *image_out = _binary___bin_rmdir_bin_start;
-            *size_out = (size_t) _binary___bin_rmdir_bin_size;
-            *name_out = APP_NAME_RMDIR;
-            return 0;
-        case APP_ID_TOUCH:
-            *image_out = _binary___bin_touch_bin_start;
-            *size_out = (size_t) _binary___bin_touch_bin_size;
-            *name_out = APP_NAME_TOUCH;
-            return 0;
-        case APP_ID_RM:
-            *image_out = _binary___bin_rm_bin_start;
-            *size_out = (size_t) _binary___bin_rm_bin_size;
-            *name_out = APP_NAME_RM;
-            return 0;
-        case APP_ID_WRITE:
-            *image_out = _binary___bin_write_bin_start;
-            *size_out = (size_t) _binary___bin_write_bin_size;
-            *name_out = APP_NAME_WRITE;
-            return 0;
-        case APP_ID_CAT:
-            *image_out = _binary___bin_cat_bin_start;
-            *size_out = (size_t) _binary___bin_cat_bin_size;
-            *name_out = APP_NAME_CAT;
-            return 0;
-        case APP_ID_KILL:
-            *image_out = _binary___bin_kill_bin_start;
-            *size_out = (size_t) _binary___bin_kill_bin_size;
-            *name_out = APP_NAME_KILL;
-            return 0;
-        case APP_ID_KERNEL_INFO:
-            *image_out = _binary___bin_kernel_info_bin_start;
-            *size_out = (size_t) _binary___bin_kernel_info_bin_size;
-            *name_out = APP_NAME_KERNEL_INFO;
-            return 0;
-        case APP_ID_BITMAP:
-            *image_out = _binary___bin_bitmap_bin_start;
-            *size_out = (size_t) _binary___bin_bitmap_bin_size;
-            *name_out = APP_NAME_BITMAP;
-            return 0;
-        default:
-            return -1;
-    }
-}
-
 
 static int copy_user_argv(const char *const *uargv,
                           int *argc_out,
@@ -151,9 +50,6 @@ static void write_user_ps_info(struct ps_info *user_ptr, const struct process *p
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
-
     user_ptr->pid = proc->pid;
     user_ptr->parent_pid = proc->parent_pid;
     user_ptr->state = proc->state;
@@ -161,33 +57,14 @@ static void write_user_ps_info(struct ps_info *user_ptr, const struct process *p
     for (int i = 0; i < PROC_NAME_MAX; i++) {
         user_ptr->name[i] = proc->name[i];
     }
-
-    WRITE_CSR(sstatus, sstatus);
+    user_ptr->priority = proc->sched_level;
+    user_ptr->nice = proc->nice;
+    user_ptr->wait_ticks = proc->wait_ticks;
 }
 
 void syscall_handle_exit(struct trap_frame *f) {
     (void) f;
-
-    // Treat pid=1 as init process. When init exits, shut down kernel.
-    if (current_proc && current_proc == init_proc) {
-        current_proc->state = PROC_EXITED;
-        current_proc->wait_reason = PROC_WAIT_NONE;
-        current_proc->wait_pid = -1;
-        if (procfs_sync_process(current_proc) < 0) {
-            printf("procfs sync failed\n");
-        }
-        kernel_shutdown();
-    }
-
-    orphan_children(current_proc->pid);
-    current_proc->state = PROC_EXITED;
-    current_proc->wait_reason = PROC_WAIT_NONE;
-    current_proc->wait_pid = -1;
-    if (procfs_sync_process(current_proc) < 0) {
-        printf("procfs sync failed\n");
-    }
-    notify_child_exit(current_proc);
-    yield();
+    process_exit();
 }
 
 void syscall_handle_ps(struct trap_frame *f) {
@@ -204,15 +81,13 @@ void syscall_handle_ps(struct trap_frame *f) {
 }
 
 void syscall_handle_clone(struct trap_frame *f) {
-    const void *image = NULL;
-    size_t image_size = 0;
-    const char *name = NULL;
-    if (resolve_app_image((int) f->a0, &image, &image_size, &name) < 0) {
+    const struct app_image *image = app_image_lookup((int) f->a0);
+    if (!image) {
         f->a0 = -1;
         return;
     }
 
-    struct process *proc = create_process(image, image_size, name);
+    struct process *proc = create_process(image, image->name);
     if (proc == NULL) {
         f->a0 = -1;
         return;
@@ -235,6 +110,10 @@ void syscall_handle_kill(struct trap_frame *f) {
     f->a0 = process_kill((int) f->a0);
 }
 
+void syscall_handle_nice(struct trap_frame *f) {
+    f->a0 = process_set_nice((int) f->a0, (int) f->a1);
+}
+
 void syscall_handle_fork(struct trap_frame *f) {
     int child_pid = process_fork(f);
     if (child_pid < 0) {
@@ -245,39 +124,32 @@ void syscall_handle_fork(struct trap_frame *f) {
 }
 
 void syscall_handle_exec(struct trap_frame *f) {
-    const void *image = NULL;
-    size_t image_size = 0;
-    const char *name = NULL;
-    if (resolve_app_image((int) f->a0, &image, &image_size, &name) < 0) {
+    const struct app_image *image = app_image_lookup((int) f->a0);
+    if (!image) {
         f->a0 = -1;
         return;
     }
 
-    int ret = process_exec(image, image_size, name, 0, NULL);
+    int ret = process_exec(image, 0, NULL);
     f->a0 = (ret < 0) ? -1 : 0;
 }
 
 void syscall_handle_execv(struct trap_frame *f) {
-    const void *image = NULL;
-    size_t image_size = 0;
-    const char *name = NULL;
-    if (resolve_app_image((int) f->a0, &image, &image_size, &name) < 0) {
+    const struct app_image *image = app_image_lookup((int) f->a0);
+    if (!image) {
         f->a0 = -1;
         return;
     }
 
     int argc = 0;
     char argv[PROC_EXEC_ARGV_MAX][PROC_EXEC_ARG_LEN];
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
     int cret = copy_user_argv((const char *const *) f->a1, &argc, argv);
-    WRITE_CSR(sstatus, sstatus);
     if (cret < 0) {
         f->a0 = -1;
         return;
     }
 
-    int ret = process_exec(image, image_size, name, argc, argv);
+    int ret = process_exec(image, argc, argv);
     f->a0 = (ret < 0) ? -1 : 0;
 }
 
@@ -288,14 +160,11 @@ void syscall_handle_getargs(struct trap_frame *f) {
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
     out->argc = current_proc->exec_argc;
     for (int i = 0; i < PROC_EXEC_ARGV_MAX; i++) {
         for (int j = 0; j < PROC_EXEC_ARG_LEN; j++) {
             out->argv[i][j] = current_proc->exec_argv[i][j];
         }
     }
-    WRITE_CSR(sstatus, sstatus);
     f->a0 = 0;
 }
@@ -1,5 +1,7 @@
 #include "kernel.h"
 #include "rtc.h"
+#include "timer.h"
+#include "process.h"
 
 static uint64_t udiv64_32_full(uint64_t n, uint32_t d, uint32_t *rem_out) {
     uint64_t q = 0;
@@ -25,14 +27,9 @@ static void write_user_time_info(struct time_spec *user_ptr, uint64_t sec, uint3
         return;
     }
 
-    uint32_t sstatus = READ_CSR(sstatus);
-    WRITE_CSR(sstatus, sstatus | SSTATUS_SUM);
-
     user_ptr->sec_lo = (uint32_t) sec;
     user_ptr->sec_hi = (uint32_t) (sec >> 32);
     user_ptr->nsec = nsec;
-
-    WRITE_CSR(sstatus, sstatus);
 }
 
 void syscall_handle_gettime(struct trap_frame *f) {
@@ -42,3 +39,20 @@ void syscall_handle_gettime(struct trap_frame *f) {
     write_user_time_info(info_ptr, sec, nsec);
     f->a0 = 0;
 }
+
+// a0/a1: duration in ns (low/high). Rounded up to whole timer counts; 0 just yields.
+void syscall_handle_sleep_ns(struct trap_frame *f) {
+    uint64_t ns = ((uint64_t) f->a1 << 32) | f->a0;
+    uint32_t rem = 0;
+    uint64_t counts = udiv64_32_full(ns, TIMER_NS_PER_COUNT, &rem);
+    if (rem != 0) {
+        counts++;
+    }
+
+    if (counts == 0) {
+        yield();
+    } else {
+        process_sleep_until(timer_now() + counts);
+    }
+    f->a0 = 0;
+}
@@ -1,26 +1,30 @@
 #include "kernel.h"
 #include "timer.h"
 #include "process.h"
+#include "cpu.h"
+#include "plic.h"
 #include "stdtypes.h"
 #include "commonlibs.h"
 #include "syscall.h"
+#include "syscall_internal.h"
 
-extern struct process *current_proc;
 
 
 void handle_trap(struct trap_frame *f) {
     uint32_t scause  = READ_CSR(scause);
+    // Non-blocking syscalls skip the generic path entirely.
+    if (scause == SCAUSE_ENVIRONMENT_CALL_FROM_U_MODE && handle_syscall_fast(f)) {
+        return;
+    }
+
     uint32_t stval   = READ_CSR(stval);
     uint32_t user_pc = READ_CSR(sepc);
     uint32_t sstatus = READ_CSR(sstatus);
     bool from_user = (sstatus & (1u << 8)) == 0;
-    struct process *owner = NULL;
 
-    if (from_user) {
-        owner = process_from_trap_frame(f);
-        if (owner) {
-            current_proc = owner;
-        }
+    // kernel_entry took tp from sscratch, so this_cpu() is valid for traps from U-mode too.
+    if (from_user && (!current_proc || current_proc->cpu != this_cpu())) {
+        PANIC("trap from user without a running process. scause=%x, sepc=%x\n", scause, user_pc);
     }
 
     switch (scause) {
@@ -58,17 +62,8 @@ void handle_trap(struct trap_frame *f) {
 
         // environment call from U-Mode
         case SCAUSE_ENVIRONMENT_CALL_FROM_U_MODE:
-            {
-                uint32_t sysno = f->a3;
-                handle_syscall(f);
-                // exec/execv succeeds with f->a0 == 0.
-                // In that case, restart from the new image entry point.
-                if ((sysno == SYSCALL_EXEC || sysno == SYSCALL_EXECV) && f->a0 == 0) {
-                    user_pc = USER_BASE;
-                } else {
-                    user_pc += 4;
-                }
-            }
+            // Past the ecall, or the new image entry after a successful exec.
+            user_pc = handle_syscall(f, user_pc);
             break;
 
         // environment call from S-Mode
@@ -77,39 +72,65 @@ void handle_trap(struct trap_frame *f) {
 
         // instruction page fault
         case SCAUSE_INSTRUCTION_PAGE_FAULT:
+            // Demand-load the image page; sepc is left as-is to retry the access.
+            if (process_handle_page_fault(current_proc, scause, stval) == 0) {
+                break;
+            }
             PANIC("Instruction page fault. scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
 
         // load page fault
         case SCAUSE_LOAD_PAGE_FAULT:
+            if (process_handle_page_fault(current_proc, scause, stval) == 0) {
+                break;
+            }
             PANIC("Load page fault. scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
 
         // store/ANO page fault
         case SCAUSE_STORE_AMO_PAGE_FAULT:
+            // Not-yet-loaded pages, or copy-on-write pages shared by fork().
+            if (process_handle_page_fault(current_proc, scause, stval) == 0) {
+                break;
+            }
             PANIC("Store/AMO page fault. scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
 
         // timer interrupt
         case SCAUSE_SUPERVISOR_TIMER:
-            timer_set_next();
             poll_console_input();
+            scheduler_expire_timers();
             scheduler_on_timer_tick();
-            if (scheduler_should_yield()) {
+            scheduler_program_timer();
+            // From the idle loop's wfi window the idle loop itself picks the next process.
+            if (from_user && scheduler_should_yield()) {
                 yield();
             }
-            if (current_proc && current_proc->pid > 0) {
-                WRITE_CSR(sscratch, (uint32_t) &current_proc->stack[sizeof(current_proc->stack)]);
-            } else if (owner) {
-                WRITE_CSR(sscratch, (uint32_t) &owner->stack[sizeof(owner->stack)]);
+            // Another process may have trapped meanwhile: sepc is restored below.
+            break;
+
+        // inter-processor interrupt: new work, a pending kill or a new timer deadline
+        case SCAUSE_SUPERVISOR_SOFTWARE:
+            clear_ipi();
+            scheduler_program_timer();
+            if (from_user && scheduler_should_yield()) {
+                yield();
+            }
+            break;
+
+        // device interrupt routed by the PLIC (UART, virtio-blk completions)
+        case SCAUSE_SUPERVISOR_EXTERNAL:
+            plic_handle_irq();
+            if (from_user && scheduler_should_yield()) {
+                yield();
             }
-            return;
+            break;
 
         default:
             PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
     }
 
-    if (current_proc && current_proc->pid > 0) {
-        WRITE_CSR(sscratch, (uint32_t) &current_proc->stack[sizeof(current_proc->stack)]);
-    } else if (owner) {
-        WRITE_CSR(sscratch, (uint32_t) &owner->stack[sizeof(owner->stack)]);
+    // kill from another hart takes effect before returning to user mode
+    if (from_user) {
+        process_exit_if_killed();
     }
+
     WRITE_CSR(sepc, user_pc);
 }
@@ -26,7 +26,8 @@ int main(int argc, char **argv) {
     printf("ramfs size max: %d bytes\n", info.ramfs_size_max);
     printf("pfs blk count : %d\n", info.pfs_block_count);
     printf("pfs blk size  : %d bytes\n", info.pfs_block_size);
-    printf("pfs img blks  : %d\n", info.pfs_image_blocks);
-    printf("pfs img bytes : %d\n", info.pfs_image_bytes);
+    printf("pfs used blks : %d\n", info.pfs_used_blocks);
+    printf("pfs used bytes: %d\n", info.pfs_used_bytes);
+    printf("cpus          : %d\n", info.cpu_count);
     return 0;
 }
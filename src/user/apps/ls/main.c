@@ -41,7 +41,7 @@ int main(int argc, char **argv) {
         path_arg = argv[2];
     }
 
-    if (user_path_resolve(path_arg, path, sizeof(path)) < 0) {
+    if (user_path_arg(path_arg, path, sizeof(path)) < 0) {
         printf("resolve path failed\n");
         return -1;
     }
@@ -10,7 +10,7 @@ int main(int argc, char **argv) {
     }
 
     char target[FS_PATH_MAX];
-    if (user_path_resolve(argv[1], target, sizeof(target)) < 0) {
+    if (user_path_arg(argv[1], target, sizeof(target)) < 0) {
         printf("resolve path failed\n");
         return -1;
     }
@@ -0,0 +1,41 @@
+#include "user_syscall.h"
+#include "commonlibs.h"
+
+static int parse_int_local(const char *s, int *out) {
+    int value = 0;
+    if (!s || *s == '\0') {
+        return -1;
+    }
+    while (*s) {
+        if (*s < '0' || *s > '9') {
+            return -1;
+        }
+        value = value * 10 + (*s - '0');
+        s++;
+    }
+    *out = value;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("usage: nice <pid> <nice>  (nice: 0..%d, larger is lower priority)\n", SCHED_NICE_MAX);
+        return -1;
+    }
+
+    int target_pid = 0;
+    int value = 0;
+    if (parse_int_local(argv[1], &target_pid) < 0 || parse_int_local(argv[2], &value) < 0) {
+        printf("invalid argument\n");
+        return -1;
+    }
+
+    int old = nice(target_pid, value);
+    if (old < 0) {
+        printf("pid: %d nice failed\n", target_pid);
+        return -1;
+    }
+
+    printf("pid: %d nice %d -> %d\n", target_pid, old, value);
+    return 0;
+}
@@ -23,6 +23,10 @@ char *proc_wait_reason_to_string(int wait_reason) {
             return "CONSOLE_INPUT";
         case PROC_WAIT_IPC_RECV:
             return "IPC_RECV";
+        case PROC_WAIT_TIMER:
+            return "TIMER";
+        case PROC_WAIT_BLOCK_IO:
+            return "BLOCK_IO";
         case PROC_WAIT_NONE:
             return "";
         default:
@@ -33,7 +37,7 @@ char *proc_wait_reason_to_string(int wait_reason) {
 int main(int argc, char **argv) {
     (void) argc;
     (void) argv;
-    printf("PID\tPPID\tAPP\tSTATE\tREASON\n");
+    printf("PID\tPPID\tAPP\tPRI\tNICE\tWAIT\tSTATE\tREASON\n");
     for (int i = 1;; i++) {
         struct ps_info info;
         int ret = ps(i, &info);
@@ -43,10 +47,13 @@ int main(int argc, char **argv) {
         if (info.state == PROC_UNUSED) {
             continue;
         }
-        printf("%d\t%d\t%s\t%s\t%s\n",
+        printf("%d\t%d\t%s\t%d\t%d\t%d\t%s\t%s\n",
                info.pid,
                info.parent_pid,
                info.name,
+               info.priority,
+               info.nice,
+               (int) info.wait_ticks,
                proc_state_to_string(info.state),
                proc_wait_reason_to_string(info.wait_reason));
     }
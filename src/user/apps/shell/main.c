@@ -26,6 +26,9 @@ static const char *shell_app_names[] = {
     APP_NAME_KILL,
     APP_NAME_KERNEL_INFO,
     APP_NAME_BITMAP,
+    APP_NAME_NICE,
+    APP_NAME_SLEEP,
+    APP_NAME_SYNC,
 };
 
 static int min_int(int a, int b) {
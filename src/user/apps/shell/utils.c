@@ -395,7 +395,7 @@ void history_write(void) {
         return;
     }
 
-    char buf[FS_FILE_MAX_SIZE];
+    static char buf[HISTORY_MAX * CMDLINE_MAX];
     size_t n = history_serialize(buf, sizeof(buf));
     int w = fs_write(fd, buf, (int) n);
     if (w < 0 || (size_t) w != n) {
@@ -454,6 +454,15 @@ static int app_map(const char *name) {
     else if (strcmp(name, APP_NAME_BITMAP) == 0) {
         return APP_ID_BITMAP;
     }
+    else if (strcmp(name, APP_NAME_NICE) == 0) {
+        return APP_ID_NICE;
+    }
+    else if (strcmp(name, APP_NAME_SLEEP) == 0) {
+        return APP_ID_SLEEP;
+    }
+    else if (strcmp(name, APP_NAME_SYNC) == 0) {
+        return APP_ID_SYNC;
+    }
     else {
         return -1;
     }
@@ -0,0 +1,37 @@
+#include "user_syscall.h"
+#include "commonlibs.h"
+
+static int parse_uint_local(const char *s, uint32_t *out) {
+    uint32_t value = 0;
+    if (!s || *s == '\0') {
+        return -1;
+    }
+    while (*s) {
+        if (*s < '0' || *s > '9') {
+            return -1;
+        }
+        value = value * 10 + (uint32_t) (*s - '0');
+        s++;
+    }
+    *out = value;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("usage: sleep <ms>\n");
+        return -1;
+    }
+
+    uint32_t ms = 0;
+    if (parse_uint_local(argv[1], &ms) < 0) {
+        printf("invalid argument\n");
+        return -1;
+    }
+
+    if (sleep_ms(ms) < 0) {
+        printf("sleep failed\n");
+        return -1;
+    }
+    return 0;
+}
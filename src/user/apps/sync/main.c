@@ -0,0 +1,16 @@
+#include "user_syscall.h"
+#include "commonlibs.h"
+
+int main(int argc, char **argv) {
+    (void) argv;
+    if (argc != 1) {
+        printf("usage: sync\n");
+        return -1;
+    }
+
+    if (fs_sync() < 0) {
+        printf("sync failed\n");
+        return -1;
+    }
+    return 0;
+}
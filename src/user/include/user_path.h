@@ -3,4 +3,4 @@
 #include "stdtypes.h"
 
 int user_path_resolve(const char *input_path, char *out_path, size_t out_size);
-
+int user_path_arg(const char *input_path, char *out_path, size_t out_size);
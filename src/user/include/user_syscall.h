@@ -6,6 +6,7 @@
 #include "rtc.h"
 
 void putchar(char ch);
+void stdout_flush(void);
 long getchar(void);
 int ps(int index, struct ps_info *info);
 int clone(int app_id);
@@ -15,6 +16,7 @@ int ipc_send(int pid, int message);
 int ipc_recv(int *from_pid);
 int bitmap(int index);
 int kill(int pid);
+int nice(int pid, int value);
 int kernel_info(struct kernel_info *out);
 int fs_open(const char *path, int flags);
 int fs_close(int fd);
@@ -24,7 +26,11 @@ int fs_mkdir(const char *path);
 int fs_readdir(const char *path, int index, struct fs_dirent *out);
 int fs_unlink(const char *path);
 int fs_rmdir(const char *path);
+int fs_fsync(int fd);
+int fs_sync(void);
 int gettime(struct time_spec *out);
+int sleep_ns(uint64_t ns);
+int sleep_ms(uint32_t ms);
 int fork(void);
 int exec(int app_id);
 int execv(int app_id, const char **argv);
@@ -107,3 +107,39 @@ int user_path_resolve(const char *input_path, char *out_path, size_t out_size) {
     return 0;
 }
 
+// Path argument for a file syscall. The kernel resolves relative paths from the
+// cwd node itself, so one without "." or ".." components is passed through
+// as-is instead of being rebuilt from getcwd(); anything else is normalized.
+int user_path_arg(const char *input_path, char *out_path, size_t out_size) {
+    if (!input_path || !out_path || out_size == 0) {
+        return -1;
+    }
+    if (input_path[0] == '\0' || input_path[0] == '/') {
+        return user_path_resolve(input_path, out_path, out_size);
+    }
+    if (strcmp(input_path, ".") == 0) {
+        strcpy_s(out_path, out_size, input_path);
+        return 0;
+    }
+
+    const char *p = input_path;
+    while (*p) {
+        const char *start = p;
+        while (*p && *p != '/') {
+            p++;
+        }
+        int len = (int) (p - start);
+        if ((len == 1 && start[0] == '.') || (len == 2 && start[0] == '.' && start[1] == '.')) {
+            return user_path_resolve(input_path, out_path, out_size);
+        }
+        while (*p == '/') {
+            p++;
+        }
+    }
+
+    if ((size_t) (p - input_path) >= out_size) {
+        return -1;
+    }
+    strcpy_s(out_path, out_size, input_path);
+    return 0;
+}
@@ -3,6 +3,13 @@
 #include "fs.h"
 #include "rtc.h"
 
+#define STDOUT_BUF_SIZE 256
+
+// stdout is line buffered: flushed on '\n', when full, and before anything that
+// reads stdin, blocks, or replaces/duplicates the process image.
+static char stdout_buf[STDOUT_BUF_SIZE];
+static int stdout_len;
+
 
 int syscall(int sysno, int arg0, int arg1, int arg2) {
     register int a0 __asm__("a0") = arg0;
@@ -19,12 +26,29 @@ int syscall(int sysno, int arg0, int arg1, int arg2) {
 }
 
 
+void stdout_flush(void) {
+    int off = 0;
+    while (off < stdout_len) {
+        int n = syscall(SYSCALL_WRITE, 1, (int) (stdout_buf + off), stdout_len - off);
+        if (n <= 0) {
+            break;
+        }
+        off += n;
+    }
+    stdout_len = 0;
+}
+
+
 void putchar(char ch) {
-    (void) syscall(SYSCALL_WRITE, 1, (int) &ch, 1);
+    stdout_buf[stdout_len++] = ch;
+    if (ch == '\n' || stdout_len == STDOUT_BUF_SIZE) {
+        stdout_flush();
+    }
 }
 
 
 long getchar(void) {
+    stdout_flush();
     char ch = 0;
     int n = syscall(SYSCALL_READ, 0, (int) &ch, 1);
     if (n <= 0) {
@@ -40,6 +64,7 @@ int ps(int index, struct ps_info *info) {
 
 
 int clone(int app_id) {
+    stdout_flush();
     return syscall(SYSCALL_CLONE, app_id, 0, 0);
 }
 
@@ -48,6 +73,7 @@ int spawn(int app_id) {
 }
 
 int waitpid(int pid) {
+    stdout_flush();
     return syscall(SYSCALL_WAITPID, pid, 0, 0);
 }
 
@@ -56,6 +82,7 @@ int ipc_send(int pid, int message) {
 }
 
 int ipc_recv(int *from_pid) {
+    stdout_flush();
     return syscall(SYSCALL_IPC_RECV, (int) from_pid, 0, 0);
 }
 
@@ -64,15 +91,21 @@ int bitmap(int index) {
 }
 
 int kill(int pid) {
+    stdout_flush();     // may be this process
     return syscall(SYSCALL_KILL, pid, 0, 0);
 }
 
+int nice(int pid, int value) {
+    return syscall(SYSCALL_NICE, pid, value, 0);
+}
+
 int kernel_info(struct kernel_info *out) {
     return syscall(SYSCALL_KERNEL_INFO, (int) out, 0, 0);
 }
 
 __attribute__((noreturn))
 void exit(void) {
+    stdout_flush();
     syscall(SYSCALL_EXIT, 0, 0, 0);
     __builtin_unreachable();
 }
@@ -87,10 +120,16 @@ int fs_close(int fd) {
 }
 
 int fs_read(int fd, void *buf, int size) {
+    if (fd == 0) {
+        stdout_flush();
+    }
     return syscall(SYSCALL_READ, fd, (int) buf, size);
 }
 
 int fs_write(int fd, const void *buf, int size) {
+    if (fd == 1) {
+        stdout_flush();
+    }
     return syscall(SYSCALL_WRITE, fd, (int) buf, size);
 }
 
@@ -110,23 +149,50 @@ int fs_rmdir(const char *path) {
     return syscall(SYSCALL_RMDIR, (int) path, 0, 0);
 }
 
+int fs_fsync(int fd) {
+    if (fd == 1) {
+        stdout_flush();
+    }
+    return syscall(SYSCALL_FSYNC, fd, 0, 0);
+}
+
+int fs_sync(void) {
+    stdout_flush();
+    return syscall(SYSCALL_SYNC, 0, 0, 0);
+}
+
 int gettime(struct time_spec *out) {
     return syscall(SYSCALL_GETTIME, (int) out, 0, 0);
 }
 
+int sleep_ns(uint64_t ns) {
+    stdout_flush();
+    return syscall(SYSCALL_SLEEP_NS, (int) (uint32_t) ns, (int) (uint32_t) (ns >> 32), 0);
+}
+
+int sleep_ms(uint32_t ms) {
+    return sleep_ns((uint64_t) ms * 1000000u);
+}
+
 int fork(void) {
+    stdout_flush();
     return syscall(SYSCALL_FORK, 0, 0, 0);
 }
 
 int exec(int app_id) {
+    stdout_flush();
     return syscall(SYSCALL_EXEC, app_id, 0, 0);
 }
 
 int execv(int app_id, const char **argv) {
+    stdout_flush();
     return syscall(SYSCALL_EXECV, app_id, (int) argv, 0);
 }
 
 int dup2(int old_fd, int new_fd) {
+    if (new_fd == 1) {
+        stdout_flush();
+    }
     return syscall(SYSCALL_DUP2, old_fd, new_fd, 0);
 }
 